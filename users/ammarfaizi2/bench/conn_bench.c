@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer connection benchmark
+ *
+ * Opens many idle connections to the server as fast as possible and
+ * reports the connection rate and the server memory per connection.
+ *
+ * The connect() completion rate is bound by the server accept rate
+ * as soon as the listen backlog is full.
+ *
+ * With -c (churn), every connection is reset as soon as it is
+ * established, so the number of connections is not limited by
+ * RLIMIT_NOFILE and the result is the sustained accept rate.
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef _DEFAULT_SOURCE
+#  define _DEFAULT_SOURCE
+#endif
+
+#include <poll.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#define INFLIGHT_CONNECTS	(256u)
+
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+static long read_rss_kib(long pid)
+{
+	FILE *handle;
+	long rss = -1;
+	char path[64];
+	char line[256];
+
+	if (pid <= 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+	handle = fopen(path, "rb");
+	if (handle == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), handle)) {
+		if (!strncmp(line, "VmRSS:", 6)) {
+			rss = strtol(line + 6, NULL, 10);
+			break;
+		}
+	}
+
+	fclose(handle);
+	return rss;
+}
+
+
+static int start_connect(struct sockaddr_in *addr)
+{
+	int fd;
+	int err;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+	if (fd < 0) {
+		err = errno;
+		printf("Error: socket(): %s\n", strerror(err));
+		return -err;
+	}
+
+	if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 &&
+	    errno != EINPROGRESS) {
+		err = errno;
+		printf("Error: connect(): %s\n", strerror(err));
+		close(fd);
+		return -err;
+	}
+
+	return fd;
+}
+
+
+static int finish_connect(int fd)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+
+	if (err)
+		printf("Error: connect(): %s\n", strerror(err));
+
+	return -err;
+}
+
+
+static void reset_close(int fd)
+{
+	struct linger lin = { .l_onoff = 1, .l_linger = 0 };
+
+	/*
+	 * RST instead of FIN, don't leave TIME_WAIT sockets
+	 * behind and run out of ephemeral ports.
+	 */
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+	close(fd);
+}
+
+
+static void raise_fd_limit(void)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int ret = 0;
+	int *fds = NULL;
+	long pid = 0;
+	bool churn = false;
+	long rss_before, rss_after;
+	double start, elapsed, now, lat, lat_sum = 0, lat_max = 0;
+	uint32_t nr_conns, started = 0, done = 0, nr_poll = 0;
+	struct sockaddr_in addr;
+	struct pollfd pfds[INFLIGHT_CONNECTS];
+	double t_start[INFLIGHT_CONNECTS];
+
+	while ((c = getopt(argc, argv, "c")) != -1) {
+		switch (c) {
+		case 'c':
+			churn = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc < 3) {
+usage:
+		printf("Usage: conn_bench [-c] [server_addr] [server_port] "
+		       "[nr_conns] [server_pid]\n");
+		return EINVAL;
+	}
+
+	nr_conns = (uint32_t)strtoul(argv[2], NULL, 10);
+	if (argc > 3)
+		pid = strtol(argv[3], NULL, 10);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)atoi(argv[1]));
+	addr.sin_addr.s_addr = inet_addr(argv[0]);
+
+	if (!churn) {
+		fds = calloc(nr_conns, sizeof(*fds));
+		if (fds == NULL) {
+			printf("Error: calloc(): %s\n", strerror(ENOMEM));
+			return ENOMEM;
+		}
+	}
+
+	raise_fd_limit();
+	rss_before = read_rss_kib(pid);
+	start = now_sec();
+
+	/*
+	 * Keep a window of in-flight connect()s, every slot
+	 * in pfds[] is refilled as soon as it completes.
+	 */
+	while (done < nr_conns) {
+		while (started < nr_conns && nr_poll < INFLIGHT_CONNECTS) {
+			ret = start_connect(&addr);
+			if (ret < 0)
+				goto out;
+			if (!churn)
+				fds[started] = ret;
+			started++;
+			pfds[nr_poll].fd = ret;
+			pfds[nr_poll].events = POLLOUT;
+			pfds[nr_poll].revents = 0;
+			t_start[nr_poll] = now_sec();
+			nr_poll++;
+		}
+
+		ret = poll(pfds, nr_poll, 5000);
+		if (ret <= 0) {
+			ret = ret ? -errno : -ETIMEDOUT;
+			printf("Error: poll(): %s\n", strerror(-ret));
+			goto out;
+		}
+
+		now = now_sec();
+		for (uint32_t i = 0; i < nr_poll;) {
+			if (!pfds[i].revents) {
+				i++;
+				continue;
+			}
+
+			ret = finish_connect(pfds[i].fd);
+			if (ret)
+				goto out;
+
+			lat = now - t_start[i];
+			lat_sum += lat;
+			if (lat > lat_max)
+				lat_max = lat;
+
+			if (churn)
+				reset_close(pfds[i].fd);
+			done++;
+
+			/*
+			 * Fill the hole with the last in-flight slot.
+			 */
+			nr_poll--;
+			pfds[i] = pfds[nr_poll];
+			t_start[i] = t_start[nr_poll];
+		}
+		ret = 0;
+	}
+
+	elapsed = now_sec() - start;
+
+	/*
+	 * Let the server accept the tail of the backlog.
+	 */
+	usleep(500000);
+	rss_after = read_rss_kib(pid);
+
+	printf("connections:   %u%s\n", nr_conns, churn ? " (churn)" : "");
+	printf("elapsed:       %.3f s\n", elapsed);
+	printf("accept_rate:   %.0f conn/s\n", nr_conns / elapsed);
+	printf("connect_lat:   avg %.3f ms, max %.3f ms\n",
+	       lat_sum * 1e3 / nr_conns, lat_max * 1e3);
+	if (!churn && rss_before >= 0 && rss_after >= 0) {
+		printf("server_rss:    %ld KiB -> %ld KiB\n", rss_before,
+		       rss_after);
+		printf("rss_per_conn:  %.2f KiB\n",
+		       (double)(rss_after - rss_before) / nr_conns);
+	}
+
+out:
+	if (churn) {
+		for (uint32_t i = 0; i < nr_poll; i++)
+			reset_close(pfds[i].fd);
+	} else {
+		for (uint32_t i = 0; i < started; i++)
+			close(fds[i]);
+	}
+	free(fds);
+	return -ret;
+}
@@ -0,0 +1,787 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer load generator
+ *
+ * Starts `ftransfer server` on a free loopback port in a scratch
+ * directory and uploads files to it from N concurrent connections.
+ * The file content is generated in memory, so the client side disk
+ * is never the bottleneck. The file sizes are drawn log-uniformly
+ * from [min, max].
+ *
+ * A file is complete when the server closes the connection, it does
+ * that once the last byte has been written. The result goes to
+ * stdout as JSON, everything else goes to stderr.
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "../ftransfer.h"
+
+#define DATA_SIZE		(1u << 20u)	/* Generated content      */
+#define DEFAULT_CLIENTS		(32u)
+#define DEFAULT_FILES		(1000u)
+#define DEFAULT_SIZE_MIN	(1024ull)
+#define DEFAULT_SIZE_MAX	(64ull << 20u)
+#define READY_TIMEOUT		(5.0)		/* Seconds                */
+#define MAX_EVENTS		(64u)
+
+struct conn {
+	int		fd;
+	bool		connected;
+	uint32_t	slot;		/* Also the file name             */
+	uint64_t	total;		/* Header + file size             */
+	uint64_t	sent;
+	double		start;
+	packet_t	hdr;
+};
+
+struct bench {
+	uint32_t	nr_clients;
+	uint64_t	max_files;	/* 0 if only limited by time      */
+	double		max_time;	/* Seconds, 0 if only by files    */
+	uint64_t	size_min;
+	uint64_t	size_max;
+	uint64_t	rng;
+	struct sockaddr_in addr;
+	int		epoll_fd;
+	char		*data;
+	struct conn	*conns;
+
+	uint64_t	started;
+	uint64_t	done;
+	uint64_t	errors;
+	uint64_t	bytes;
+	double		begin;
+	double		*lat;		/* Completion latency, seconds    */
+	uint64_t	nr_lat;
+	uint64_t	cap_lat;
+};
+
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+static uint64_t next_rand(struct bench *b)
+{
+	/*
+	 * xorshift64*, reproducible for a given seed.
+	 */
+	b->rng ^= b->rng >> 12u;
+	b->rng ^= b->rng << 25u;
+	b->rng ^= b->rng >> 27u;
+	return b->rng * 2685821657736338717ull;
+}
+
+
+static uint64_t pick_size(struct bench *b)
+{
+	double lo, hi, u;
+
+	if (b->size_min == b->size_max)
+		return b->size_min;
+
+	lo = log((double)b->size_min);
+	hi = log((double)b->size_max);
+	u  = (double)(next_rand(b) >> 11u) / (double)(1ull << 53u);
+	return (uint64_t)exp(lo + (hi - lo) * u);
+}
+
+
+static int parse_size(const char *str, uint64_t *out)
+{
+	char *end;
+	uint64_t val;
+
+	val = strtoull(str, &end, 10);
+	switch (*end) {
+	case 'G': case 'g':
+		val <<= 10u;
+		/* fallthrough */
+	case 'M': case 'm':
+		val <<= 10u;
+		/* fallthrough */
+	case 'K': case 'k':
+		val <<= 10u;
+		end++;
+		break;
+	}
+
+	if (end == str || (*end != '\0' && *end != ':') || val == 0)
+		return -EINVAL;
+
+	*out = val;
+	return 0;
+}
+
+
+static int parse_size_range(struct bench *b, const char *str)
+{
+	const char *sep = strchr(str, ':');
+
+	if (parse_size(str, &b->size_min))
+		return -EINVAL;
+
+	b->size_max = b->size_min;
+	if (sep && parse_size(sep + 1, &b->size_max))
+		return -EINVAL;
+
+	return b->size_max < b->size_min ? -EINVAL : 0;
+}
+
+
+static int pick_free_port(struct sockaddr_in *addr)
+{
+	int fd;
+	int err = 0;
+	socklen_t len = sizeof(*addr);
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family      = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (bind(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 ||
+	    getsockname(fd, (struct sockaddr *)addr, &len) < 0)
+		err = -errno;
+
+	close(fd);
+	return err;
+}
+
+
+static pid_t spawn_server(const char *bin, const char *dir, const char *log,
+			  uint16_t port, uint32_t nr_clients, int argc,
+			  char *argv[])
+{
+	int fd;
+	pid_t pid;
+	char port_str[8], clients_str[16];
+	char **args;
+	int nr = 0;
+
+	args = calloc((size_t)argc + 8u, sizeof(*args));
+	if (args == NULL)
+		return -ENOMEM;
+
+	snprintf(port_str, sizeof(port_str), "%u", port);
+	snprintf(clients_str, sizeof(clients_str), "%u", nr_clients * 2u);
+	args[nr++] = (char *)bin;
+	args[nr++] = (char *)"server";
+	args[nr++] = (char *)"127.0.0.1";
+	args[nr++] = port_str;
+
+	/*
+	 * Make room for every client. A client reconnects as soon
+	 * as it sees EOF, which may be before the server has freed
+	 * the old channel, hence the headroom. The options given
+	 * after "--" come later and win.
+	 */
+	args[nr++] = (char *)"--max-clients";
+	args[nr++] = clients_str;
+	for (int i = 0; i < argc; i++)
+		args[nr++] = argv[i];
+
+	pid = fork();
+	if (pid != 0) {
+		free(args);
+		return pid < 0 ? -errno : pid;
+	}
+
+	if (chdir(dir) < 0) {
+		fprintf(stderr, "Error: chdir(%s): %s\n", dir, strerror(errno));
+		_exit(127);
+	}
+
+	fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+
+	execv(bin, args);
+	fprintf(stderr, "Error: execv(%s): %s\n", bin, strerror(errno));
+	_exit(127);
+}
+
+
+static int wait_server_ready(struct sockaddr_in *addr, pid_t pid)
+{
+	int fd;
+	int status;
+	double deadline = now_sec() + READY_TIMEOUT;
+	struct timespec ts = { .tv_nsec = 10000000l };
+
+	while (now_sec() < deadline) {
+		if (waitpid(pid, &status, WNOHANG) == pid) {
+			fprintf(stderr, "Error: The server exited early\n");
+			return -ECHILD;
+		}
+
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -errno;
+
+		if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) == 0) {
+			close(fd);
+			return 0;
+		}
+
+		close(fd);
+		nanosleep(&ts, NULL);
+	}
+
+	fprintf(stderr, "Error: The server is not listening\n");
+	return -ETIMEDOUT;
+}
+
+
+/*
+ * utime + stime of every thread, in seconds.
+ */
+static double read_cpu_sec(pid_t pid)
+{
+	FILE *handle;
+	char path[64];
+	char buf[1024];
+	char *p;
+	unsigned long utime, stime;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	handle = fopen(path, "rb");
+	if (handle == NULL)
+		return -1.0;
+
+	p = fgets(buf, sizeof(buf), handle);
+	fclose(handle);
+	if (p == NULL || (p = strrchr(buf, ')')) == NULL)
+		return -1.0;
+
+	/*
+	 * utime and stime are the 14th and 15th fields, the
+	 * 3rd one follows the ')' of the command name.
+	 */
+	if (sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		   &utime, &stime) != 2)
+		return -1.0;
+
+	return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+
+static long read_peak_rss_kib(pid_t pid)
+{
+	FILE *handle;
+	long rss = -1;
+	char path[64];
+	char line[256];
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	handle = fopen(path, "rb");
+	if (handle == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), handle)) {
+		if (!strncmp(line, "VmHWM:", 6)) {
+			rss = strtol(line + 6, NULL, 10);
+			break;
+		}
+	}
+
+	fclose(handle);
+	return rss;
+}
+
+
+static bool want_more(struct bench *b)
+{
+	if (b->max_files && b->started >= b->max_files)
+		return false;
+	if (b->max_time > 0 && now_sec() - b->begin >= b->max_time)
+		return false;
+	return true;
+}
+
+
+static int start_file(struct bench *b, struct conn *c)
+{
+	int fd;
+	int err;
+	uint64_t size;
+	struct epoll_event ev;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		err = errno;
+		fprintf(stderr, "Error: socket(): %s\n", strerror(err));
+		return -err;
+	}
+
+	c->start = now_sec();
+	if (connect(fd, (struct sockaddr *)&b->addr, sizeof(b->addr)) < 0 &&
+	    errno != EINPROGRESS) {
+		err = errno;
+		fprintf(stderr, "Error: connect(): %s\n", strerror(err));
+		close(fd);
+		return -err;
+	}
+
+	size = pick_size(b);
+	memset(&c->hdr, 0, sizeof(c->hdr));
+	c->hdr.file_size     = htobe64(size);
+	c->hdr.file_name_len = (uint8_t)snprintf(c->hdr.file_name,
+						 sizeof(c->hdr.file_name),
+						 "bench_%u.bin", c->slot);
+	c->fd        = fd;
+	c->connected = false;
+	c->total     = sizeof(c->hdr) + size;
+	c->sent      = 0;
+
+	ev.events   = EPOLLOUT;
+	ev.data.ptr = c;
+	if (epoll_ctl(b->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		err = errno;
+		fprintf(stderr, "Error: epoll_ctl(): %s\n", strerror(err));
+		close(fd);
+		c->fd = -1;
+		return -err;
+	}
+
+	b->started++;
+	return 0;
+}
+
+
+static int record_latency(struct bench *b, double lat)
+{
+	uint64_t cap;
+	double *tmp;
+
+	if (b->nr_lat == b->cap_lat) {
+		cap = b->cap_lat ? b->cap_lat * 2u : 4096u;
+		tmp = realloc(b->lat, cap * sizeof(*tmp));
+		if (tmp == NULL)
+			return -ENOMEM;
+		b->lat     = tmp;
+		b->cap_lat = cap;
+	}
+
+	b->lat[b->nr_lat++] = lat;
+	return 0;
+}
+
+
+static void end_file(struct bench *b, struct conn *c, bool ok)
+{
+	close(c->fd);
+	c->fd = -1;
+
+	if (ok) {
+		b->done++;
+		b->bytes += c->total - sizeof(c->hdr);
+		if (record_latency(b, now_sec() - c->start))
+			b->errors++;
+	} else {
+		b->errors++;
+	}
+
+	if (want_more(b) && start_file(b, c))
+		b->errors++;
+}
+
+
+/*
+ * Returns true when everything has been sent.
+ */
+static bool send_more(struct bench *b, struct conn *c, bool *err)
+{
+	ssize_t ret;
+	size_t len, pos;
+	const char *buf;
+
+	while (c->sent < c->total) {
+		if (c->sent < sizeof(c->hdr)) {
+			buf = (const char *)&c->hdr + c->sent;
+			len = sizeof(c->hdr) - (size_t)c->sent;
+		} else {
+			/*
+			 * Cycle through the generated content.
+			 */
+			pos = (size_t)((c->sent - sizeof(c->hdr)) % DATA_SIZE);
+			buf = b->data + pos;
+			len = DATA_SIZE - pos;
+			if (len > c->total - c->sent)
+				len = (size_t)(c->total - c->sent);
+		}
+
+		ret = send(c->fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				return false;
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error: send(): %s\n", strerror(errno));
+			*err = true;
+			return false;
+		}
+		c->sent += (uint64_t)ret;
+	}
+
+	return true;
+}
+
+
+static void handle_conn(struct bench *b, struct conn *c, uint32_t events)
+{
+	int soerr = 0;
+	char buf[64];
+	ssize_t ret;
+	bool err = false;
+	socklen_t len = sizeof(soerr);
+	struct epoll_event ev;
+
+	if (!c->connected) {
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &soerr, &len);
+		if (soerr) {
+			fprintf(stderr, "Error: connect(): %s\n", strerror(soerr));
+			end_file(b, c, false);
+			return;
+		}
+		c->connected = true;
+	}
+
+	if (c->sent < c->total) {
+		if (!send_more(b, c, &err)) {
+			if (err)
+				end_file(b, c, false);
+			return;
+		}
+
+		/*
+		 * Everything is sent, wait for the server to
+		 * close the connection.
+		 */
+		ev.events   = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = c;
+		epoll_ctl(b->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+		return;
+	}
+
+	if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+		return;
+
+	ret = recv(c->fd, buf, sizeof(buf), 0);
+	if (ret < 0 && errno == EAGAIN)
+		return;
+
+	/*
+	 * The server has nothing to say, EOF (or a reset
+	 * after the last byte) means the file is done.
+	 */
+	end_file(b, c, ret == 0 || (ret < 0 && errno == ECONNRESET));
+}
+
+
+static int run_load(struct bench *b)
+{
+	int nr;
+	struct epoll_event events[MAX_EVENTS];
+
+	b->begin = now_sec();
+	for (uint32_t i = 0; i < b->nr_clients && want_more(b); i++) {
+		if (start_file(b, &b->conns[i]))
+			return -EIO;
+	}
+
+	while (b->done + b->errors < b->started) {
+		nr = epoll_wait(b->epoll_fd, events, MAX_EVENTS, 1000);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error: epoll_wait(): %s\n",
+				strerror(errno));
+			return -errno;
+		}
+
+		for (int i = 0; i < nr; i++)
+			handle_conn(b, events[i].data.ptr, events[i].events);
+	}
+
+	return 0;
+}
+
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+static double percentile(const double *sorted, uint64_t nr, double pct)
+{
+	uint64_t idx;
+
+	if (nr == 0)
+		return 0.0;
+
+	idx = (uint64_t)ceil(pct / 100.0 * (double)nr);
+	if (idx > 0)
+		idx--;
+	return sorted[idx < nr ? idx : nr - 1u];
+}
+
+
+static void print_json(struct bench *b, double elapsed, double cpu,
+		       long peak_rss)
+{
+	qsort(b->lat, b->nr_lat, sizeof(*b->lat), cmp_double);
+
+	printf("{\n");
+	printf("  \"clients\": %u,\n", b->nr_clients);
+	printf("  \"size_min\": %" PRIu64 ",\n", b->size_min);
+	printf("  \"size_max\": %" PRIu64 ",\n", b->size_max);
+	printf("  \"files\": %" PRIu64 ",\n", b->done);
+	printf("  \"errors\": %" PRIu64 ",\n", b->errors);
+	printf("  \"bytes\": %" PRIu64 ",\n", b->bytes);
+	printf("  \"elapsed_s\": %.3f,\n", elapsed);
+	printf("  \"gb_per_s\": %.3f,\n", (double)b->bytes / 1e9 / elapsed);
+	printf("  \"files_per_s\": %.1f,\n", (double)b->done / elapsed);
+	printf("  \"latency_ms\": { \"p50\": %.3f, \"p99\": %.3f, "
+	       "\"p999\": %.3f, \"max\": %.3f },\n",
+	       percentile(b->lat, b->nr_lat, 50.0) * 1e3,
+	       percentile(b->lat, b->nr_lat, 99.0) * 1e3,
+	       percentile(b->lat, b->nr_lat, 99.9) * 1e3,
+	       percentile(b->lat, b->nr_lat, 100.0) * 1e3);
+	printf("  \"server_cpu_pct\": %.1f,\n", cpu / elapsed * 100.0);
+	printf("  \"server_peak_rss_kib\": %ld\n", peak_rss);
+	printf("}\n");
+}
+
+
+static void cleanup_dir(const char *dir, uint32_t nr_clients, bool keep_log)
+{
+	char path[PATH_MAX];
+
+	for (uint32_t i = 0; i < nr_clients; i++) {
+		snprintf(path, sizeof(path), "%s/uploaded_files/bench_%u.bin",
+			 dir, i);
+		unlink(path);
+	}
+
+	snprintf(path, sizeof(path), "%s/uploaded_files", dir);
+	rmdir(path);
+	if (!keep_log) {
+		snprintf(path, sizeof(path), "%s/server.log", dir);
+		unlink(path);
+		rmdir(dir);
+	}
+}
+
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: load_bench [-c clients] [-n files] [-t seconds]\n"
+		"                  [-s min[:max]] [-b ftransfer] [-r seed] [-k]\n"
+		"                  [-- server options]\n"
+		"\n"
+		"  -c  Concurrent connections (default: %u)\n"
+		"  -n  Files to upload, 0 for no limit (default: %u)\n"
+		"  -t  Stop starting new files after this many seconds\n"
+		"  -s  File size or log-uniform size range, K/M/G suffixes\n"
+		"      (default: 1K:64M)\n"
+		"  -b  Server binary (default: ./ftransfer)\n"
+		"  -r  Random seed (default: 1)\n"
+		"  -k  Keep the scratch directory with the server log\n",
+		DEFAULT_CLIENTS, DEFAULT_FILES);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int ret = 0;
+	int status;
+	pid_t pid;
+	bool keep = false;
+	const char *bin = "./ftransfer";
+	char bin_path[PATH_MAX];
+	char dir[] = "/tmp/ftransfer_bench.XXXXXX";
+	char path[PATH_MAX];
+	double elapsed, cpu_start, cpu_end;
+	long peak_rss;
+	struct bench b;
+
+	memset(&b, 0, sizeof(b));
+	b.nr_clients = DEFAULT_CLIENTS;
+	b.max_files  = DEFAULT_FILES;
+	b.size_min   = DEFAULT_SIZE_MIN;
+	b.size_max   = DEFAULT_SIZE_MAX;
+	b.rng        = 1;
+	b.epoll_fd   = -1;
+
+	while ((c = getopt(argc, argv, "c:n:t:s:b:r:k")) != -1) {
+		switch (c) {
+		case 'c':
+			b.nr_clients = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			b.max_files = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			b.max_time = strtod(optarg, NULL);
+			break;
+		case 's':
+			if (parse_size_range(&b, optarg)) {
+				fprintf(stderr, "Error: Invalid size \"%s\"\n",
+					optarg);
+				return EINVAL;
+			}
+			break;
+		case 'b':
+			bin = optarg;
+			break;
+		case 'r':
+			b.rng = strtoull(optarg, NULL, 10) | 1u;
+			break;
+		case 'k':
+			keep = true;
+			break;
+		default:
+			usage();
+			return EINVAL;
+		}
+	}
+
+	if (b.nr_clients == 0 || (b.max_files == 0 && b.max_time <= 0)) {
+		usage();
+		return EINVAL;
+	}
+
+	if (realpath(bin, bin_path) == NULL) {
+		fprintf(stderr, "Error: %s: %s\n", bin, strerror(errno));
+		return ENOENT;
+	}
+
+	b.conns = calloc(b.nr_clients, sizeof(*b.conns));
+	b.data  = malloc(DATA_SIZE);
+	if (b.conns == NULL || b.data == NULL) {
+		fprintf(stderr, "Error: malloc(): %s\n", strerror(ENOMEM));
+		return ENOMEM;
+	}
+
+	for (uint32_t i = 0; i < DATA_SIZE; i += sizeof(uint64_t)) {
+		uint64_t r = next_rand(&b);
+		memcpy(b.data + i, &r, sizeof(r));
+	}
+
+	for (uint32_t i = 0; i < b.nr_clients; i++) {
+		b.conns[i].fd   = -1;
+		b.conns[i].slot = i;
+	}
+
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "Error: mkdtemp(): %s\n", strerror(errno));
+		return errno;
+	}
+
+	snprintf(path, sizeof(path), "%s/uploaded_files", dir);
+	mkdir(path, 0755);
+
+	ret = pick_free_port(&b.addr);
+	if (ret) {
+		fprintf(stderr, "Error: bind(): %s\n", strerror(-ret));
+		goto out_dir;
+	}
+
+	snprintf(path, sizeof(path), "%s/server.log", dir);
+	pid = spawn_server(bin_path, dir, path, ntohs(b.addr.sin_port),
+			   b.nr_clients, argc - optind, argv + optind);
+	if (pid < 0) {
+		ret = (int)pid;
+		fprintf(stderr, "Error: fork(): %s\n", strerror(-ret));
+		goto out_dir;
+	}
+
+	ret = wait_server_ready(&b.addr, pid);
+	if (ret)
+		goto out_kill;
+
+	b.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (b.epoll_fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "Error: epoll_create1(): %s\n", strerror(-ret));
+		goto out_kill;
+	}
+
+	fprintf(stderr, "Running %u clients against %s (pid %d), "
+		"scratch dir %s\n", b.nr_clients, bin, (int)pid, dir);
+
+	cpu_start = read_cpu_sec(pid);
+	ret = run_load(&b);
+	elapsed = now_sec() - b.begin;
+	cpu_end = read_cpu_sec(pid);
+	peak_rss = read_peak_rss_kib(pid);
+	if (ret == 0)
+		print_json(&b, elapsed, cpu_end - cpu_start, peak_rss);
+
+out_kill:
+	kill(pid, SIGINT);
+	if (waitpid(pid, &status, 0) == pid &&
+	    !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+		fprintf(stderr, "Error: The server exited abnormally\n");
+		if (ret == 0)
+			ret = -ECHILD;
+	}
+out_dir:
+	cleanup_dir(dir, b.nr_clients, keep);
+	if (keep)
+		fprintf(stderr, "Server log: %s/server.log\n", dir);
+
+	for (uint32_t i = 0; i < b.nr_clients; i++) {
+		if (b.conns[i].fd != -1)
+			close(b.conns[i].fd);
+	}
+	if (b.epoll_fd != -1)
+		close(b.epoll_fd);
+	free(b.lat);
+	free(b.data);
+	free(b.conns);
+	return -ret;
+}
@@ -0,0 +1,486 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer microbenchmarks
+ *
+ * Runs the protocol and buffer hot paths of server.c in a loop,
+ * without sockets or an event loop. Every case grows its
+ * iteration count until one round runs for at least -m seconds,
+ * then reports the time per iteration of that round.
+ *
+ * The buffer cases sweep 4 KiB to 1 MiB at run time. The cases
+ * that go through server.c use the receive buffer size it was
+ * built with, rebuild with `make clean` and
+ * `make bench/micro_bench RECV_BUFFER_SIZE=N` to change it.
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "../server.h"
+
+#define SWEEP_MIN		(0x1000u)	/* 4 KiB                  */
+#define SWEEP_MAX		(0x100000u)	/* 1 MiB                  */
+#define FILE_WRAP		(64ull << 20u)	/* Rewind the output here */
+#define BENCH_FILE		"micro_bench.bin"
+
+struct bench_case;
+typedef void (*bench_fn_t)(struct bench_case *bc, uint64_t iters);
+
+struct bench_case {
+	const char	*name;
+	size_t		arg;		/* Bytes, 0 if none           */
+	bench_fn_t	run;
+};
+
+struct bench_env {
+	struct server_cfg	cfg;
+	struct server_state	state;
+	struct client_channel	chan;
+	union uni_pkt		*pktbuf;
+	char			*buf;		/* SWEEP_MAX bytes            */
+	char			dir[PATH_MAX / 2];
+	char			path[PATH_MAX];	/* BENCH_FILE in dir          */
+	double			min_time;
+	uint64_t		sink;		/* Defeats dead code removal  */
+};
+
+static struct bench_env g_env;
+
+
+/*
+ * The server objects print it on bad options, which never
+ * reach them here. ftransfer.o has the real one.
+ */
+void print_help(void)
+{
+}
+
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+static void die(const char *what, int err)
+{
+	fprintf(stderr, "Error: %s: %s\n", what, strerror(err));
+	exit(1);
+}
+
+
+static void reset_chan(struct client_channel *chan)
+{
+	memset(chan, 0, sizeof(*chan));
+	chan->is_used    = true;
+	chan->cli_fd     = -1;
+	chan->pipe_fd[0] = -1;
+	chan->pipe_fd[1] = -1;
+	chan->pktbuf     = g_env.pktbuf;
+
+	/*
+	 * Known peer, the log macros must not getpeername().
+	 */
+	strcpy(chan->src_ip, "127.0.0.1");
+	chan->src_addr.sin_family = AF_INET;
+}
+
+
+static size_t fill_header(size_t content_len)
+{
+	packet_t *pkt = &g_env.pktbuf->packet;
+	const char name[] = BENCH_FILE;
+
+	/*
+	 * The file is bigger than what is sent, the content
+	 * must never complete it.
+	 */
+	pkt->file_size = htobe64((uint64_t)RECV_BUFFER_SIZE * 4u);
+	pkt->file_name_len = (uint8_t)(sizeof(name) - 1u);
+	memcpy(pkt->file_name, name, sizeof(name));
+	return sizeof(*pkt) + content_len;
+}
+
+
+static void close_chan_file(struct client_channel *chan)
+{
+	if (chan->handle) {
+		fclose(chan->handle);
+		chan->handle = NULL;
+	}
+}
+
+
+static void bench_validate_file_name(struct bench_case *bc, uint64_t iters)
+{
+	char name[256];
+
+	memset(name, 'a', bc->arg);
+	name[bc->arg] = '\0';
+	for (uint64_t i = 0; i < iters; i++) {
+		__asm__ volatile("" : : "r"(name) : "memory");
+		g_env.sink += validate_file_name(name);
+	}
+}
+
+
+/*
+ * Header only: parse, fopen() and truncate the file.
+ */
+static void bench_file_info_header(struct bench_case *bc, uint64_t iters)
+{
+	size_t len;
+	struct client_channel *chan = &g_env.chan;
+
+	(void)bc;
+	for (uint64_t i = 0; i < iters; i++) {
+		reset_chan(chan);
+		len = fill_header(0);
+		if (handle_file_info(&g_env.state, chan, len))
+			die("handle_file_info()", EINVAL);
+		close_chan_file(chan);
+	}
+}
+
+
+/*
+ * Header and content in one full buffer, the content is
+ * moved to the front.
+ */
+static void bench_file_info_compact(struct bench_case *bc, uint64_t iters)
+{
+	size_t len;
+	struct client_channel *chan = &g_env.chan;
+
+	(void)bc;
+	for (uint64_t i = 0; i < iters; i++) {
+		reset_chan(chan);
+		len = fill_header(RECV_BUFFER_SIZE - sizeof(packet_t));
+		if (handle_file_info(&g_env.state, chan, len) != -EAGAIN)
+			die("handle_file_info()", EINVAL);
+		close_chan_file(chan);
+	}
+}
+
+
+/*
+ * The same compaction with only the memmove() left.
+ */
+static void bench_memmove_compact(struct bench_case *bc, uint64_t iters)
+{
+	char *buf = g_env.buf;
+
+	for (uint64_t i = 0; i < iters; i++) {
+		memmove(buf, buf + sizeof(packet_t), bc->arg - sizeof(packet_t));
+		__asm__ volatile("" : : "r"(buf) : "memory");
+	}
+}
+
+
+/*
+ * A new file whose header arrives with content: file info,
+ * -EAGAIN, then the content is written.
+ */
+static void bench_client_data_first(struct bench_case *bc, uint64_t iters)
+{
+	size_t len;
+	struct client_channel *chan = &g_env.chan;
+
+	(void)bc;
+	for (uint64_t i = 0; i < iters; i++) {
+		reset_chan(chan);
+		len = fill_header(RECV_BUFFER_SIZE - sizeof(packet_t));
+		if (handle_client_data(&g_env.state, chan, len))
+			die("handle_client_data()", EINVAL);
+		close_chan_file(chan);
+	}
+}
+
+
+/*
+ * Steady state: a full buffer of content for an open file.
+ */
+static void bench_client_data_content(struct bench_case *bc, uint64_t iters)
+{
+	size_t len;
+	struct client_channel *chan = &g_env.chan;
+
+	(void)bc;
+	reset_chan(chan);
+	len = fill_header(0);
+	if (handle_client_data(&g_env.state, chan, len))
+		die("handle_client_data()", EINVAL);
+
+	for (uint64_t i = 0; i < iters; i++) {
+		if (chan->recv_file_len + RECV_BUFFER_SIZE >= chan->file_size) {
+			rewind(chan->handle);
+			chan->recv_file_len = 0;
+		}
+		if (handle_client_data(&g_env.state, chan, RECV_BUFFER_SIZE))
+			die("handle_client_data()", EINVAL);
+	}
+
+	close_chan_file(chan);
+}
+
+
+static FILE *open_bench_file(int mode)
+{
+	FILE *handle;
+
+	handle = fopen(g_env.path, "wb");
+	if (handle == NULL)
+		die(g_env.path, errno);
+
+	if (mode == _IONBF)
+		setvbuf(handle, NULL, _IONBF, 0);
+	return handle;
+}
+
+
+static void run_fwrite(size_t len, uint64_t iters, int mode)
+{
+	uint64_t off = 0;
+	FILE *handle = open_bench_file(mode);
+
+	for (uint64_t i = 0; i < iters; i++) {
+		if (off >= FILE_WRAP) {
+			rewind(handle);
+			off = 0;
+		}
+		if (fwrite(g_env.buf, 1, len, handle) != len)
+			die("fwrite()", ferror(handle) ? EIO : ENOSPC);
+		off += len;
+	}
+
+	fclose(handle);
+}
+
+
+/*
+ * What the server does, setvbuf(_IONBF).
+ */
+static void bench_fwrite_unbuffered(struct bench_case *bc, uint64_t iters)
+{
+	run_fwrite(bc->arg, iters, _IONBF);
+}
+
+
+/*
+ * The default stdio buffer.
+ */
+static void bench_fwrite_buffered(struct bench_case *bc, uint64_t iters)
+{
+	run_fwrite(bc->arg, iters, _IOFBF);
+}
+
+
+static void bench_write(struct bench_case *bc, uint64_t iters)
+{
+	int fd;
+	ssize_t ret;
+	uint64_t off = 0;
+
+	fd = open(g_env.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		die(g_env.path, errno);
+
+	for (uint64_t i = 0; i < iters; i++) {
+		if (off >= FILE_WRAP) {
+			lseek(fd, 0, SEEK_SET);
+			off = 0;
+		}
+		ret = write(fd, g_env.buf, bc->arg);
+		if (ret != (ssize_t)bc->arg)
+			die("write()", ret < 0 ? errno : ENOSPC);
+		off += bc->arg;
+	}
+
+	close(fd);
+}
+
+
+static void run_case(struct bench_case *bc)
+{
+	char name[64];
+	uint64_t iters = 1;
+	double start, elapsed, ns;
+
+	for (;;) {
+		start = now_sec();
+		bc->run(bc, iters);
+		elapsed = now_sec() - start;
+		if (elapsed >= g_env.min_time || iters >= (1ull << 40u))
+			break;
+
+		/*
+		 * Jump close to the target once the round is long
+		 * enough to be trusted.
+		 */
+		if (elapsed > 0.01)
+			iters = (uint64_t)((double)iters * g_env.min_time /
+					   elapsed * 1.1) + 1u;
+		else
+			iters *= 10u;
+	}
+
+	if (bc->arg)
+		snprintf(name, sizeof(name), "%s/%zu", bc->name, bc->arg);
+	else
+		snprintf(name, sizeof(name), "%s", bc->name);
+
+	ns = elapsed * 1e9 / (double)iters;
+	printf("%-40s %12.1f ns %12" PRIu64, name, ns, iters);
+	if (bc->arg && bc->run != bench_validate_file_name)
+		printf(" %10.1f MB/s", (double)bc->arg * 1e3 / ns);
+	printf("\n");
+	fflush(stdout);
+}
+
+
+static int add_case(struct bench_case *cases, int nr, const char *filter,
+		    const char *name, size_t arg, bench_fn_t run)
+{
+	if (filter && !strstr(name, filter))
+		return nr;
+
+	cases[nr].name = name;
+	cases[nr].arg  = arg;
+	cases[nr].run  = run;
+	return nr + 1;
+}
+
+
+static int build_cases(struct bench_case *cases, const char *filter)
+{
+	int nr = 0;
+
+	nr = add_case(cases, nr, filter, "validate_file_name", 16,
+		      bench_validate_file_name);
+	nr = add_case(cases, nr, filter, "validate_file_name", 255,
+		      bench_validate_file_name);
+	nr = add_case(cases, nr, filter, "handle_file_info_header", 0,
+		      bench_file_info_header);
+	nr = add_case(cases, nr, filter, "handle_file_info_compact",
+		      RECV_BUFFER_SIZE, bench_file_info_compact);
+	nr = add_case(cases, nr, filter, "handle_client_data_first",
+		      RECV_BUFFER_SIZE, bench_client_data_first);
+	nr = add_case(cases, nr, filter, "handle_client_data_content",
+		      RECV_BUFFER_SIZE, bench_client_data_content);
+
+	for (size_t len = SWEEP_MIN; len <= SWEEP_MAX; len *= 4u)
+		nr = add_case(cases, nr, filter, "memmove_compact", len,
+			      bench_memmove_compact);
+	for (size_t len = SWEEP_MIN; len <= SWEEP_MAX; len *= 4u)
+		nr = add_case(cases, nr, filter, "fwrite_unbuffered", len,
+			      bench_fwrite_unbuffered);
+	for (size_t len = SWEEP_MIN; len <= SWEEP_MAX; len *= 4u)
+		nr = add_case(cases, nr, filter, "fwrite_buffered", len,
+			      bench_fwrite_buffered);
+	for (size_t len = SWEEP_MIN; len <= SWEEP_MAX; len *= 4u)
+		nr = add_case(cases, nr, filter, "write", len, bench_write);
+
+	return nr;
+}
+
+
+static void init_env(const char *base)
+{
+	snprintf(g_env.dir, sizeof(g_env.dir), "%s/micro_bench.XXXXXX", base);
+	if (mkdtemp(g_env.dir) == NULL)
+		die(g_env.dir, errno);
+	snprintf(g_env.path, sizeof(g_env.path), "%s/" BENCH_FILE, g_env.dir);
+
+	g_env.pktbuf = aligned_alloc(4096, sizeof(*g_env.pktbuf));
+	g_env.buf    = aligned_alloc(4096, SWEEP_MAX);
+	if (g_env.pktbuf == NULL || g_env.buf == NULL)
+		die("aligned_alloc()", ENOMEM);
+	memset(g_env.pktbuf, 'x', sizeof(*g_env.pktbuf));
+	memset(g_env.buf, 'x', SWEEP_MAX);
+
+	/*
+	 * Inline writes, no splice, no durability; the
+	 * per file messages would only measure the logger.
+	 */
+	g_env.cfg.storage_path = g_env.dir;
+	g_env.cfg.durability   = DURABILITY_NONE;
+	g_env.state.cfg        = &g_env.cfg;
+	g_env.state.epoll_fd   = -1;
+	log_level              = LOG_ERR;
+}
+
+
+static void destroy_env(void)
+{
+	unlink(g_env.path);
+	rmdir(g_env.dir);
+	free(g_env.pktbuf);
+	free(g_env.buf);
+}
+
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: micro_bench [-f filter] [-m seconds] [-d dir]\n"
+		"\n"
+		"  -f  Only run the cases whose name contains this\n"
+		"  -m  Minimum time per case (default: 0.5)\n"
+		"  -d  Where to write the files (default: /tmp)\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c, nr;
+	const char *filter = NULL;
+	const char *dir = "/tmp";
+	struct bench_case cases[64];
+
+	g_env.min_time = 0.5;
+	while ((c = getopt(argc, argv, "f:m:d:")) != -1) {
+		switch (c) {
+		case 'f':
+			filter = optarg;
+			break;
+		case 'm':
+			g_env.min_time = strtod(optarg, NULL);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		default:
+			usage();
+			return EINVAL;
+		}
+	}
+
+	init_env(dir);
+	nr = build_cases(cases, filter);
+
+	printf("RECV_BUFFER_SIZE=%u, files in %s\n\n", RECV_BUFFER_SIZE,
+	       g_env.dir);
+	printf("%-40s %15s %12s %15s\n", "Benchmark", "Time", "Iterations",
+	       "Throughput");
+	for (int i = 0; i < nr; i++)
+		run_case(&cases[i]);
+
+	destroy_env();
+	return g_env.sink == UINT64_MAX;
+}
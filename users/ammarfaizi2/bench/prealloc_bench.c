@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer preallocation benchmark
+ *
+ * Simulates many uploads landing on the same filesystem at once:
+ * N files are written round-robin, one chunk at a time, like the
+ * server does when N clients are sending. Reports the write
+ * throughput (fsync included) and the extent count of the files.
+ *
+ * With -p every file is fallocate()d to its final size first, the
+ * same as the server does with --preallocate on.
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#define DEFAULT_CHUNK_KB	(64u)
+
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+static long count_extents(int fd)
+{
+	struct fiemap fm;
+
+	/*
+	 * fm_extent_count == 0 only asks for the number of
+	 * extents.
+	 */
+	memset(&fm, 0, sizeof(fm));
+	fm.fm_length = FIEMAP_MAX_OFFSET;
+	fm.fm_flags  = FIEMAP_FLAG_SYNC;
+	if (ioctl(fd, FS_IOC_FIEMAP, &fm) < 0) {
+		printf("Error: ioctl(FS_IOC_FIEMAP): %s\n", strerror(errno));
+		return -1;
+	}
+
+	return (long)fm.fm_mapped_extents;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int ret = 0;
+	int *fds;
+	char *chunk;
+	char path[1024];
+	bool prealloc = false;
+	uint32_t nr_files;
+	uint64_t file_size, chunk_size = DEFAULT_CHUNK_KB * 1024u, off;
+	long ext, ext_total = 0, ext_max = 0;
+	double start, elapsed;
+	const char *dir;
+
+	while ((c = getopt(argc, argv, "p")) != -1) {
+		switch (c) {
+		case 'p':
+			prealloc = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc < 3) {
+usage:
+		printf("Usage: prealloc_bench [-p] [dir] [nr_files] "
+		       "[file_size_mb] [chunk_kb]\n");
+		return EINVAL;
+	}
+
+	dir = argv[0];
+	nr_files = (uint32_t)strtoul(argv[1], NULL, 10);
+	file_size = strtoull(argv[2], NULL, 10) * 1024u * 1024u;
+	if (argc > 3)
+		chunk_size = strtoull(argv[3], NULL, 10) * 1024u;
+
+	if (nr_files == 0 || chunk_size == 0)
+		goto usage;
+
+	fds = calloc(nr_files, sizeof(*fds));
+	chunk = malloc(chunk_size);
+	if (fds == NULL || chunk == NULL) {
+		printf("Error: malloc(): %s\n", strerror(ENOMEM));
+		return ENOMEM;
+	}
+	memset(chunk, 'x', chunk_size);
+
+	for (uint32_t i = 0; i < nr_files; i++)
+		fds[i] = -1;
+
+	start = now_sec();
+	for (uint32_t i = 0; i < nr_files; i++) {
+		snprintf(path, sizeof(path), "%s/prealloc_bench_%u.bin", dir, i);
+		fds[i] = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			      0644);
+		if (fds[i] < 0) {
+			ret = -errno;
+			printf("Error: open(%s): %s\n", path, strerror(-ret));
+			goto out;
+		}
+
+		if (prealloc && fallocate(fds[i], 0, 0, (off_t)file_size) < 0) {
+			ret = -errno;
+			printf("Error: fallocate(): %s\n", strerror(-ret));
+			goto out;
+		}
+	}
+
+	for (off = 0; off < file_size; off += chunk_size) {
+		size_t len = (size_t)(file_size - off < chunk_size ?
+				      file_size - off : chunk_size);
+
+		for (uint32_t i = 0; i < nr_files; i++) {
+			if (write(fds[i], chunk, len) != (ssize_t)len) {
+				ret = -errno;
+				printf("Error: write(): %s\n", strerror(-ret));
+				goto out;
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < nr_files; i++)
+		fsync(fds[i]);
+	elapsed = now_sec() - start;
+
+	for (uint32_t i = 0; i < nr_files; i++) {
+		ext = count_extents(fds[i]);
+		if (ext < 0) {
+			ret = -EINVAL;
+			goto out;
+		}
+		ext_total += ext;
+		if (ext > ext_max)
+			ext_max = ext;
+	}
+
+	printf("preallocate:   %s\n", prealloc ? "on" : "off");
+	printf("files:         %u x %" PRIu64 " MiB, %" PRIu64 " KiB chunks\n",
+	       nr_files, file_size >> 20u, chunk_size >> 10u);
+	printf("elapsed:       %.3f s\n", elapsed);
+	printf("throughput:    %.1f MiB/s\n",
+	       (double)(file_size * nr_files) / 1048576.0 / elapsed);
+	printf("extents:       total %ld, avg %.1f, max %ld\n", ext_total,
+	       (double)ext_total / nr_files, ext_max);
+
+out:
+	for (uint32_t i = 0; i < nr_files; i++) {
+		if (fds[i] < 0)
+			continue;
+		close(fds[i]);
+		snprintf(path, sizeof(path), "%s/prealloc_bench_%u.bin", dir, i);
+		unlink(path);
+	}
+	free(chunk);
+	free(fds);
+	return -ret;
+}
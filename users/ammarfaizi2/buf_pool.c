@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer server (receive buffer pool)
+ *
+ * Receive buffers are only attached to a channel while it has
+ * unconsumed bytes, so memory follows the number of active
+ * transfers instead of the number of connections.
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef _DEFAULT_SOURCE
+#  define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "server.h"
+
+
+static int buf_pool_grow(struct buf_pool *pool)
+{
+	int err;
+	char *chunk;
+	uint32_t nr;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+	nr = pool->max_bufs - pool->nr_bufs;
+	if (nr == 0)
+		return -EAGAIN;
+	if (nr > pool->chunk_bufs)
+		nr = pool->chunk_bufs;
+
+	if (pool->huge_pages) {
+		chunk = mmap(NULL, BUF_POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+			     flags | MAP_HUGETLB, -1, 0);
+		if (chunk != MAP_FAILED)
+			goto got_chunk;
+
+		/*
+		 * No huge pages reserved, fall back to normal pages
+		 * and let THP back them if it can.
+		 */
+		pr_dbg("mmap(MAP_HUGETLB): %s\n", strerror(errno));
+	}
+
+	chunk = mmap(NULL, BUF_POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE, flags,
+		     -1, 0);
+	if (chunk == MAP_FAILED) {
+		err = errno;
+		pr_err("mmap(): %s\n", strerror(err));
+		return -err;
+	}
+
+	if (pool->huge_pages)
+		madvise(chunk, BUF_POOL_CHUNK_SIZE, MADV_HUGEPAGE);
+
+got_chunk:
+	pool->chunks[pool->nr_chunks++] = chunk;
+	pool->nr_bufs += nr;
+
+	/*
+	 * Push in reverse order, so the first buffer of the
+	 * chunk is handed out first.
+	 */
+	for (uint32_t i = nr; i--;)
+		pool->free_bufs[pool->nr_free++] =
+			(union uni_pkt *)(void *)(chunk + i * pool->buf_size);
+
+	return 0;
+}
+
+
+union uni_pkt *buf_pool_get(struct buf_pool *pool)
+{
+	if (pool->nr_free == 0 && buf_pool_grow(pool))
+		return NULL;
+
+	return pool->free_bufs[--pool->nr_free];
+}
+
+
+void buf_pool_put(struct buf_pool *pool, union uni_pkt *buf)
+{
+	/*
+	 * LIFO, the next user gets the most recently used
+	 * (cache hot) buffer.
+	 */
+	pool->free_bufs[pool->nr_free++] = buf;
+}
+
+
+/*
+ * @buf_size must be a power of two, at most BUF_POOL_CHUNK_SIZE.
+ */
+int buf_pool_init(struct buf_pool *pool, uint32_t max_bufs, uint32_t buf_size,
+		  bool huge_pages)
+{
+	uint32_t max_chunks;
+	uint32_t chunk_bufs = BUF_POOL_CHUNK_SIZE / buf_size;
+
+	memset(pool, 0, sizeof(*pool));
+	max_chunks = (max_bufs + chunk_bufs - 1u) / chunk_bufs;
+
+	pool->chunks = calloc(max_chunks, sizeof(*pool->chunks));
+	pool->free_bufs = calloc(max_bufs, sizeof(*pool->free_bufs));
+	if (pool->chunks == NULL || pool->free_bufs == NULL) {
+		pr_err("calloc(): %s\n", strerror(ENOMEM));
+		return -ENOMEM;
+	}
+
+	pool->max_bufs   = max_bufs;
+	pool->buf_size   = buf_size;
+	pool->chunk_bufs = chunk_bufs;
+	pool->huge_pages = huge_pages;
+	return 0;
+}
+
+
+void buf_pool_destroy(struct buf_pool *pool)
+{
+	for (uint32_t i = 0; i < pool->nr_chunks; i++)
+		munmap(pool->chunks[i], BUF_POOL_CHUNK_SIZE);
+
+	free(pool->chunks);
+	free(pool->free_bufs);
+	memset(pool, 0, sizeof(*pool));
+}
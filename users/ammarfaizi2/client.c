@@ -10,8 +10,10 @@
 #endif
 
 #include <poll.h>
+#include <time.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <signal.h>
 #include <unistd.h>
@@ -19,45 +21,155 @@
 #include <string.h>
 #include <endian.h>
 #include <libgen.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <netinet/tcp.h>
+#include <linux/errqueue.h>
 
 #include "ftransfer.h"
+#include "log.h"
 
-#define DEBUG			(0)
 #define SEND_BUFFER_SIZE	(0x4000u)
+#define SEND_BUFFER_MIN		(0x1000u)
+#define SEND_BUFFER_MAX		(0x100000u)
+#define HELLO_TIMEOUT		(5000)	/* ms to wait for the hello reply */
+#define STREAMS_MAX		(64u)
+#define STREAM_MIN_RANGE	(0x400000u)	/* Smaller files use one stream */
+#define RESUME_MIN		(0x100000u)	/* Smaller files are just resent */
+#define FP_SAMPLES		(16u)
+#define FP_SAMPLE_SIZE		(0x10000u)
+#define SENDFILE_CHUNK		(0x40000000u)	/* Below the 2 GiB cap   */
+#define ZC_CHUNK		(0x100000u)	/* Per MSG_ZEROCOPY send */
+#define ZC_WINDOW		(0x2000000u)	/* Per mmap() of the file */
+#define ZC_MAX_WINDOWS		(4u)
+#define RA_BUF_SIZE		(0x40000u)	/* Per read-ahead buffer */
+#define RA_DEPTH		(4u)
+#define RA_MAX			(64u)
+#define PACE_BURST_MIN		(0x4000u)	/* Bucket depth, at least */
+#define PACE_BURST_MAX		(0x400000u)
+#define PACE_SLEEP_MAX		(100000000u)	/* ns, to watch stop_el  */
+#define CONNECT_TIMEOUT		(10000u)	/* ms for the whole race */
+#define CONNECT_STAGGER		(250u)		/* ms between attempts  */
+#define CONNECT_MAX		(16u)		/* Addresses to try     */
+
+static_assert(SEND_BUFFER_MIN >= sizeof(packet_t), "Bad SEND_BUFFER_MIN");
+
+enum send_mode {
+	SEND_COPY,			/* fread() + send()           */
+	SEND_SENDFILE,			/* sendfile()                 */
+	SEND_ZEROCOPY,			/* mmap() + MSG_ZEROCOPY      */
+};
 
-#if DEBUG
-#  define printf_dbg(...) printf(__VA_ARGS__)
-#else
-#  define printf_dbg(...)
-#endif
-
+/*
+ * A mapped part of the file, the kernel may still reference its
+ * pages until the notifications below @end_id are in.
+ */
+struct zc_window {
+	char		*addr;
+	size_t		len;
+	uint32_t	end_id;		/* zc_next after its last send */
+};
 
-union uni_pkt {
-	packet_t	packet;
-	char		raw_buf[SEND_BUFFER_SIZE];
+/*
+ * Read-ahead ring of the copy path. The reader thread fills the
+ * buffers from the file while the sender drains them.
+ */
+struct read_ahead {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	FILE		*handle;
+	const char	*target_file;
+	char		*mem;		/* nr * RA_BUF_SIZE bytes     */
+	size_t		lens[RA_MAX];
+	uint32_t	nr;		/* Buffers in the ring        */
+	uint32_t	head;		/* Next one to fill           */
+	uint32_t	tail;		/* Next one to send           */
+	uint32_t	filled;
+	uint64_t	left;		/* Still to be read           */
+	int		err;		/* Set by the reader          */
+	bool		stop;		/* Set by the sender          */
+	pthread_t	thread;
 };
 
-static_assert(SEND_BUFFER_SIZE >= sizeof(packet_t), "Bad SEND_BUFFER_SIZE");
+/*
+ * Client options.
+ */
+struct client_cfg {
+	const char	*server_addr;
+	uint16_t	server_port;
+	struct addrinfo	*addrs;		/* Resolved server_addr       */
+	uint32_t	connect_timeout; /* ms                        */
+	char		**targets;	/* Files and directories      */
+	int		nr_targets;
+	uint32_t	send_buf_size;	/* User space buffer          */
+	uint32_t	sock_sndbuf;	/* SO_SNDBUF, 0 to autotune   */
+	const char	*congestion;	/* TCP_CONGESTION, or NULL    */
+	uint32_t	nr_streams;	/* Connections per big file   */
+	bool		resume;		/* Resume interrupted uploads */
+	enum send_mode	send_mode;	/* How regular files go out   */
+	uint32_t	read_ahead;	/* Buffers, 0 reads inline    */
+	uint64_t	rate;		/* Bytes per second, 0 no cap */
+};
 
 struct client_state {
 	bool		stop_el;
+	bool		persistent;	/* Many files per connection  */
+	uint32_t	features;	/* FT_FEAT_* of the session   */
 	int		tcp_fd;
+	const struct client_cfg *cfg;
 	const char	*target_file;
 	FILE		*handle;
-	union uni_pkt	pktbuf;
+	char		*buf;		/* send_buf_size bytes        */
+	uint32_t	nr_sent;	/* Files sent so far          */
+	uint64_t	xfer_id;	/* Multi-stream: transfer id  */
+	uint64_t	xfer_size;	/* Multi-stream: whole file   */
+	uint64_t	range_off;	/* Multi-stream: this range   */
+	uint64_t	range_len;
+	pthread_t	thread;		/* Stream thread              */
+	int		ret;		/* Stream thread result       */
+	bool		zc_on;		/* SO_ZEROCOPY is set         */
+	bool		zc_off;		/* Fell back to sendfile()    */
+	bool		zc_copied;	/* Kernel copied the data     */
+	uint32_t	zc_next;	/* Next notification id       */
+	uint32_t	zc_done;	/* Ids below are released     */
+	uint32_t	zc_nr_win;	/* Mapped windows, in order   */
+	struct zc_window zc_win[ZC_MAX_WINDOWS];
 };
 
 
 static struct client_state *g_state;
+static struct client_state *g_streams;
+static uint32_t g_nr_streams;
+
+/*
+ * --rate, one token bucket for all the connections. Sends are
+ * charged after the fact, so the tokens go negative for a debt
+ * the next sender sleeps off.
+ */
+static struct {
+	pthread_mutex_t		lock;
+	uint64_t		rate;		/* Bytes per second, 0 is off */
+	uint64_t		burst;		/* Bucket depth, max per send */
+	int64_t			tokens;
+	uint64_t		last_ns;	/* Last refill                */
+} g_pace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
 
 static void handle_interrupt(int sig)
 {
 	g_state->stop_el = true;
+	for (uint32_t i = 0; i < g_nr_streams; i++)
+		g_streams[i].stop_el = true;
 	putchar('\n');
 	(void)sig;
 }
@@ -65,13 +177,45 @@ static void handle_interrupt(int sig)
 
 static int init_state(struct client_state *state)
 {
-	state->stop_el   = false;
-	state->tcp_fd	 = -1;
-	state->handle    = NULL;
+	state->stop_el    = false;
+	state->persistent = false;
+	state->features   = 0;
+	state->tcp_fd	  = -1;
+	state->handle     = NULL;
+	state->nr_sent    = 0;
+	state->zc_on      = false;
+	state->zc_off     = false;
+	state->zc_nr_win  = 0;
+	state->buf        = malloc(state->cfg->send_buf_size);
+	if (state->buf == NULL) {
+		pr_err("malloc(): %s\n", strerror(ENOMEM));
+		return -ENOMEM;
+	}
 	return 0;
 }
 
 
+static void destroy_state(struct client_state *state)
+{
+	int tcp_fd = state->tcp_fd;
+	FILE *handle = state->handle;
+
+	if (tcp_fd != -1) {
+		printf("Closing tcp_fd (%d)...\n", tcp_fd);
+		close(tcp_fd);
+	}
+
+	if (handle != NULL) {
+		fclose(handle);
+	}
+
+	for (uint32_t i = 0; i < state->zc_nr_win; i++)
+		munmap(state->zc_win[i].addr, state->zc_win[i].len);
+
+	free(state->buf);
+}
+
+
 static int open_target_file(struct client_state *state)
 {
 	FILE *handle;
@@ -79,17 +223,26 @@ static int open_target_file(struct client_state *state)
 	handle = fopen(state->target_file, "rb");
 	if (handle == NULL) {
 		int err = errno;
-		printf("Error: fopen(\"%s\"): %s\n", state->target_file,
+		pr_err("fopen(\"%s\"): %s\n", state->target_file,
 		       strerror(err));
 		return -err;
 	}
 
+	/*
+	 * Doubles the kernel read-ahead window, fails harmlessly
+	 * on a pipe.
+	 */
+	posix_fadvise(fileno(handle), 0, 0, POSIX_FADV_SEQUENTIAL);
 	state->handle = handle;
 	return 0;
 }
 
 
-static int socket_setup(int tcp_fd)
+/*
+ * Must be done before connect(), the window scale is agreed
+ * on in the handshake.
+ */
+static int socket_setup(int tcp_fd, const struct client_cfg *cfg)
 {
 	int y;
 	int err;
@@ -98,70 +251,269 @@ static int socket_setup(int tcp_fd)
 	socklen_t len = sizeof(y);
 	const void *py = (const void *)&y;
 
-	y = 1;
-	retval = setsockopt(tcp_fd, IPPROTO_TCP, TCP_NODELAY, py, len);
-	if (retval < 0) {
-		lv = "IPPROTO_TCP";
-		on = "TCP_NODELAY";
-		goto out_err;
+	if (cfg->congestion != NULL) {
+		retval = setsockopt(tcp_fd, IPPROTO_TCP, TCP_CONGESTION,
+				    cfg->congestion,
+				    (socklen_t)strlen(cfg->congestion));
+		if (retval < 0) {
+			lv = "IPPROTO_TCP";
+			on = "TCP_CONGESTION";
+			goto out_err;
+		}
+	}
+
+	/*
+	 * Setting it turns the send autotuning off, only do
+	 * it when asked. Only root can go past net.core.wmem_max.
+	 */
+	if (cfg->sock_sndbuf != 0) {
+		y = (int)cfg->sock_sndbuf;
+		retval = setsockopt(tcp_fd, SOL_SOCKET, SO_SNDBUFFORCE, py, len);
+		if (retval < 0)
+			retval = setsockopt(tcp_fd, SOL_SOCKET, SO_SNDBUF, py,
+					    len);
+		if (retval < 0) {
+			lv = "SOL_SOCKET";
+			on = "SO_SNDBUF";
+			goto out_err;
+		}
+
+		/*
+		 * The kernel doubles the value for its bookkeeping.
+		 */
+		if (getsockopt(tcp_fd, SOL_SOCKET, SO_SNDBUF, &y, &len) == 0 &&
+		    (uint32_t)y / 2u < cfg->sock_sndbuf)
+			pr_warn("SO_SNDBUF is capped to %d bytes by "
+				"net.core.wmem_max\n", y / 2);
+	}
+
+	/*
+	 * TCP spaces the packets of each burst the token bucket
+	 * lets through, instead of sending them back to back. An
+	 * eighth above the cap, so the bucket stays the limit and
+	 * a late burst can still catch up.
+	 */
+	if (cfg->rate != 0) {
+		uint64_t rate = cfg->rate + cfg->rate / 8u;
+		uint32_t rate32 = (rate > UINT32_MAX) ? UINT32_MAX :
+			(uint32_t)rate;
+
+		if (setsockopt(tcp_fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate,
+			       sizeof(rate)) < 0 &&
+		    setsockopt(tcp_fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate32,
+			       sizeof(rate32)) < 0)
+			pr_warn("SO_MAX_PACING_RATE: %s, the rate is "
+				"kept in bursts\n", strerror(errno));
 	}
 
 	return 0;
 out_err:
 	err = errno;
-	printf("Error: setsockopt(tcp_fd, %s, %s): %s\n", lv, on, strerror(err));
+	pr_err("setsockopt(tcp_fd, %s, %s): %s\n", lv, on, strerror(err));
 	return -err;
 }
 
 
-static int init_socket(const char *server_addr, uint16_t server_port,
-		       struct client_state *state)
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+static uint64_t now_ms(void)
+{
+	return now_ns() / 1000000u;
+}
+
+
+/*
+ * Alternate the address families, starting with the one the
+ * resolver put first (RFC 8305). A dead IPv6 path then costs
+ * one stagger, not one timeout per IPv6 address.
+ */
+static uint32_t order_candidates(struct addrinfo *addrs,
+				 struct addrinfo *cand[CONNECT_MAX])
+{
+	uint32_t nr = 0;
+	struct addrinfo *a, *b;
+	int first = addrs->ai_family;
+
+	a = addrs;
+	b = addrs;
+	while (nr < CONNECT_MAX) {
+		while (a != NULL && a->ai_family != first)
+			a = a->ai_next;
+		while (b != NULL && b->ai_family == first)
+			b = b->ai_next;
+		if (a == NULL && b == NULL)
+			break;
+
+		if (a != NULL) {
+			cand[nr++] = a;
+			a = a->ai_next;
+		}
+		if (b != NULL && nr < CONNECT_MAX) {
+			cand[nr++] = b;
+			b = b->ai_next;
+		}
+	}
+	return nr;
+}
+
+
+/*
+ * Returns the socket, connected when @done is set, else with
+ * the connect() in progress.
+ */
+static int start_connect(const struct addrinfo *ai,
+			 const struct client_cfg *cfg, bool *done)
 {
 	int ret;
 	int tcp_fd;
-	struct sockaddr_in addr;
-	socklen_t addr_len = sizeof(addr);
 
-	tcp_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+	tcp_fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK,
+			IPPROTO_TCP);
 	if (tcp_fd < 0) {
 		ret = errno;
-		printf("Error: socket(): %s\n", strerror(ret));
+		pr_err("socket(): %s\n", strerror(ret));
 		return -ret;
 	}
 
-	ret = socket_setup(tcp_fd);
-	if (ret)
+	ret = socket_setup(tcp_fd, cfg);
+	if (ret) {
+		close(tcp_fd);
 		return ret;
+	}
 
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(server_port);
-	addr.sin_addr.s_addr = inet_addr(server_addr);
-
-	printf("Connecting to %s:%u...\n", server_addr, server_port);
-exec_connect:
-	ret = connect(tcp_fd, (struct sockaddr *)&addr, addr_len);
-	if (ret) {
+	*done = !connect(tcp_fd, ai->ai_addr, ai->ai_addrlen);
+	if (!*done && errno != EINPROGRESS) {
 		ret = errno;
-		if (ret == EINPROGRESS || ret == EALREADY || ret == EAGAIN) {
-			usleep(10000);
-			goto exec_connect;
+		close(tcp_fd);
+		return -ret;
+	}
+	return tcp_fd;
+}
+
+
+/*
+ * Race the candidates, a new one starts every CONNECT_STAGGER ms
+ * or as soon as all the ones in flight failed. The first to
+ * connect wins, the whole thing gives up at the deadline.
+ */
+static int race_connect(struct client_state *state)
+{
+	int err = ETIMEDOUT;
+	int ret = -1;
+	bool done = false;
+	struct pollfd fds[CONNECT_MAX];
+	struct addrinfo *cand[CONNECT_MAX];
+	uint32_t i, nr_fds = 0, next = 0, nr_cand;
+	uint64_t now = now_ms();
+	uint64_t deadline = now + state->cfg->connect_timeout;
+	uint64_t next_start = now;
+	socklen_t len = sizeof(err);
+
+	nr_cand = order_candidates(state->cfg->addrs, cand);
+	for (;;) {
+		if (state->stop_el) {
+			printf("Stopping event loop...\n");
+			err = EINTR;
+			break;
 		}
 
-		printf("Error: connect(): %s\n", strerror(ret));
-		ret = -ret;
-		goto out;
+		now = now_ms();
+		if (now >= deadline) {
+			err = ETIMEDOUT;
+			break;
+		}
+
+		if (next < nr_cand && (now >= next_start || nr_fds == 0)) {
+			ret = start_connect(cand[next++], state->cfg, &done);
+			if (ret < 0) {
+				err = -ret;
+				next_start = now;
+				continue;
+			}
+			if (done)
+				break;
+
+			fds[nr_fds].fd      = ret;
+			fds[nr_fds].events  = POLLOUT;
+			fds[nr_fds].revents = 0;
+			nr_fds++;
+			next_start = now + CONNECT_STAGGER;
+			continue;
+		}
+
+		if (nr_fds == 0)
+			break;
+
+		ret = (int)(deadline - now);
+		if (next < nr_cand && next_start - now < (uint64_t)ret)
+			ret = (int)(next_start - now);
+		if (poll(fds, nr_fds, ret) <= 0)
+			continue;
+
+		for (i = 0; i < nr_fds && !done; i++) {
+			if (!fds[i].revents)
+				continue;
+
+			if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err,
+				       &len) < 0)
+				err = errno;
+			if (!err) {
+				done = true;
+				ret = fds[i].fd;
+				fds[i] = fds[--nr_fds];
+				break;
+			}
+
+			/*
+			 * Failed, the next candidate needn't wait for
+			 * the stagger.
+			 */
+			close(fds[i].fd);
+			fds[i--] = fds[--nr_fds];
+			next_start = now;
+		}
+		if (done)
+			break;
 	}
 
-	printf("Connection established!\n");
-	state->tcp_fd = tcp_fd;
-out:
-	if (ret)
-		close(tcp_fd);
+	for (i = 0; i < nr_fds; i++)
+		close(fds[i].fd);
+
+	if (!done) {
+		pr_err("connect(): %s\n", strerror(err));
+		return -err;
+	}
 	return ret;
 }
 
 
+static int init_socket(struct client_state *state)
+{
+	int tcp_fd;
+
+	printf("Connecting to %s:%u...\n", state->cfg->server_addr,
+	       state->cfg->server_port);
+	tcp_fd = race_connect(state);
+	if (tcp_fd < 0)
+		return tcp_fd;
+
+	printf("Connection established!\n");
+	state->tcp_fd    = tcp_fd;
+	state->zc_on     = false;
+	state->zc_copied = false;
+	state->zc_next   = 0;
+	state->zc_done   = 0;
+	return 0;
+}
+
+
 static uint64_t get_file_size(FILE *handle)
 {
 	int err;
@@ -169,7 +521,7 @@ static uint64_t get_file_size(FILE *handle)
 	err = fseek(handle, 0L, SEEK_END);
 	if (err) {
 		err = errno;
-		printf("Error: fseek(): %s\n", strerror(err));
+		pr_err("fseek(): %s\n", strerror(err));
 		errno = err;
 		return 0;
 	}
@@ -179,167 +531,1394 @@ static uint64_t get_file_size(FILE *handle)
 }
 
 
-static int send_target_file(struct client_state *state)
+static void init_pace(uint64_t rate)
+{
+	uint64_t burst = rate / 100u;	/* 10 ms worth */
+
+	if (burst < PACE_BURST_MIN)
+		burst = PACE_BURST_MIN;
+	if (burst > PACE_BURST_MAX)
+		burst = PACE_BURST_MAX;
+
+	g_pace.rate    = rate;
+	g_pace.burst   = burst;
+	g_pace.tokens  = 0;
+	g_pace.last_ns = now_ns();
+}
+
+
+/*
+ * Waits until the bucket is out of debt, and caps @len to one
+ * burst. No syscall unless there is a debt to sleep off.
+ */
+static int pace_wait(struct client_state *state, size_t *len)
+{
+	uint64_t now, ns, add;
+	struct timespec ts;
+
+	if (g_pace.rate == 0)
+		return 0;
+
+	for (;;) {
+		if (state->stop_el)
+			return -EINTR;
+
+		pthread_mutex_lock(&g_pace.lock);
+		now = now_ns();
+		ns  = now - g_pace.last_ns;
+		if (ns > 1000000000u)
+			ns = 1000000000u;
+		add = (ns / 1000u) * g_pace.rate / 1000000u;
+		if (add > 0) {
+			g_pace.tokens += (int64_t)add;
+			if (g_pace.tokens > (int64_t)g_pace.burst)
+				g_pace.tokens = (int64_t)g_pace.burst;
+			g_pace.last_ns = now;
+		}
+
+		if (g_pace.tokens >= 0) {
+			pthread_mutex_unlock(&g_pace.lock);
+			break;
+		}
+		ns = (uint64_t)-g_pace.tokens * 1000000000u / g_pace.rate + 1u;
+		pthread_mutex_unlock(&g_pace.lock);
+
+		if (ns > PACE_SLEEP_MAX)
+			ns = PACE_SLEEP_MAX;
+		ts.tv_sec  = 0;
+		ts.tv_nsec = (long)ns;
+		nanosleep(&ts, NULL);
+	}
+
+	if (*len > g_pace.burst)
+		*len = (size_t)g_pace.burst;
+	return 0;
+}
+
+
+static void pace_charge(size_t len)
+{
+	if (g_pace.rate == 0)
+		return;
+
+	pthread_mutex_lock(&g_pace.lock);
+	g_pace.tokens -= (int64_t)len;
+	pthread_mutex_unlock(&g_pace.lock);
+}
+
+
+static int send_all(struct client_state *state, const char *buf, size_t len,
+		    int flags)
 {
-	size_t send_size;
-	uint64_t file_size;
-	const char *file_base_name;
-	int tcp_fd = state->tcp_fd;
-	FILE *handle = state->handle;
-	packet_t *pkt = &state->pktbuf.packet;
-	char file_name[0x1000];
 	int err;
+	ssize_t ret;
 	struct pollfd fds[1];
 
-	snprintf(file_name, sizeof(file_name), "%s", state->target_file);
-	file_base_name = basename(file_name);
+	fds[0].fd      = state->tcp_fd;
+	fds[0].events  = POLLOUT;
+	fds[0].revents = 0;
 
-	errno = 0;
-	file_size = get_file_size(handle);
-	if (file_size == 0 && errno != 0)
-		return -errno;
+	while (len > 0) {
+		size_t chunk = len;
 
+		if (state->stop_el)
+			return -EINTR;
 
-	printf("=================================\n");
-	printf("File name: %s\n", file_base_name);
-	printf("File size: %" PRIu64 "\n", file_size);
-	printf("=================================\n");
+		err = pace_wait(state, &chunk);
+		if (err)
+			return err;
+
+		ret = send(state->tcp_fd, buf, chunk, flags);
+		if (ret < 0) {
+			err = errno;
+			if (err != EAGAIN) {
+				pr_err("send(): %s\n", strerror(err));
+				return -err;
+			}
+			poll(fds, 1, 1000);
+			continue;
+		}
+
+		pace_charge((size_t)ret);
+		buf += ret;
+		len -= (size_t)ret;
+	}
+
+	return 0;
+}
+
+
+static int recv_all(struct client_state *state, char *buf, size_t len,
+		    int timeout)
+{
+	int err;
+	ssize_t ret;
+	struct pollfd fds[1];
+
+	fds[0].fd      = state->tcp_fd;
+	fds[0].events  = POLLIN;
+	fds[0].revents = 0;
+
+	while (len > 0) {
+		if (state->stop_el)
+			return -EINTR;
+
+		ret = poll(fds, 1, timeout);
+		if (ret == 0)
+			return -ETIMEDOUT;
+		if (ret < 0)
+			continue;
+
+		ret = recv(state->tcp_fd, buf, len, 0);
+		if (ret == 0)
+			return -ECONNRESET;
+		if (ret < 0) {
+			err = errno;
+			if (err == EAGAIN)
+				continue;
+			return -err;
+		}
+
+		buf += ret;
+		len -= (size_t)ret;
+	}
+
+	return 0;
+}
+
+
+static void fill_packet(struct client_state *state, packet_t *pkt,
+			uint64_t file_size)
+{
+	const char *file_base_name;
+	char file_name[0x1000];
+
+	snprintf(file_name, sizeof(file_name), "%s", state->target_file);
+	file_base_name = basename(file_name);
 
 	pkt->file_size = htobe64(file_size);
 	strncpy(pkt->file_name, file_base_name, sizeof(pkt->file_name));
 	pkt->file_name[sizeof(pkt->file_name) - 1] = '\0';
 	pkt->file_name_len = (uint8_t)strlen(pkt->file_name);
+}
 
-	printf("Sending file to server...\n");
-	send_size = sizeof(*pkt);
 
+/*
+ * Sends @len bytes at @off, both advance with what went out.
+ * Returns 1 if sendfile() doesn't support the file.
+ */
+static int sendfile_content(struct client_state *state, off_t *off,
+			    uint64_t *len)
+{
+	int err;
+	size_t chunk;
+	ssize_t ret;
+	struct pollfd fds[1];
+	int fd = fileno(state->handle);
 
-	fds[0].fd = tcp_fd;
-	fds[0].events = POLLOUT;
+	fds[0].fd      = state->tcp_fd;
+	fds[0].events  = POLLOUT;
 	fds[0].revents = 0;
 
-	do {
-		size_t fread_ret;
-		ssize_t send_ret;
-		char *raw_buf = state->pktbuf.raw_buf;
-
-		fread_ret = fread(state->pktbuf.raw_buf + send_size,
-				  sizeof(char),
-				  SEND_BUFFER_SIZE - send_size,
-				  handle);
-
-		send_size += fread_ret;
-		file_size -= fread_ret;
-
-	exec_send:
+	while (*len > 0) {
 		if (state->stop_el) {
 			printf("Stopping event loop...\n");
-			break;
+			return -EINTR;
 		}
 
-		send_ret = send(tcp_fd, raw_buf, send_size, 0);
-		if (send_ret < 0) {
+		chunk = (*len < SENDFILE_CHUNK) ? (size_t)*len : SENDFILE_CHUNK;
+		err = pace_wait(state, &chunk);
+		if (err)
+			return err;
+
+		ret = sendfile(state->tcp_fd, fd, off, chunk);
+		if (ret < 0) {
 			err = errno;
 			if (err == EAGAIN) {
-				int ret;
-				/*
-				 *
-				 * Oops, the network buffer is full
-				 * because this loop is too fast
-				 * compared to the network speed.
-				 *
-				 * We must wait until the network buffer
-				 * is flushed and is ready for writing.
-				 *
-				 * Let's sleep on poll() and wait for
-				 * the kernel to wake us up when writing
-				 * buffer is ready again.
-				 *
-				 */
-				printf_dbg("Sleeping on poll()...\n");
-			exec_poll:
-				ret = poll(fds, 1, 1000);
-				if (state->stop_el)
-					goto exec_send;
-				if (ret < 1)
-					goto exec_poll;
-
-				goto exec_send;
+				pr_dbg("Sleeping on poll()...\n");
+				poll(fds, 1, 1000);
+				continue;
 			}
-			printf("Error: send(): %s\n", strerror(err));
+			if (err == EINVAL || err == ENOSYS)
+				return 1;
+			pr_err("sendfile(): %s\n", strerror(err));
 			return -err;
 		}
 
-		printf_dbg("send() %zu bytes to the server\n", send_ret);
-		if ((size_t)send_ret < send_size) {
-			/*
-			 *
-			 * Only partial bytes are sent, must
-			 * resend the pending buffer.
-			 *
-			 */
-			send_size -= (size_t)send_ret;
-			memmove(raw_buf, raw_buf + (size_t)send_ret, send_size);
-			printf_dbg("Partial bytes are sent, resend pending buffer...\n");
-			goto exec_send;
+		if (ret == 0) {
+			pr_err("sendfile(\"%s\"): file is shorter than "
+			       "its size\n", state->target_file);
+			return -EIO;
 		}
-		send_size = 0;
-	
-	} while (file_size > 0);
 
-	printf("File sent completely!\n");
+		pr_dbg("sendfile() %zd bytes to the server\n", ret);
+		pace_charge((size_t)ret);
+		*len -= (uint64_t)ret;
+	}
+
 	return 0;
 }
 
 
-static void destroy_state(struct client_state *state)
+/*
+ * Unmap the windows whose sends the kernel is done with. TCP
+ * releases them in order, so they are at the front.
+ */
+static void zc_unmap_done(struct client_state *state, bool all)
 {
-	int tcp_fd = state->tcp_fd;
-	FILE *handle = state->handle;
+	uint32_t i, n = 0;
+	struct zc_window *win = state->zc_win;
 
-	if (tcp_fd != -1) {
-		printf("Closing tcp_fd (%d)...\n", tcp_fd);
-		close(tcp_fd);
+	while (n < state->zc_nr_win &&
+	       (all || (int32_t)(state->zc_done - win[n].end_id) >= 0)) {
+		munmap(win[n].addr, win[n].len);
+		n++;
 	}
 
-	if (handle != NULL) {
-		fclose(handle);
-	}
+	for (i = n; i < state->zc_nr_win; i++)
+		win[i - n] = win[i];
+	state->zc_nr_win -= n;
 }
 
 
-static int internal_run_client(char *argv[])
+/*
+ * Reap the MSG_ZEROCOPY notifications from the error queue.
+ */
+static int zc_reap(struct client_state *state)
 {
-	int ret;
-	struct client_state *state;
+	int err;
+	ssize_t ret;
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+		ret = recvmsg(state->tcp_fd, &msg, MSG_ERRQUEUE);
+		if (ret < 0) {
+			err = errno;
+			if (err == EAGAIN)
+				break;
+			pr_err("recvmsg(MSG_ERRQUEUE): %s\n",
+			       strerror(err));
+			return -err;
+		}
 
-	state = malloc(sizeof(*state));
-	if (state == NULL) {
-		printf("Error: malloc(): %s", strerror(ENOMEM));
-		return -ENOMEM;
-	}
-	memset(state, 0, sizeof(*state));
-	g_state = state;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP &&
+			      cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 &&
+			      cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				if (serr->ee_errno) {
+					pr_err("send(): %s\n",
+					       strerror(serr->ee_errno));
+					return -(int)serr->ee_errno;
+				}
+				continue;
+			}
 
-	signal(SIGINT, handle_interrupt);
-	signal(SIGTERM, handle_interrupt);
-	signal(SIGHUP, handle_interrupt);
-	signal(SIGPIPE, SIG_IGN);
+			/*
+			 * [ee_info, ee_data] are done.
+			 */
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				state->zc_copied = true;
+			if ((int32_t)(serr->ee_data + 1 - state->zc_done) > 0)
+				state->zc_done = serr->ee_data + 1;
+		}
+	}
 
-	ret = init_state(state);
-	if (ret)
+	zc_unmap_done(state, false);
+	return 0;
+}
+
+
+/*
+ * Wait for room in the socket or for a notification.
+ */
+static int zc_wait(struct client_state *state, short events)
+{
+	struct pollfd fds[1];
+
+	if (state->stop_el) {
+		printf("Stopping event loop...\n");
+		return -EINTR;
+	}
+
+	fds[0].fd      = state->tcp_fd;
+	fds[0].events  = events;
+	fds[0].revents = 0;
+	poll(fds, 1, 1000);
+	return zc_reap(state);
+}
+
+
+/*
+ * Map the window that starts at @off, page aligned.
+ */
+static int zc_map_window(struct client_state *state, off_t off, uint64_t len,
+			 struct zc_window *win, size_t *skew)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	off_t map_off = off & ~((off_t)page - 1);
+
+	*skew    = (size_t)(off - map_off);
+	win->len = (len < ZC_WINDOW - *skew) ? (size_t)len + *skew : ZC_WINDOW;
+	win->addr = mmap(NULL, win->len, PROT_READ, MAP_SHARED,
+			 fileno(state->handle), map_off);
+	if (win->addr == MAP_FAILED)
+		return -errno;
+
+	return 0;
+}
+
+
+/*
+ * Sends @len bytes at @off like sendfile_content(), but from an
+ * mmap() of the file with MSG_ZEROCOPY. The pages are pinned
+ * instead of copied, which pays off for big sends on a NIC that
+ * can gather them. Where the kernel copies anyway (loopback, no
+ * scatter-gather), it says so in the notification, and the rest
+ * goes through sendfile_content().
+ *
+ * Returns 1 to fall back.
+ */
+static int zerocopy_content(struct client_state *state, off_t *off,
+			    uint64_t *len)
+{
+	int err = 0;
+	char *p;
+	size_t n, skew;
+	ssize_t ret;
+	int on = 1;
+	struct zc_window win;
+
+	if (!state->zc_on) {
+		if (setsockopt(state->tcp_fd, SOL_SOCKET, SO_ZEROCOPY, &on,
+			       sizeof(on)) < 0) {
+			pr_warn("SO_ZEROCOPY: %s, using sendfile()\n",
+				strerror(errno));
+			state->zc_off = true;
+			return 1;
+		}
+		state->zc_on = true;
+	}
+
+	while (*len > 0 && !state->zc_copied) {
+		if (state->zc_nr_win == ZC_MAX_WINDOWS) {
+			err = zc_wait(state, 0);
+			if (err)
+				goto out;
+			continue;
+		}
+
+		err = zc_map_window(state, *off, *len, &win, &skew);
+		if (err) {
+			pr_warn("mmap(\"%s\"): %s, using sendfile()\n",
+				state->target_file, strerror(-err));
+			state->zc_off = true;
+			err = 0;
+			break;
+		}
+
+		/*
+		 * Reaps in between must not unmap the window that is
+		 * still being sent, it joins the others once done.
+		 */
+		p = win.addr + skew;
+		n = win.len - skew;
+		while (n > 0) {
+			size_t chunk = (n < ZC_CHUNK) ? n : ZC_CHUNK;
+
+			err = pace_wait(state, &chunk);
+			if (err)
+				goto out_unmap;
+
+			ret = send(state->tcp_fd, p, chunk, MSG_ZEROCOPY);
+			if (ret < 0) {
+				err = errno;
+				/*
+				 * ENOBUFS, the pinned pages are over the
+				 * optmem limit until some are released.
+				 */
+				if (err == EAGAIN || err == ENOBUFS) {
+					err = zc_wait(state, POLLOUT);
+					if (err)
+						goto out_unmap;
+					continue;
+				}
+				pr_err("send(MSG_ZEROCOPY): %s\n",
+				       strerror(err));
+				err = -err;
+				goto out_unmap;
+			}
+
+			pace_charge((size_t)ret);
+			state->zc_next++;
+			p    += ret;
+			n    -= (size_t)ret;
+			*off += ret;
+			*len -= (uint64_t)ret;
+		}
+
+		win.end_id = state->zc_next;
+		state->zc_win[state->zc_nr_win++] = win;
+		err = zc_reap(state);
+		if (err)
+			goto out;
+	}
+
+	/*
+	 * The mapping must outlive the kernel's use of its pages.
+	 */
+	while (state->zc_nr_win > 0) {
+		err = zc_wait(state, 0);
+		if (err)
+			goto out;
+	}
+
+	if (state->zc_copied && !state->zc_off) {
+		printf("Kernel copied the MSG_ZEROCOPY data, using "
+		       "sendfile()\n");
+		state->zc_off = true;
+	}
+	return (*len > 0) ? 1 : 0;
+
+out_unmap:
+	munmap(win.addr, win.len);
+out:
+	zc_unmap_done(state, true);
+	return err;
+}
+
+
+static enum send_mode send_mode(struct client_state *state)
+{
+	struct stat st;
+	enum send_mode mode = state->cfg->send_mode;
+
+	if (mode == SEND_COPY)
+		return SEND_COPY;
+
+	if (fstat(fileno(state->handle), &st) || !S_ISREG(st.st_mode))
+		return SEND_COPY;
+
+	if (mode == SEND_ZEROCOPY && state->zc_off)
+		return SEND_SENDFILE;
+
+	return mode;
+}
+
+
+static void *read_ahead_thread(void *arg)
+{
+	size_t len;
+	uint32_t i;
+	struct read_ahead *ra = arg;
+
+	pthread_mutex_lock(&ra->lock);
+	while (ra->left > 0 && !ra->stop) {
+		if (ra->filled == ra->nr) {
+			pthread_cond_wait(&ra->cond, &ra->lock);
+			continue;
+		}
+
+		i = ra->head;
+		len = (ra->left < RA_BUF_SIZE) ? (size_t)ra->left : RA_BUF_SIZE;
+		pthread_mutex_unlock(&ra->lock);
+
+		if (fread(ra->mem + (size_t)i * RA_BUF_SIZE, 1, len,
+			  ra->handle) != len) {
+			pr_err("fread(\"%s\"): %s\n", ra->target_file,
+			       ferror(ra->handle) ? strerror(EIO) :
+			       "file is shorter than its size");
+			pthread_mutex_lock(&ra->lock);
+			ra->err = -EIO;
+			break;
+		}
+
+		pthread_mutex_lock(&ra->lock);
+		ra->lens[i] = len;
+		ra->left   -= len;
+		ra->head    = (i + 1u) % ra->nr;
+		ra->filled++;
+		pthread_cond_signal(&ra->cond);
+	}
+	pthread_cond_signal(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	return NULL;
+}
+
+
+/*
+ * Sends @file_size bytes from the current file position, read
+ * by a thread ahead of the sends, so the disk and the network
+ * work at the same time. The thread owns the handle until it
+ * is joined.
+ */
+static int send_read_ahead(struct client_state *state, uint64_t file_size)
+{
+	int err;
+	size_t len;
+	uint32_t i;
+	struct read_ahead ra;
+	sigset_t mask, old_mask;
+
+	memset(&ra, 0, sizeof(ra));
+	ra.handle      = state->handle;
+	ra.target_file = state->target_file;
+	ra.nr          = state->cfg->read_ahead;
+	ra.left        = file_size;
+	ra.mem         = malloc((size_t)ra.nr * RA_BUF_SIZE);
+	if (ra.mem == NULL) {
+		pr_err("malloc(): %s\n", strerror(ENOMEM));
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&ra.lock, NULL);
+	pthread_cond_init(&ra.cond, NULL);
+
+	/*
+	 * Signals are for this thread, it watches stop_el.
+	 */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	err = -pthread_create(&ra.thread, NULL, read_ahead_thread, &ra);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (err) {
+		pr_err("pthread_create(): %s\n", strerror(-err));
 		goto out;
+	}
+
+	while (file_size > 0) {
+		pthread_mutex_lock(&ra.lock);
+		while (ra.filled == 0 && ra.err == 0)
+			pthread_cond_wait(&ra.cond, &ra.lock);
+		err = ra.err;
+		i   = ra.tail;
+		len = ra.lens[i];
+		pthread_mutex_unlock(&ra.lock);
+		if (err)
+			break;
+
+		err = send_all(state, ra.mem + (size_t)i * RA_BUF_SIZE, len, 0);
+		if (err)
+			break;
+		file_size -= len;
+
+		pthread_mutex_lock(&ra.lock);
+		ra.tail = (i + 1u) % ra.nr;
+		ra.filled--;
+		pthread_cond_signal(&ra.cond);
+		pthread_mutex_unlock(&ra.lock);
+	}
+
+	pthread_mutex_lock(&ra.lock);
+	ra.stop = true;
+	pthread_cond_signal(&ra.cond);
+	pthread_mutex_unlock(&ra.lock);
+	pthread_join(ra.thread, NULL);
+out:
+	pthread_cond_destroy(&ra.cond);
+	pthread_mutex_destroy(&ra.lock);
+	free(ra.mem);
+	return err;
+}
 
-	state->target_file = argv[2];
+
+/*
+ * The header is already in the first @send_size bytes of the
+ * buffer, @file_size bytes from the current file position
+ * follow it.
+ */
+static int send_content(struct client_state *state, size_t send_size,
+			uint64_t file_size)
+{
+	FILE *handle = state->handle;
+	size_t buf_size = state->cfg->send_buf_size;
+	enum send_mode mode;
+	int err;
+	off_t off;
+
+	mode = send_mode(state);
+	off = ftello(handle);
+	if (mode != SEND_COPY && off >= 0) {
+		/*
+		 * MSG_MORE, the header goes out in the same segment
+		 * as the start of the content.
+		 */
+		err = send_all(state, state->buf, send_size,
+			       file_size ? MSG_MORE : 0);
+		if (err)
+			return err;
+
+		if (mode == SEND_ZEROCOPY) {
+			err = zerocopy_content(state, &off, &file_size);
+			if (err <= 0)
+				return err;
+		}
+
+		err = sendfile_content(state, &off, &file_size);
+		if (err <= 0)
+			return err;
+
+		/*
+		 * Not supported for this file, the rest is copied
+		 * from where the kernel stopped.
+		 */
+		if (fseeko(handle, off, SEEK_SET)) {
+			err = errno;
+			pr_err("fseeko(\"%s\"): %s\n",
+			       state->target_file, strerror(err));
+			return -err;
+		}
+		send_size = 0;
+	}
+
+	if (state->cfg->read_ahead && file_size > RA_BUF_SIZE) {
+		err = send_all(state, state->buf, send_size, MSG_MORE);
+		if (err)
+			return err;
+		return send_read_ahead(state, file_size);
+	}
+
+	do {
+		size_t want;
+		size_t fread_ret;
+
+		/*
+		 * Never send more than announced, on a persistent
+		 * connection the next header follows right after.
+		 */
+		want = buf_size - send_size;
+		if (want > file_size)
+			want = (size_t)file_size;
+
+		fread_ret = fread(state->buf + send_size, 1, want, handle);
+		if (fread_ret != want) {
+			pr_err("fread(\"%s\"): %s\n", state->target_file,
+			       ferror(handle) ? strerror(EIO) :
+			       "file is shorter than its size");
+			return -EIO;
+		}
+
+		send_size += fread_ret;
+		file_size -= fread_ret;
+
+		err = send_all(state, state->buf, send_size, 0);
+		if (err)
+			return err;
+		send_size = 0;
+	} while (file_size > 0);
+
+	return 0;
+}
+
+
+static int send_target_file(struct client_state *state, uint64_t file_size)
+{
+	int ret;
+	packet_t *pkt = (packet_t *)(void *)state->buf;
+
+	fill_packet(state, pkt, file_size);
+	printf("=================================\n");
+	printf("File name: %s\n", pkt->file_name);
+	printf("File size: %" PRIu64 "\n", file_size);
+	printf("=================================\n");
+
+	printf("Sending file to server...\n");
+	ret = send_content(state, sizeof(*pkt), file_size);
+	if (!ret)
+		printf("File sent completely!\n");
+	return ret;
+}
+
+
+/*
+ * FNV-1a of the file size and FP_SAMPLES evenly spaced samples,
+ * the first and the last one included. Reading the whole file
+ * just to find out where to resume would defeat the purpose.
+ */
+static int file_fingerprint(struct client_state *state, uint64_t file_size,
+			    uint64_t *out)
+{
+	int err;
+	ssize_t ret;
+	uint64_t off;
+	size_t len = FP_SAMPLE_SIZE;
+	size_t chunk, done;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	const unsigned char *p = (const unsigned char *)state->buf;
+	int fd = fileno(state->handle);
+
+	if (len > file_size)
+		len = (size_t)file_size;
+
+	for (uint32_t i = 0; i < 8; i++) {
+		hash ^= (file_size >> (i * 8u)) & 0xffu;
+		hash *= 0x100000001b3ull;
+	}
+
+	for (uint32_t i = 0; i < FP_SAMPLES; i++) {
+		off = (file_size - len) / (FP_SAMPLES - 1u) * i;
+
+		/*
+		 * The send buffer may be smaller than a sample, the
+		 * hash must not depend on --send-buffer.
+		 */
+		for (done = 0; done < len; done += chunk) {
+			chunk = len - done;
+			if (chunk > state->cfg->send_buf_size)
+				chunk = state->cfg->send_buf_size;
+
+			ret = pread(fd, state->buf, chunk, (off_t)(off + done));
+			if (ret != (ssize_t)chunk) {
+				err = (ret < 0) ? errno : EIO;
+				pr_err("pread(\"%s\"): %s\n",
+				       state->target_file, strerror(err));
+				return -err;
+			}
+
+			for (size_t j = 0; j < chunk; j++) {
+				hash ^= p[j];
+				hash *= 0x100000001b3ull;
+			}
+		}
+	}
+
+	*out = hash;
+	return 0;
+}
+
+
+/*
+ * Ask the server how much of this file it already holds from
+ * an interrupted upload, only the rest is sent.
+ */
+static int send_resumable(struct client_state *state, uint64_t file_size)
+{
+	int ret;
+	uint64_t fp = 0;
+	uint64_t held;
+	packet_t *pkt = (packet_t *)(void *)state->buf;
+	resume_hdr_t *rsm = (resume_hdr_t *)(void *)(pkt + 1);
+
+	ret = file_fingerprint(state, file_size, &fp);
+	if (ret)
+		return ret;
+
+	fill_packet(state, pkt, FT_RESUME_SIZE);
+	rsm->file_size   = htobe64(file_size);
+	rsm->fingerprint = htobe64(fp);
+	printf("=================================\n");
+	printf("File name: %s\n", pkt->file_name);
+	printf("File size: %" PRIu64 "\n", file_size);
+	printf("=================================\n");
+
+	/*
+	 * The server may still be writing the previous file
+	 * of the session, no timeout.
+	 */
+	ret = send_all(state, state->buf, sizeof(*pkt) + sizeof(*rsm), 0);
+	if (!ret)
+		ret = recv_all(state, (char *)&held, sizeof(held), -1);
+	if (ret) {
+		if (ret != -EINTR)
+			pr_err("No resume reply: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	held = be64toh(held);
+	if (held > file_size) {
+		pr_err("The server holds more than the file size\n");
+		return -EPROTO;
+	}
+
+	if (held > 0)
+		printf("Resuming at byte %" PRIu64 "\n", held);
+
+	if (fseeko(state->handle, (off_t)held, SEEK_SET) < 0) {
+		ret = errno;
+		pr_err("fseeko(\"%s\"): %s\n", state->target_file,
+		       strerror(ret));
+		return -ret;
+	}
+
+	printf("Sending file to server...\n");
+	ret = send_content(state, 0, file_size - held);
+	if (!ret)
+		printf("File sent completely!\n");
+	return ret;
+}
+
+
+static int send_range(struct client_state *state)
+{
+	int ret;
+	packet_t *pkt = (packet_t *)(void *)state->buf;
+	range_hdr_t *rng = (range_hdr_t *)(void *)(pkt + 1);
+
+	if (fseeko(state->handle, (off_t)state->range_off, SEEK_SET) < 0) {
+		ret = errno;
+		pr_err("fseeko(\"%s\"): %s\n", state->target_file,
+		       strerror(ret));
+		return -ret;
+	}
+
+	fill_packet(state, pkt, FT_RANGE_SIZE);
+	rng->xfer_id   = htobe64(state->xfer_id);
+	rng->file_size = htobe64(state->xfer_size);
+	rng->offset    = htobe64(state->range_off);
+	rng->length    = htobe64(state->range_len);
+
+	ret = send_content(state, sizeof(*pkt) + sizeof(*rng),
+			   state->range_len);
+	if (!ret)
+		printf("Range %" PRIu64 "+%" PRIu64 " sent completely!\n",
+		       state->range_off, state->range_len);
+	return ret;
+}
+
+
+static int reconnect(struct client_state *state)
+{
+	if (state->tcp_fd != -1) {
+		close(state->tcp_fd);
+		state->tcp_fd = -1;
+	}
+
+	return init_socket(state);
+}
+
+
+/*
+ * Ask the server to take many files on this connection. Older
+ * servers close it instead, then it's one file per connection.
+ */
+static int open_session(struct client_state *state)
+{
+	int ret;
+	uint32_t feat;
+	packet_t *pkt = (packet_t *)(void *)state->buf;
+
+	memset(pkt, 0, sizeof(*pkt));
+	pkt->file_size     = htobe64(FT_CTRL_SIZE);
+	pkt->file_name_len = (uint8_t)(sizeof(FT_HELLO) - 1u);
+	memcpy(pkt->file_name, FT_HELLO, sizeof(FT_HELLO) - 1u);
+
+	ret = send_all(state, state->buf, sizeof(*pkt), 0);
+	if (!ret)
+		ret = recv_all(state, (char *)&feat, sizeof(feat),
+			       HELLO_TIMEOUT);
+	if (ret == -EINTR)
+		return ret;
+
+	if (ret) {
+		printf("The server doesn't support sessions, "
+		       "using one connection per file\n");
+		state->features   = 0;
+		state->persistent = false;
+		return reconnect(state);
+	}
+
+	/*
+	 * It may still refuse, the connection is good for
+	 * one file then.
+	 */
+	state->features   = be32toh(feat);
+	state->persistent = !!(state->features & FT_FEAT_PERSIST);
+	if (state->persistent)
+		printf("Sending all files over one connection\n");
+	else
+		printf("The server refuses persistent connections, "
+		       "using one connection per file\n");
+	return 0;
+}
+
+
+/*
+ * The server closes the connection once it has read the whole
+ * session. That is not an acknowledgement: with --durability
+ * group the files may still be waiting for the syncer, and a
+ * failed commit is only reported in the server log.
+ */
+static int close_session(struct client_state *state)
+{
+	int err;
+	char c;
+	ssize_t ret;
+	struct pollfd fds[1];
+
+	if (shutdown(state->tcp_fd, SHUT_WR) < 0) {
+		err = errno;
+		pr_err("shutdown(): %s\n", strerror(err));
+		return -err;
+	}
+
+	fds[0].fd      = state->tcp_fd;
+	fds[0].events  = POLLIN;
+	fds[0].revents = 0;
+
+	printf("Waiting for the server to finish...\n");
+	while (!state->stop_el) {
+		if (poll(fds, 1, 1000) < 1)
+			continue;
+
+		ret = recv(state->tcp_fd, &c, sizeof(c), 0);
+		if (ret == 0)
+			return 0;
+		if (ret > 0) {
+			pr_err("Unexpected data from the server\n");
+			return -EPROTO;
+		}
+
+		err = errno;
+		if (err == EAGAIN)
+			continue;
+		pr_err("recv(): %s\n", strerror(err));
+		return -err;
+	}
+
+	return -EINTR;
+}
+
+
+static void *run_stream(void *arg)
+{
+	int ret;
+	struct client_state *st = arg;
+
+	ret = open_target_file(st);
+	if (!ret)
+		ret = init_socket(st);
+	if (!ret)
+		ret = open_session(st);
+	if (!ret && !(st->features & FT_FEAT_RANGES)) {
+		pr_err("The server doesn't take byte ranges\n");
+		ret = -EPROTONOSUPPORT;
+	}
+	if (!ret)
+		ret = send_range(st);
+	if (!ret)
+		ret = close_session(st);
+
+	st->ret = ret;
+	return NULL;
+}
+
+
+static uint64_t new_xfer_id(void)
+{
+	uint64_t id;
+	struct timespec ts;
+
+	if (getrandom(&id, sizeof(id), 0) == (ssize_t)sizeof(id))
+		return id;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)getpid() << 32) ^ (uint64_t)ts.tv_sec ^
+	       ((uint64_t)ts.tv_nsec << 16);
+}
+
+
+/*
+ * Split the file into one byte range per stream. The first one
+ * goes over this connection, every other one over its own
+ * connection from its own thread.
+ */
+static int send_file_streams(struct client_state *state, uint64_t file_size)
+{
+	int ret;
+	uint64_t range;
+	uint32_t nr_started = 0;
+	struct client_state *streams;
+	sigset_t mask, old_mask;
+	uint32_t nr = state->cfg->nr_streams;
+
+	if (file_size / STREAM_MIN_RANGE < nr)
+		nr = (uint32_t)(file_size / STREAM_MIN_RANGE);
+	range = file_size / nr;
+
+	streams = calloc(nr - 1u, sizeof(*streams));
+	if (streams == NULL) {
+		pr_err("calloc(): %s\n", strerror(ENOMEM));
+		return -ENOMEM;
+	}
+
+	state->xfer_id   = new_xfer_id();
+	state->xfer_size = file_size;
+	state->range_off = 0;
+	state->range_len = range;
+	printf("Sending %s over %u streams\n", state->target_file, nr);
+
+	/*
+	 * Signals stay with the main thread, it stops the
+	 * streams.
+	 */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = 0;
+	for (uint32_t i = 1; i < nr; i++) {
+		struct client_state *st = &streams[i - 1u];
+
+		st->cfg         = state->cfg;
+		st->target_file = state->target_file;
+		ret = init_state(st);
+		if (ret)
+			break;
+
+		st->xfer_id   = state->xfer_id;
+		st->xfer_size = file_size;
+		st->range_off = range * i;
+		st->range_len = (i == nr - 1u) ? file_size - st->range_off : range;
+		ret = -pthread_create(&st->thread, NULL, run_stream, st);
+		if (ret) {
+			pr_err("pthread_create(): %s\n", strerror(-ret));
+			free(st->buf);
+			break;
+		}
+		nr_started++;
+	}
+	g_streams    = streams;
+	g_nr_streams = nr_started;
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret)
+		state->stop_el = true;
+	else
+		ret = send_range(state);
+
+	if (ret)
+		for (uint32_t i = 0; i < nr_started; i++)
+			streams[i].stop_el = true;
+
+	for (uint32_t i = 0; i < nr_started; i++) {
+		pthread_join(streams[i].thread, NULL);
+		if (!ret)
+			ret = streams[i].ret;
+	}
+
+	g_nr_streams = 0;
+	for (uint32_t i = 0; i < nr_started; i++)
+		destroy_state(&streams[i]);
+	free(streams);
+
+	if (!ret)
+		printf("File sent completely!\n");
+	return ret;
+}
+
+
+static int send_file(struct client_state *state, const char *path)
+{
+	int ret;
+	bool resume;
+	bool streams;
+	uint64_t file_size;
+
+	state->target_file = path;
 	ret = open_target_file(state);
 	if (ret)
+		return ret;
+
+	errno = 0;
+	file_size = get_file_size(state->handle);
+	if (file_size == 0 && errno != 0) {
+		ret = -errno;
 		goto out;
+	}
+
+	/*
+	 * The server tells in the hello if it takes ranges
+	 * and resume headers.
+	 */
+	streams = state->cfg->nr_streams > 1u &&
+		  file_size >= 2u * (uint64_t)STREAM_MIN_RANGE;
+	resume  = state->cfg->resume && file_size >= RESUME_MIN;
+	if (state->tcp_fd == -1 || (state->nr_sent > 0 && !state->persistent)) {
+		ret = reconnect(state);
+		if (!ret && (streams || resume))
+			ret = open_session(state);
+		if (ret)
+			goto out;
+	}
+
+	if (streams && (state->features & FT_FEAT_RANGES))
+		ret = send_file_streams(state, file_size);
+	else if (resume && (state->features & FT_FEAT_RESUME))
+		ret = send_resumable(state, file_size);
+	else
+		ret = send_target_file(state, file_size);
+out:
+	fclose(state->handle);
+	state->handle = NULL;
+	if (!ret)
+		state->nr_sent++;
+	return ret;
+}
+
+
+static bool is_directory(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+
+/*
+ * The server stores every file in one flat directory, so only
+ * the regular files right inside @dir_path are sent.
+ */
+static int send_dir(struct client_state *state, const char *dir_path)
+{
+	int err;
+	int ret = 0;
+	DIR *dir;
+	struct stat st;
+	struct dirent *ent;
+	char path[0x1000];
+
+	dir = opendir(dir_path);
+	if (dir == NULL) {
+		err = errno;
+		pr_err("opendir(\"%s\"): %s\n", dir_path,
+		       strerror(err));
+		return -err;
+	}
+
+	while (!state->stop_el && (ent = readdir(dir)) != NULL) {
+		if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir_path,
+				     ent->d_name) >= sizeof(path))
+			continue;
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		ret = send_file(state, path);
+		if (ret)
+			break;
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+
+static int parse_u32(const char *opt, const char *val, uint32_t min,
+		     uint32_t max, uint32_t *out)
+{
+	char *end;
+	unsigned long num;
+
+	num = strtoul(val, &end, 10);
+	if (*end != '\0' || *val == '\0' || num < min || num > max) {
+		pr_err("%s must be between %u and %u\n", opt, min, max);
+		return -EINVAL;
+	}
+
+	*out = (uint32_t)num;
+	return 0;
+}
+
+
+static int parse_on_off(const char *opt, const char *val, bool *out)
+{
+	if (!strcmp(val, "on")) {
+		*out = true;
+		return 0;
+	}
+
+	if (!strcmp(val, "off")) {
+		*out = false;
+		return 0;
+	}
+
+	pr_err("Invalid value for %s: \"%s\"\n", opt, val);
+	return -EINVAL;
+}
+
+
+static int parse_send_mode(const char *opt, const char *val,
+			   enum send_mode *out)
+{
+	if (!strcmp(val, "copy")) {
+		*out = SEND_COPY;
+		return 0;
+	}
+
+	if (!strcmp(val, "sendfile")) {
+		*out = SEND_SENDFILE;
+		return 0;
+	}
+
+	if (!strcmp(val, "zerocopy")) {
+		*out = SEND_ZEROCOPY;
+		return 0;
+	}
+
+	pr_err("Invalid value for %s: \"%s\"\n", opt, val);
+	return -EINVAL;
+}
+
+
+static int parse_client_opts(int argc, char *argv[], struct client_cfg *cfg)
+{
+	const char *opt, *val;
+
+	for (int i = 0; i < argc; i += 2) {
+		opt = argv[i];
+		if (i + 1 >= argc) {
+			pr_err("Missing value for option \"%s\"\n", opt);
+			return -EINVAL;
+		}
+		val = argv[i + 1];
+
+		if (!strcmp(opt, "--send-buffer")) {
+			if (parse_u32(opt, val, SEND_BUFFER_MIN / 1024u,
+				      SEND_BUFFER_MAX / 1024u,
+				      &cfg->send_buf_size))
+				return -EINVAL;
+			cfg->send_buf_size *= 1024u;
+			continue;
+		}
+
+		if (!strcmp(opt, "--sock-sndbuf")) {
+			if (parse_u32(opt, val, 0, 1u << 20u, &cfg->sock_sndbuf))
+				return -EINVAL;
+			cfg->sock_sndbuf *= 1024u;
+			continue;
+		}
+
+		if (!strcmp(opt, "--congestion")) {
+			cfg->congestion = val;
+			continue;
+		}
+
+		if (!strcmp(opt, "--connect-timeout")) {
+			if (parse_u32(opt, val, 1, 600000, &cfg->connect_timeout))
+				return -EINVAL;
+			continue;
+		}
+
+		if (!strcmp(opt, "--rate")) {
+			uint32_t kib;
+
+			if (parse_u32(opt, val, 0, UINT32_MAX, &kib))
+				return -EINVAL;
+			cfg->rate = (uint64_t)kib * 1024u;
+			continue;
+		}
+
+		if (!strcmp(opt, "--read-ahead")) {
+			if (parse_u32(opt, val, 0, RA_MAX, &cfg->read_ahead))
+				return -EINVAL;
+			continue;
+		}
+
+		if (!strcmp(opt, "--send-mode")) {
+			if (parse_send_mode(opt, val, &cfg->send_mode))
+				return -EINVAL;
+			continue;
+		}
 
-	ret = init_socket(argv[0], (uint16_t)atoi(argv[1]), state);
+		if (!strcmp(opt, "--resume")) {
+			if (parse_on_off(opt, val, &cfg->resume))
+				return -EINVAL;
+			continue;
+		}
+
+		if (!strcmp(opt, "--streams")) {
+			if (parse_u32(opt, val, 1, STREAMS_MAX, &cfg->nr_streams))
+				return -EINVAL;
+			continue;
+		}
+
+		pr_err("Unknown client option \"%s\"\n", opt);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Once for all the connections, the streams and reconnects race
+ * the same addresses.
+ */
+static int resolve_server(struct client_cfg *cfg)
+{
+	int ret;
+	char port[8];
+	struct addrinfo hints;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags    = AI_NUMERICSERV;
+	snprintf(port, sizeof(port), "%u", cfg->server_port);
+
+	ret = getaddrinfo(cfg->server_addr, port, &hints, &cfg->addrs);
+	if (ret) {
+		pr_err("getaddrinfo(\"%s\"): %s\n", cfg->server_addr,
+		       ret == EAI_SYSTEM ? strerror(errno) : gai_strerror(ret));
+		return ret == EAI_MEMORY ? -ENOMEM : -EINVAL;
+	}
+	return 0;
+}
+
+
+static int internal_run_client(const struct client_cfg *cfg)
+{
+	int ret;
+	bool session;
+	struct client_state *state;
+
+	state = malloc(sizeof(*state));
+	if (state == NULL) {
+		pr_err("malloc(): %s\n", strerror(ENOMEM));
+		return -ENOMEM;
+	}
+	memset(state, 0, sizeof(*state));
+	state->cfg = cfg;
+	g_state = state;
+
+	signal(SIGINT, handle_interrupt);
+	signal(SIGTERM, handle_interrupt);
+	signal(SIGHUP, handle_interrupt);
+	signal(SIGPIPE, SIG_IGN);
+
+	ret = init_state(state);
 	if (ret)
 		goto out;
 
-	ret = send_target_file(state);
+	session = cfg->nr_targets > 1 || is_directory(cfg->targets[0]);
+	if (session) {
+		ret = init_socket(state);
+		if (!ret)
+			ret = open_session(state);
+		if (ret)
+			goto out;
+	}
+
+	for (int i = 0; i < cfg->nr_targets && !state->stop_el; i++) {
+		if (is_directory(cfg->targets[i]))
+			ret = send_dir(state, cfg->targets[i]);
+		else
+			ret = send_file(state, cfg->targets[i]);
+		if (ret)
+			goto out;
+	}
+
+	if (state->persistent && !state->stop_el)
+		ret = close_session(state);
+	if (session && !ret)
+		printf("%u file(s) sent\n", state->nr_sent);
 out:
 	destroy_state(state);
 	free(state);
@@ -352,14 +1931,46 @@ int run_client(int argc, char *argv[])
 	/*
 	 * argv[0] is the server address
 	 * argv[1] is the server port
-	 * argv[2] is the file name
+	 * argv[2..] are the files and directories
+	 * then the options
 	 */
+	int ret;
+	int nr = 2;
+	struct client_cfg cfg;
+
+	while (nr < argc && strncmp(argv[nr], "--", 2))
+		nr++;
 
-	if (argc != 3) {
-		printf("Error: Invalid argument on run_client\n");
+	if (nr < 3) {
+		pr_err("Invalid argument on run_client\n");
 		print_help();
 		return EINVAL;
 	}
 
-	return -internal_run_client(argv);
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.server_addr   = argv[0];
+	cfg.server_port   = (uint16_t)atoi(argv[1]);
+	cfg.targets       = argv + 2;
+	cfg.nr_targets    = nr - 2;
+	cfg.send_buf_size = SEND_BUFFER_SIZE;
+	cfg.sock_sndbuf   = 0;
+	cfg.congestion    = NULL;
+	cfg.nr_streams    = 1;
+	cfg.resume        = true;
+	cfg.send_mode     = SEND_SENDFILE;
+	cfg.read_ahead    = RA_DEPTH;
+	cfg.connect_timeout = CONNECT_TIMEOUT;
+	if (parse_client_opts(argc - nr, argv + nr, &cfg)) {
+		print_help();
+		return EINVAL;
+	}
+
+	init_pace(cfg.rate);
+	ret = resolve_server(&cfg);
+	if (ret)
+		return -ret;
+
+	ret = internal_run_client(&cfg);
+	freeaddrinfo(cfg.addrs);
+	return -ret;
 }
@@ -8,23 +8,135 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "ftransfer.h"
+#include "log.h"
 
 static const char *app = NULL;
 
 void print_help(void)
 {
 	printf("Usage: \n");
-	printf("  %s server [bind_addr] [bind_port]\n", app);
-	printf("  %s client [server_addr] [server_port] [filename]\n", app);
+	printf("  %s server [bind_addr] [bind_port] [options]\n", app);
+	printf("  %s client [server_addr] [server_port] [file|dir]... [options]\n",
+	       app);
+	printf("  %s stats [socket_path]\n", app);
+	printf("\nServer options:\n");
+	printf("  --engine <epoll|io_uring>    Event engine (default: epoll)\n");
+	printf("  --splice <on|off>            Splice file content to disk, epoll\n"
+	       "                               engine only (default: on)\n");
+	printf("  --preallocate <on|off>       Reserve the announced file size\n"
+	       "                               with fallocate() (default: on)\n");
+	printf("  --durability <mode>          none, fdatasync (every file) or\n"
+	       "                               group (batched commits by a\n"
+	       "                               background syncer, default)\n");
+	printf("  --sync-interval <ms>         Group commit interval (default: 10)\n");
+	printf("  --sync-batch <N>             Commit early once N files are\n"
+	       "                               waiting (default: 64)\n");
+	printf("  --workers <N>                Number of worker threads, each\n"
+	       "                               with its own SO_REUSEPORT socket\n"
+	       "                               (default: 1)\n");
+	printf("  --writers <N>                Disk writer threads, epoll engine\n"
+	       "                               only, 0 writes inline (default: 0)\n");
+	printf("  --writer-budget <KiB>        Queued writes per client before it\n"
+	       "                               stops being read (default: 256)\n");
+	printf("  --max-clients <N>            Concurrent clients per worker\n"
+	       "                               (default: 100)\n");
+	printf("  --backlog <N>                listen() backlog, capped by\n"
+	       "                               net.core.somaxconn (default: 4096)\n");
+	printf("  --recv-buffer <KiB>          Receive buffer per client, a power\n"
+	       "                               of two from 4 to 1024 (default: 16)\n");
+	printf("  --recv-buffer-max <KiB>      Grow the receive buffer of a client\n"
+	       "                               whose recv() keeps filling it, up\n"
+	       "                               to this size, epoll engine only\n"
+	       "                               (default: off)\n");
+	printf("  --sock-rcvbuf <KiB>          SO_RCVBUF, about twice the\n"
+	       "                               bandwidth-delay product, 0 keeps\n"
+	       "                               the kernel autotuning (default: 0)\n");
+	printf("  --congestion <name>          TCP congestion control, e.g. bbr\n"
+	       "                               (default: the system default)\n");
+	printf("  --quantum <KiB>              Bytes a ready client may send per\n"
+	       "                               event loop round, times the weight\n"
+	       "                               of its class, 0 is one recv() per\n"
+	       "                               event, epoll engine only\n"
+	       "                               (default: the largest receive\n"
+	       "                               buffer, at least 64, or a splice\n"
+	       "                               pipe over the largest weight)\n");
+	printf("  --class <addr>/<bits>:<w>    Clients from this network get\n"
+	       "                               weight w, 1 to 64, instead of 1.\n"
+	       "                               Up to 7, the first match wins, the\n"
+	       "                               stats report bytes per class\n");
+	printf("  --busy-poll <usec>           Spin this long for new events\n"
+	       "                               before sleeping, and set\n"
+	       "                               SO_BUSY_POLL. Costs a CPU per\n"
+	       "                               worker, the spin is epoll engine\n"
+	       "                               only (default: 0, off)\n");
+	printf("  --huge-pages <on|off>        Back receive buffers with huge\n"
+	       "                               pages (default: off)\n");
+	printf("  --pin-cpu <on|off>           Pin each worker to a CPU\n"
+	       "                               (default: off)\n");
+	printf("  --header-timeout <sec>       Time allowed to send the file\n"
+	       "                               info, 0 disables (default: 30)\n");
+	printf("  --idle-timeout <sec>         Close clients that send nothing\n"
+	       "                               for this long, 0 disables\n"
+	       "                               (default: 120)\n");
+	printf("  --min-rate <bytes/s>         Close clients slower than this,\n"
+	       "                               0 disables (default: 0)\n");
+	printf("  --rate-window <sec>          Window for --min-rate\n"
+	       "                               (default: 30)\n");
+	printf("  --log-level <level>          crit, err, warn, info or debug\n"
+	       "                               (default: info)\n");
+	printf("  --stats-socket <path>        Serve live counters, histograms\n"
+	       "                               and the client list on a Unix\n"
+	       "                               socket (default: off)\n");
+	printf("\nClient options:\n");
+	printf("  Several files, or a directory, are sent over one\n"
+	       "  connection when the server supports it.\n");
+	printf("  --send-buffer <KiB>          Read and send() size, 4 to 1024\n"
+	       "                               (default: 16)\n");
+	printf("  --sock-sndbuf <KiB>          SO_SNDBUF, 0 keeps the kernel\n"
+	       "                               autotuning (default: 0)\n");
+	printf("  --congestion <name>          TCP congestion control, e.g. bbr\n"
+	       "                               (default: the system default)\n");
+	printf("  --streams <N>                Send files of 8 MiB and up as N\n"
+	       "                               byte ranges over N connections,\n"
+	       "                               1 to 64 (default: 1)\n");
+	printf("  --resume <on|off>            Continue an interrupted upload of\n"
+	       "                               a file of 1 MiB and up where it\n"
+	       "                               stopped (default: on)\n");
+	printf("  --send-mode <mode>           How regular files are sent: copy\n"
+	       "                               (read() + send()), sendfile, or\n"
+	       "                               zerocopy (mmap() + MSG_ZEROCOPY,\n"
+	       "                               falls back to sendfile where the\n"
+	       "                               kernel copies) (default: sendfile)\n");
+	printf("  --connect-timeout <ms>       Give up connecting after this long,\n"
+	       "                               the server's IPv6 and IPv4\n"
+	       "                               addresses are tried in parallel,\n"
+	       "                               250 ms apart (default: 10000)\n");
+	printf("  --read-ahead <N>             Buffers of 256 KiB a thread reads\n"
+	       "                               ahead of the sends when copying,\n"
+	       "                               0 to 64, 0 reads inline\n"
+	       "                               (default: 4)\n");
+	printf("  --rate <KiB/s>               Cap the upload rate of the client,\n"
+	       "                               all connections together, paced\n"
+	       "                               by TCP (default: 0, no cap)\n");
+	printf("\nEnvironment:\n");
+	printf("  FTRANSFER_LOG_LEVEL=<level>  Log level of every command,\n"
+	       "                               --log-level overrides it\n");
 }
 
 
 int main(int argc, char *argv[])
 {
+	const char *log_env;
+
 	app = argv[0];
 
+	log_env = getenv("FTRANSFER_LOG_LEVEL");
+	if (log_env && log_parse_level(log_env, &log_level))
+		pr_warn("Invalid FTRANSFER_LOG_LEVEL \"%s\"\n", log_env);
+
 	if (argc < 2) {
 		print_help();
 		return 0;
@@ -35,8 +147,10 @@ int main(int argc, char *argv[])
 		return run_server(argc, argv + 2);
 	else if (!strncmp("client", argv[1], 6))
 		return run_client(argc, argv + 2);
+	else if (!strncmp("stats", argv[1], 5))
+		return run_stats(argc, argv + 2);
 
-	printf("Error: Invalid argument \"%s\"\n\n", argv[1]);
+	pr_err("Invalid argument \"%s\"\n\n", argv[1]);
 	print_help();
 	return EINVAL;
 }
@@ -13,6 +13,7 @@
 void print_help(void);
 int run_server(int argc, char *argv[]);
 int run_client(int argc, char *argv[]);
+int run_stats(int argc, char *argv[]);
 
 typedef struct __attribute__((packed)) packet_t {
 	uint64_t	file_size;
@@ -20,6 +21,46 @@ typedef struct __attribute__((packed)) packet_t {
 	char		file_name[0xffu];
 } packet_t;
 
+/*
+ * A header with this file_size is a control packet, not a file.
+ * The only one so far is FT_HELLO, sent first on a connection
+ * that is going to carry many files. The server answers with a
+ * big endian uint32_t of the FT_FEAT_* bits it enables for the
+ * connection. Servers that don't know it close the connection.
+ */
+#define FT_CTRL_SIZE		UINT64_MAX
+#define FT_HELLO		"ftransfer-hello"
+#define FT_FEAT_PERSIST		(1u << 0)	/* Many files per connection */
+#define FT_FEAT_RANGES		(1u << 1)	/* Byte range headers        */
+#define FT_FEAT_RESUME		(1u << 2)	/* Resume headers            */
+
+/*
+ * A header with this file_size starts one byte range of a file
+ * that is sent over several connections, a range_hdr_t follows
+ * it. Only allowed once the server enabled FT_FEAT_RANGES.
+ */
+#define FT_RANGE_SIZE		(UINT64_MAX - 1u)
+
+typedef struct __attribute__((packed)) range_hdr_t {
+	uint64_t	xfer_id;	/* Same on every range of the file */
+	uint64_t	file_size;	/* Size of the whole file          */
+	uint64_t	offset;		/* First byte of this range        */
+	uint64_t	length;		/* Bytes in this range             */
+} range_hdr_t;
+
+/*
+ * A header with this file_size starts a file that can be resumed,
+ * a resume_hdr_t follows it. The server answers with a big endian
+ * uint64_t of the bytes it already holds of that very file, only
+ * the rest of the content follows. Only allowed once the server
+ * enabled FT_FEAT_RESUME.
+ */
+#define FT_RESUME_SIZE		(UINT64_MAX - 2u)
+
+typedef struct __attribute__((packed)) resume_hdr_t {
+	uint64_t	file_size;	/* Size of the whole file          */
+	uint64_t	fingerprint;	/* Of the content, client defined  */
+} resume_hdr_t;
 
 
 #endif
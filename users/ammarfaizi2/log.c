@@ -0,0 +1,463 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer logger
+ *
+ * Every thread formats its messages into its own single producer
+ * single consumer ring, a background thread writes them out. A
+ * stalled stdout then only stalls the logger thread, the rings
+ * fill up and further messages are dropped and counted instead
+ * of blocking the event loops.
+ *
+ * Without the logger thread (the client, or before log_start())
+ * the messages are written synchronously.
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+
+#define LOG_BATCH_NS		(1000000l)	/* Wait for more, 1 ms    */
+
+struct log_rec {
+	uint64_t		ts_ns;		/* CLOCK_REALTIME             */
+	uint16_t		len;		/* Bytes in text              */
+	uint8_t			level;
+	char			text[LOG_MSG_SIZE];
+};
+
+/*
+ * head is only written by the logger thread and tail only by
+ * the owner thread, keep them on different cache lines.
+ */
+struct log_ring {
+	_Alignas(64) uint32_t	head;
+	uint64_t		reported;	/* Drops already reported     */
+	_Alignas(64) uint32_t	tail;
+	uint64_t		dropped;	/* Ring was full              */
+	struct log_ring		*next;
+	struct log_rec		recs[LOG_RING_SIZE];
+};
+
+struct log_clock {
+	time_t			sec;		/* Second of buf              */
+	char			buf[32];	/* Formatted local time       */
+};
+
+struct logger {
+	pthread_mutex_t		lock;		/* Serializes registration    */
+	struct log_ring		*rings;		/* One per logging thread     */
+	pthread_t		thread;
+	bool			has_thread;
+	bool			running;	/* Queue the messages?        */
+	bool			stop;
+	uint32_t		sleeping;	/* Waiting on event_fd?       */
+	int			event_fd;
+	struct log_clock	clock;		/* Logger thread only         */
+};
+
+enum log_level log_level = LOG_INFO;
+
+static struct logger g_log = {
+	.lock     = PTHREAD_MUTEX_INITIALIZER,
+	.event_fd = -1,
+	.clock    = { .sec = -1 },
+};
+
+static _Thread_local struct log_ring *tls_ring;
+
+static const char * const level_prefix[] = {
+	[LOG_CRIT] = "Bug: ",
+	[LOG_ERR]  = "Error: ",
+	[LOG_WARN] = "Warning: ",
+	[LOG_INFO] = "",
+	[LOG_DBG]  = "Debug: ",
+};
+
+
+static uint64_t realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+static const char *format_time(struct log_clock *clock, uint64_t ts_ns)
+{
+	struct tm tm;
+	time_t sec = (time_t)(ts_ns / 1000000000u);
+
+	if (sec != clock->sec) {
+		localtime_r(&sec, &tm);
+		strftime(clock->buf, sizeof(clock->buf), "%F %T", &tm);
+		clock->sec = sec;
+	}
+
+	return clock->buf;
+}
+
+
+static void write_line(struct log_clock *clock, uint8_t level, uint64_t ts_ns,
+		       const char *text, size_t len)
+{
+	bool nl = (len == 0 || text[len - 1] != '\n');
+
+	fprintf(stdout, "%s.%03u %s%.*s%s", format_time(clock, ts_ns),
+		(unsigned)(ts_ns / 1000000u % 1000u), level_prefix[level],
+		(int)len, text, nl ? "\n" : "");
+}
+
+
+static void log_sync(enum log_level level, const char *fmt, va_list ap)
+{
+	int len;
+	char text[LOG_MSG_SIZE];
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	static struct log_clock clock = { .sec = -1 };
+
+	len = vsnprintf(text, sizeof(text), fmt, ap);
+	if (len < 0)
+		return;
+	if ((size_t)len >= sizeof(text))
+		len = sizeof(text) - 1;
+
+	pthread_mutex_lock(&lock);
+	write_line(&clock, level, realtime_ns(), text, (size_t)len);
+	if (level == LOG_CRIT)
+		fflush(stdout);
+	pthread_mutex_unlock(&lock);
+}
+
+
+static struct log_ring *get_ring(void)
+{
+	struct log_ring *ring = tls_ring;
+
+	if (ring != NULL)
+		return ring;
+
+	ring = aligned_alloc(64, sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+
+	ring->head     = 0;
+	ring->tail     = 0;
+	ring->dropped  = 0;
+	ring->reported = 0;
+
+	pthread_mutex_lock(&g_log.lock);
+	ring->next = g_log.rings;
+	__atomic_store_n(&g_log.rings, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&g_log.lock);
+
+	tls_ring = ring;
+	return ring;
+}
+
+
+static void kick_logger(void)
+{
+	uint64_t val = 1;
+
+	/*
+	 * Can't fail on a valid eventfd, and there would be
+	 * nowhere to report it anyway.
+	 */
+	if (write(g_log.event_fd, &val, sizeof(val)) < 0)
+		return;
+}
+
+
+void log_msg(enum log_level level, const char *fmt, ...)
+{
+	int len;
+	va_list ap;
+	uint32_t tail;
+	struct log_rec *rec;
+	struct log_ring *ring;
+
+	if (level > log_level)
+		return;
+
+	va_start(ap, fmt);
+	if (level == LOG_CRIT ||
+	    !__atomic_load_n(&g_log.running, __ATOMIC_ACQUIRE) ||
+	    (ring = get_ring()) == NULL) {
+		log_sync(level, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	tail = ring->tail;
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >=
+	    LOG_RING_SIZE) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1u,
+				 __ATOMIC_RELAXED);
+		va_end(ap);
+		return;
+	}
+
+	rec = &ring->recs[tail & (LOG_RING_SIZE - 1u)];
+	len = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		len = 0;
+	if ((size_t)len >= sizeof(rec->text))
+		len = sizeof(rec->text) - 1;
+
+	rec->ts_ns = realtime_ns();
+	rec->len   = (uint16_t)len;
+	rec->level = (uint8_t)level;
+	__atomic_store_n(&ring->tail, tail + 1u, __ATOMIC_RELEASE);
+
+	/*
+	 * Same handshake as the disk writers, the logger either
+	 * sees this record or we see its sleeping flag.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&g_log.sleeping, __ATOMIC_RELAXED))
+		kick_logger();
+}
+
+
+bool log_ratelimit(struct log_ratelimit *rl, const char *func)
+{
+	uint32_t missed;
+	struct timespec ts;
+	uint64_t now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	now = (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+
+	if (rl->begin == 0 || now - rl->begin >= LOG_RL_INTERVAL) {
+		missed = rl->missed;
+		rl->begin   = now;
+		rl->printed = 0;
+		rl->missed  = 0;
+		if (missed)
+			pr_warn("%s: %u messages suppressed\n", func, missed);
+	}
+
+	if (rl->printed < LOG_RL_BURST) {
+		rl->printed++;
+		return true;
+	}
+
+	rl->missed++;
+	return false;
+}
+
+
+int log_parse_level(const char *str, enum log_level *level)
+{
+	static const char * const names[] = {
+		[LOG_CRIT] = "crit",
+		[LOG_ERR]  = "err",
+		[LOG_WARN] = "warn",
+		[LOG_INFO] = "info",
+		[LOG_DBG]  = "debug",
+	};
+
+	for (uint32_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (!strcasecmp(str, names[i])) {
+			*level = (enum log_level)i;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+
+uint64_t log_dropped(void)
+{
+	uint64_t total = 0;
+	struct log_ring *ring;
+
+	ring = __atomic_load_n(&g_log.rings, __ATOMIC_ACQUIRE);
+	for (; ring; ring = ring->next)
+		total += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+	return total;
+}
+
+
+static uint32_t drain_ring(struct log_ring *ring)
+{
+	int len;
+	char text[64];
+	uint64_t dropped;
+	uint32_t nr = 0, head = ring->head;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	struct log_rec *rec;
+
+	for (; head != tail; head++, nr++) {
+		rec = &ring->recs[head & (LOG_RING_SIZE - 1u)];
+		write_line(&g_log.clock, rec->level, rec->ts_ns, rec->text,
+			   rec->len);
+	}
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+	dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped != ring->reported) {
+		len = snprintf(text, sizeof(text), "%" PRIu64 " log messages "
+			       "dropped\n", dropped - ring->reported);
+		write_line(&g_log.clock, LOG_WARN, realtime_ns(), text,
+			   (size_t)len);
+		ring->reported = dropped;
+	}
+
+	return nr;
+}
+
+
+static uint32_t drain_rings(void)
+{
+	uint32_t nr = 0;
+	struct log_ring *ring;
+
+	ring = __atomic_load_n(&g_log.rings, __ATOMIC_ACQUIRE);
+	for (; ring; ring = ring->next)
+		nr += drain_ring(ring);
+
+	return nr;
+}
+
+
+static bool rings_have_work(void)
+{
+	struct log_ring *ring;
+
+	ring = __atomic_load_n(&g_log.rings, __ATOMIC_ACQUIRE);
+	for (; ring; ring = ring->next) {
+		if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head)
+			return true;
+	}
+
+	return false;
+}
+
+
+static void *run_logger(void *arg)
+{
+	uint64_t val;
+	struct timespec batch = { .tv_nsec = LOG_BATCH_NS };
+
+	for (;;) {
+		if (drain_rings()) {
+			/*
+			 * One write() for everything that arrives
+			 * in the next millisecond.
+			 */
+			fflush(stdout);
+			nanosleep(&batch, NULL);
+			continue;
+		}
+
+		/*
+		 * Pairs with the fence in log_msg(), a record is
+		 * either seen here or the producer sees the flag.
+		 */
+		__atomic_store_n(&g_log.sleeping, 1u, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (rings_have_work()) {
+			__atomic_store_n(&g_log.sleeping, 0u, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		fflush(stdout);
+		if (__atomic_load_n(&g_log.stop, __ATOMIC_ACQUIRE))
+			break;
+
+		if (read(g_log.event_fd, &val, sizeof(val)) < 0 &&
+		    errno != EINTR)
+			break;
+		__atomic_store_n(&g_log.sleeping, 0u, __ATOMIC_RELAXED);
+	}
+
+	return arg;
+}
+
+
+int log_start(void)
+{
+	int ret;
+	sigset_t set, old;
+
+	g_log.event_fd = eventfd(0, EFD_CLOEXEC);
+	if (g_log.event_fd < 0) {
+		ret = errno;
+		pr_err("eventfd(): %s\n", strerror(ret));
+		return -ret;
+	}
+
+	/*
+	 * Whatever was written synchronously goes out first.
+	 */
+	fflush(stdout);
+
+	/*
+	 * Signals are handled by the main thread.
+	 */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	ret = pthread_create(&g_log.thread, NULL, run_logger, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		pr_err("pthread_create(): %s\n", strerror(ret));
+		close(g_log.event_fd);
+		g_log.event_fd = -1;
+		return -ret;
+	}
+
+	g_log.has_thread = true;
+	__atomic_store_n(&g_log.running, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/*
+ * Must be called after every other thread has stopped logging,
+ * the queued messages are written before it returns.
+ */
+void log_stop(void)
+{
+	struct log_ring *ring, *next;
+
+	if (!g_log.has_thread)
+		return;
+
+	__atomic_store_n(&g_log.running, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&g_log.stop, true, __ATOMIC_RELEASE);
+	kick_logger();
+	pthread_join(g_log.thread, NULL);
+	g_log.has_thread = false;
+	close(g_log.event_fd);
+	g_log.event_fd = -1;
+
+	for (ring = g_log.rings; ring; ring = next) {
+		next = ring->next;
+		free(ring);
+	}
+	g_log.rings = NULL;
+	tls_ring    = NULL;
+}
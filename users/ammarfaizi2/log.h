@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer logger
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define LOG_RING_SIZE		(256u)		/* Records, power of two  */
+#define LOG_MSG_SIZE		(496u)
+#define LOG_RL_INTERVAL		(5000u)		/* Milliseconds           */
+#define LOG_RL_BURST		(10u)
+
+enum log_level {
+	LOG_CRIT	= 0,	/* Never queued, e.g. right before abort() */
+	LOG_ERR		= 1,
+	LOG_WARN	= 2,
+	LOG_INFO	= 3,
+	LOG_DBG		= 4,
+};
+
+/*
+ * Per call site, per thread.
+ */
+struct log_ratelimit {
+	uint64_t	begin;		/* Window start, milliseconds         */
+	uint32_t	printed;	/* Messages in this window            */
+	uint32_t	missed;		/* Suppressed in this window          */
+};
+
+extern enum log_level log_level;
+
+void log_msg(enum log_level level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+bool log_ratelimit(struct log_ratelimit *rl, const char *func);
+int log_parse_level(const char *str, enum log_level *level);
+uint64_t log_dropped(void);
+int log_start(void);
+void log_stop(void);
+
+#define pr_crit(...)	log_msg(LOG_CRIT, __VA_ARGS__)
+#define pr_err(...)	log_msg(LOG_ERR, __VA_ARGS__)
+#define pr_warn(...)	log_msg(LOG_WARN, __VA_ARGS__)
+#define pr_info(...)	log_msg(LOG_INFO, __VA_ARGS__)
+
+/*
+ * The arguments are not even evaluated unless the debug
+ * level is enabled.
+ */
+#define pr_dbg(...)						\
+do {								\
+	if (log_level >= LOG_DBG)				\
+		log_msg(LOG_DBG, __VA_ARGS__);			\
+} while (0)
+
+/*
+ * At most LOG_RL_BURST messages every LOG_RL_INTERVAL ms
+ * from one call site.
+ */
+#define log_ratelimited(LEVEL, ...)				\
+do {								\
+	static _Thread_local struct log_ratelimit log_rl;	\
+	if (log_level >= (LEVEL) &&				\
+	    log_ratelimit(&log_rl, __func__))			\
+		log_msg((LEVEL), __VA_ARGS__);			\
+} while (0)
+
+#define pr_err_ratelimited(...)	 log_ratelimited(LOG_ERR, __VA_ARGS__)
+#define pr_warn_ratelimited(...) log_ratelimited(LOG_WARN, __VA_ARGS__)
+
+
+#endif
@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer server (scheduling classes)
+ *
+ * Every channel belongs to a class, picked by its peer address
+ * when it is accepted. The epoll engine serves the ready channels
+ * deficit round robin: each round a channel may receive up to
+ * quantum * weight bytes of its class, so a fast peer can't take
+ * the whole event loop from the slow ones.
+ *
+ * Class 0 is "default", for the peers no --class matches.
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "server.h"
+
+
+void sched_init_cfg(struct server_cfg *cfg)
+{
+	struct sched_class *cls = &cfg->classes[0];
+
+	snprintf(cls->name, sizeof(cls->name), "default");
+	cls->net    = 0;
+	cls->mask   = 0;
+	cls->weight = 1;
+	cfg->nr_classes = 1;
+	cfg->quantum    = QUANTUM_AUTO;
+}
+
+
+/*
+ * A round must allow at least one full recv(), or a channel on
+ * a grown buffer pays an extra epoll_wait() per buffer. When
+ * splicing, the heaviest class gets a full pipe per round; the
+ * lighter ones still get their share of it.
+ */
+void sched_fix_quantum(struct server_cfg *cfg)
+{
+	uint32_t max_weight = 1;
+
+	if (cfg->quantum != QUANTUM_AUTO)
+		return;
+
+	cfg->quantum = DEFAULT_QUANTUM * 1024u;
+	if (cfg->quantum < cfg->recv_buf_max)
+		cfg->quantum = cfg->recv_buf_max;
+
+	if (!cfg->use_splice || cfg->nr_writers)
+		return;
+
+	for (uint32_t i = 0; i < cfg->nr_classes; i++) {
+		if (max_weight < cfg->classes[i].weight)
+			max_weight = cfg->classes[i].weight;
+	}
+	if (cfg->quantum < SPLICE_PIPE_SIZE / max_weight)
+		cfg->quantum = SPLICE_PIPE_SIZE / max_weight;
+}
+
+
+/*
+ * @val is "<addr>/<bits>:<weight>", e.g. "10.0.0.0/8:4".
+ */
+int sched_add_class(struct server_cfg *cfg, const char *val)
+{
+	char *end;
+	char addr[INET_ADDRSTRLEN];
+	unsigned long bits, weight;
+	const char *slash, *colon;
+	struct in_addr in;
+	struct sched_class *cls;
+
+	if (cfg->nr_classes >= SCHED_MAX_CLASSES) {
+		pr_err("Too many --class, at most %u\n", SCHED_MAX_CLASSES - 1u);
+		return -EINVAL;
+	}
+
+	slash = strchr(val, '/');
+	colon = strrchr(val, ':');
+	if (slash == NULL || colon == NULL || colon < slash ||
+	    (size_t)(slash - val) >= sizeof(addr))
+		goto out_inval;
+
+	memcpy(addr, val, (size_t)(slash - val));
+	addr[slash - val] = '\0';
+	if (inet_pton(AF_INET, addr, &in) != 1)
+		goto out_inval;
+
+	bits = strtoul(slash + 1, &end, 10);
+	if (end != colon || end == slash + 1 || bits > 32)
+		goto out_inval;
+
+	weight = strtoul(colon + 1, &end, 10);
+	if (*end != '\0' || end == colon + 1 || weight < 1 ||
+	    weight > SCHED_WEIGHT_MAX)
+		goto out_inval;
+
+	cls = &cfg->classes[cfg->nr_classes++];
+	cls->mask   = bits ? ~0u << (32u - bits) : 0;
+	cls->net    = ntohl(in.s_addr) & cls->mask;
+	cls->weight = (uint32_t)weight;
+	snprintf(cls->name, sizeof(cls->name), "%.*s", (int)(colon - val),
+		 val);
+	return 0;
+
+out_inval:
+	pr_err("Invalid --class \"%s\", want <addr>/<bits>:<weight> with a "
+	       "weight of 1 to %u\n", val, SCHED_WEIGHT_MAX);
+	return -EINVAL;
+}
+
+
+/*
+ * The first matching --class wins.
+ */
+uint8_t sched_classify(const struct server_cfg *cfg,
+		       const struct sockaddr_in *addr)
+{
+	uint32_t ip;
+
+	if (addr->sin_family != AF_INET)
+		return 0;
+
+	ip = ntohl(addr->sin_addr.s_addr);
+	for (uint32_t i = 1; i < cfg->nr_classes; i++) {
+		if ((ip & cfg->classes[i].mask) == cfg->classes[i].net)
+			return (uint8_t)i;
+	}
+	return 0;
+}
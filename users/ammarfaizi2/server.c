@@ -5,93 +5,75 @@
  * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
  */
 
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
 #ifndef _DEFAULT_SOURCE
 #  define _DEFAULT_SOURCE
 #endif
 
 #include <stdio.h>
 #include <errno.h>
-#include <assert.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <endian.h>
-#include <stdbool.h>
 #include <inttypes.h>
 #include <sys/epoll.h>
-#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+#include <sys/resource.h>
 #include <netinet/tcp.h>
 
-#include "ftransfer.h"
-
-
-#define DEBUG			(0)
-#define MAX_CLIENTS		(100u)
-#define EPOLL_MAP_SIZE		(0xffffu)
-#define EPOLL_MAP_TO_NOP	(0x0u)
-#define EPOLL_MAP_TO_TCP	(0x1u)
-#define EPOLL_MAP_SHIFT		(0x2u)
-#define EPOLL_INPUT_EVT		(EPOLLIN | EPOLLPRI)
-#define RECV_BUFFER_SIZE	(0x4000u)
-
-/* Macros for printing  */
-#define W_IP(CHAN) ((CHAN)->src_ip), ((CHAN)->src_port)
-#define W_IU(CHAN) W_IP(CHAN)
-#define PRWIU "%s:%u"
-
-#ifndef INET_ADDRSTRLEN
-#  define IPV4_L (sizeof("xxx.xxx.xxx.xxx"))
-#else
-#  define IPV4_L (INET_ADDRSTRLEN)
-#endif
-
-#if DEBUG
-#  define printf_dbg(...) printf(__VA_ARGS__)
-#else
-#  define printf_dbg(...)
-#endif
+#include "server.h"
 
 
-union uni_pkt {
-	packet_t	packet;
-	char		raw_buf[RECV_BUFFER_SIZE];
-};
+static struct server_state *g_shards;
+static uint32_t g_nr_shards;
 
-static_assert(RECV_BUFFER_SIZE >= sizeof(packet_t), "Bad RECV_BUFFER_SIZE");
 
-struct client_channel {
-	bool		is_used;	/* Is this channel used?              */
-	bool		got_file_info;	/* Have we received file info?        */
-	int		cli_fd;		/* Client file descriptor             */
-	size_t		recv_s;		/* How many active bytes in packet?   */
-	uint16_t	arr_idx;	/* Index in the channel array         */
-	char		src_ip[IPV4_L];	/* Human readable src IPv4            */
-	uint16_t	src_port;	/* Human readable src port            */
-	uint64_t	recv_file_len;	/* Received file bytes                */
-	uint64_t	file_size;	/* File size                          */
-	char		file_name[256];	/* File name                          */
-	FILE		*handle;	/* File handle                        */
-	union uni_pkt	pktbuf;		/* Packet buffer                      */
-};
+/*
+ * Async-signal-safe, called from the signal handler too.
+ */
+void wake_shard(struct server_state *state)
+{
+	int err = errno;
+	ssize_t ret = 0;
+	uint64_t val = 1;
+	int fd = __atomic_load_n(&state->wake_fd, __ATOMIC_RELAXED);
 
-struct server_state {
-	bool			stop_el;	/* Stop the event loop?       */
-	int			tcp_fd;		/* Main TCP file descriptor   */
-	int			epoll_fd;	/* Epoll file descriptor      */
-	struct client_channel	*chans;		/* Channel array              */
-	uint16_t		*epoll_map;	/* Mapping for O(1) retrieval */
-	uint16_t		av_client;	/* How many unused array slot?*/
-	const char		*storage_path;	/* Path to save uploaded files*/
-};
+	/*
+	 * It can only fail with EAGAIN, the counter is full
+	 * and epoll_wait() returns anyway.
+	 */
+	if (fd != -1)
+		ret = write(fd, &val, sizeof(val));
+	(void)ret;
+	errno = err;
+}
 
 
-static struct server_state *g_state;
+static void stop_all_shards(void)
+{
+	for (uint32_t i = 0; i < g_nr_shards; i++) {
+		g_shards[i].stop_el = true;
+		wake_shard(&g_shards[i]);
+	}
+}
 
 
 static void handle_interrupt(int sig)
 {
-	g_state->stop_el = true;
+	stop_all_shards();
 	putchar('\n');
 	(void)sig;
 }
@@ -101,54 +83,234 @@ static inline void *calloc_wrp(size_t nmemb, size_t size)
 {
 	void *ret = calloc(nmemb, size);
 	if (ret == NULL) {
-		printf("Error: calloc(): %s\n", strerror(ENOMEM));
+		pr_err("calloc(): %s\n", strerror(ENOMEM));
 		errno = ENOMEM;
 	}
 	return ret;
 }
 
 
-static inline void reset_client(struct client_channel *chan, uint16_t idx)
+static inline void reset_client(struct client_channel *chan, uint32_t idx)
 {
 	chan->is_used       = false;
 	chan->got_file_info = false;
+	chan->is_closing    = false;
+	chan->recv_armed    = false;
+	chan->persistent    = false;
+	chan->ranges        = false;
+	chan->resume        = false;
+	chan->resumable     = false;
 	chan->cli_fd        = -1;
 	chan->recv_s        = 0;
 	chan->arr_idx       = idx;
+	chan->io_inflight   = 0;
 	chan->file_size     = 0;
+	chan->file_off      = 0;
+	chan->xfer          = NULL;
 	chan->recv_file_len = 0;
+	chan->write_off     = 0;
 	chan->handle        = NULL;
+	chan->pipe_fd[0]    = -1;
+	chan->pipe_fd[1]    = -1;
+	chan->splicing      = false;
+	chan->pipe_size     = 0;
+	chan->no_splice     = false;
+	chan->pktbuf        = NULL;
+	chan->wr_bytes      = 0;
+	chan->rx_paused     = false;
+	chan->src_ip[0]     = '\0';
+	memset(&chan->src_addr, 0, sizeof(chan->src_addr));
+	chan->timer.next    = NULL;
+	chan->timer.pprev   = NULL;
+	chan->accept_tick   = 0;
+	chan->header_tick   = 0;
+	chan->active_tick   = 0;
+	chan->win_tick      = 0;
+	chan->win_bytes     = 0;
+	chan->rx_bytes      = 0;
+	chan->file_start_us = 0;
+	chan->buf_class     = 0;
+	chan->full_recvs    = 0;
+	chan->sched_class   = 0;
+	chan->deficit       = 0;
 }
 
 
 static int init_channels(struct server_state *state)
 {
-	struct client_channel *chans;
+	uint32_t max_clients = state->cfg->max_clients;
+	uint32_t nr_slabs;
+
+	/*
+	 * Channels are allocated lazily, one slab at a time,
+	 * only the slab table and the free slot stack are
+	 * sized up front.
+	 */
+	nr_slabs = (max_clients + CHAN_SLAB_SIZE - 1u) >> CHAN_SLAB_SHIFT;
+	state->chan_slabs = calloc_wrp(nr_slabs, sizeof(*state->chan_slabs));
+	if (state->chan_slabs == NULL)
+		return -ENOMEM;
+
+	state->free_slots = calloc_wrp(max_clients, sizeof(*state->free_slots));
+	if (state->free_slots == NULL)
+		return -ENOMEM;
+
+	state->nr_chans = 0;
+	state->nr_free  = 0;
+	return 0;
+}
+
+
+static int grow_channels(struct server_state *state)
+{
+	uint32_t base = state->nr_chans;
+	uint32_t nr = state->cfg->max_clients - base;
+	struct client_channel *slab;
+
+	if (nr == 0)
+		return -EAGAIN;
+
+	if (nr > CHAN_SLAB_SIZE)
+		nr = CHAN_SLAB_SIZE;
 
-	chans = calloc_wrp(MAX_CLIENTS, sizeof(*chans));
-	if (chans == NULL)
+	slab = calloc_wrp(nr, sizeof(*slab));
+	if (slab == NULL)
 		return -ENOMEM;
 
-	for (uint16_t i = 0; i < MAX_CLIENTS; i++)
-		reset_client(&chans[i], i);
+	state->chan_slabs[base >> CHAN_SLAB_SHIFT] = slab;
+	state->nr_chans += nr;
+
+	/*
+	 * Push in reverse order, so the lowest index is
+	 * popped first.
+	 */
+	for (uint32_t i = nr; i--;) {
+		reset_client(&slab[i], base + i);
+		state->free_slots[state->nr_free++] = base + i;
+	}
 
-	state->chans = chans;
 	return 0;
 }
 
 
+static struct client_channel *alloc_channel(struct server_state *state)
+{
+	if (state->nr_free == 0 && grow_channels(state))
+		return NULL;
+
+	return get_channel(state, state->free_slots[--state->nr_free]);
+}
+
+
+static inline void free_channel(struct server_state *state,
+				struct client_channel *chan)
+{
+	state->free_slots[state->nr_free++] = chan->arr_idx;
+}
+
+
+static uint32_t get_fd_limit(void)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) < 0) {
+		pr_err("getrlimit(RLIMIT_NOFILE): %s\n",
+		       strerror(errno));
+		return 1024u;
+	}
+
+	/*
+	 * Take the whole hard limit, we are going to need it
+	 * for lots of clients.
+	 */
+	if (rlim.rlim_cur < rlim.rlim_max) {
+		rlim.rlim_cur = rlim.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rlim) < 0)
+			getrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	if (rlim.rlim_cur == RLIM_INFINITY || rlim.rlim_cur > EPOLL_MAP_MAX)
+		return EPOLL_MAP_MAX;
+
+	return (uint32_t)rlim.rlim_cur;
+}
+
+
 static int init_epoll_map(struct server_state *state)
 {
-	uint16_t *epoll_map;
+	uint32_t *epoll_map;
+	uint32_t size = get_fd_limit();
 
-	epoll_map = calloc_wrp(MAX_CLIENTS, sizeof(*epoll_map));
+	/*
+	 * epoll_map is indexed by file descriptor, not by
+	 * channel index. A file descriptor can't go beyond
+	 * RLIMIT_NOFILE.
+	 */
+	epoll_map = calloc_wrp(size, sizeof(*epoll_map));
 	if (epoll_map == NULL)
 		return -ENOMEM;
 
-	for (uint16_t i = 0; i < MAX_CLIENTS; i++)
+	for (uint32_t i = 0; i < size; i++)
 		epoll_map[i] = EPOLL_MAP_TO_NOP;
 
-	state->epoll_map = epoll_map;
+	state->epoll_map      = epoll_map;
+	state->epoll_map_size = size;
+	return 0;
+}
+
+
+static uint64_t get_tick(void)
+{
+	struct timespec ts;
+
+	/*
+	 * CLOCK_MONOTONIC_COARSE is served from the vDSO and its
+	 * resolution is far finer than a tick.
+	 */
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ((uint64_t)ts.tv_sec * 1000u +
+		(uint64_t)ts.tv_nsec / 1000000u) / TW_TICK_MS;
+}
+
+
+static inline uint64_t sec_to_ticks(uint32_t sec)
+{
+	return (uint64_t)sec * 1000u / TW_TICK_MS;
+}
+
+
+/*
+ * One pool per receive buffer size, from recv_buf_size up to
+ * recv_buf_max in powers of two.
+ */
+static int init_buf_pools(struct server_state *state)
+{
+	int ret;
+	uint64_t max_bufs;
+	uint32_t buf_size;
+	const struct server_cfg *cfg = state->cfg;
+
+	buf_size = cfg->recv_buf_size;
+	for (uint32_t i = 0; buf_size <= cfg->recv_buf_max; i++) {
+		/*
+		 * With the writer pool a channel holds up to its
+		 * budget in buffers that are waiting for the disk.
+		 */
+		max_bufs = cfg->max_clients;
+		if (cfg->nr_writers)
+			max_bufs *= 2u + cfg->writer_budget / buf_size;
+		if (max_bufs > UINT32_MAX)
+			max_bufs = UINT32_MAX;
+
+		ret = buf_pool_init(&state->buf_pools[i], (uint32_t)max_bufs,
+				    buf_size, cfg->huge_pages);
+		if (ret)
+			return ret;
+
+		state->nr_buf_pools = i + 1u;
+		buf_size *= 2u;
+	}
+
 	return 0;
 }
 
@@ -159,7 +321,8 @@ static int init_state(struct server_state *state)
 	state->stop_el   = false;
 	state->tcp_fd	 = -1;
 	state->epoll_fd	 = -1;
-	state->av_client = MAX_CLIENTS;
+	state->av_client = state->cfg->max_clients;
+	tw_init(&state->timers, get_tick());
 
 	ret = init_channels(state);
 	if (ret)
@@ -169,11 +332,76 @@ static int init_state(struct server_state *state)
 	if (ret)
 		return ret;
 
+	return init_buf_pools(state);
+}
+
+
+/*
+ * The accepted sockets inherit the buffer size, busy poll
+ * and congestion control of the listening socket. SO_RCVBUF
+ * must be set before listen(), the window scale is agreed
+ * on in the handshake.
+ */
+static int socket_tune(int tcp_fd, const struct server_state *state)
+{
+	int y;
+	int err;
+	socklen_t len = sizeof(y);
+	const struct server_cfg *cfg = state->cfg;
+
+	if (cfg->congestion != NULL &&
+	    setsockopt(tcp_fd, IPPROTO_TCP, TCP_CONGESTION, cfg->congestion,
+		       (socklen_t)strlen(cfg->congestion)) < 0) {
+		err = errno;
+		pr_err("setsockopt(tcp_fd, IPPROTO_TCP, TCP_CONGESTION, "
+		       "\"%s\"): %s (see net.ipv4.tcp_allowed_congestion_control)"
+		       "\n", cfg->congestion, strerror(err));
+		return -err;
+	}
+
+	/*
+	 * recv() spins on the device queue for this long when
+	 * there is no data yet. Going past net.core.busy_read
+	 * needs CAP_NET_ADMIN, the user space spin still works
+	 * without it.
+	 */
+	y = (int)cfg->busy_poll;
+	if (y && setsockopt(tcp_fd, SOL_SOCKET, SO_BUSY_POLL, &y, len) < 0 &&
+	    state->worker_id == 0)
+		pr_warn("setsockopt(tcp_fd, SOL_SOCKET, SO_BUSY_POLL): %s\n",
+			strerror(errno));
+
+	/*
+	 * Setting it turns the receive autotuning off, only do
+	 * it when asked. Only root can go past net.core.rmem_max.
+	 */
+	if (cfg->sock_rcvbuf == 0)
+		return 0;
+
+	y = (int)cfg->sock_rcvbuf;
+	if (setsockopt(tcp_fd, SOL_SOCKET, SO_RCVBUFFORCE, &y, len) < 0 &&
+	    setsockopt(tcp_fd, SOL_SOCKET, SO_RCVBUF, &y, len) < 0) {
+		err = errno;
+		pr_err("setsockopt(tcp_fd, SOL_SOCKET, SO_RCVBUF): %s\n",
+		       strerror(err));
+		return -err;
+	}
+
+	/*
+	 * The kernel doubles the value for its bookkeeping and
+	 * caps it at net.core.rmem_max.
+	 */
+	if (state->worker_id == 0 &&
+	    getsockopt(tcp_fd, SOL_SOCKET, SO_RCVBUF, &y, &len) == 0 &&
+	    (uint32_t)y / 2u < cfg->sock_rcvbuf)
+		pr_warn("SO_RCVBUF is capped to %d bytes by net.core.rmem_max\n",
+			y / 2);
+
 	return 0;
 }
 
 
-static int socket_setup(int tcp_fd)
+static int socket_setup(int tcp_fd, const struct server_state *state)
 {
 	int y;
 	int err;
@@ -181,6 +409,7 @@ static int socket_setup(int tcp_fd)
 	const char *lv, *on; /* level and optname */
 	socklen_t len = sizeof(y);
 	const void *py = (const void *)&y;
+	const struct server_cfg *cfg = state->cfg;
 
 	y = 1;
 	retval = setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEADDR, py, len);
@@ -190,18 +419,24 @@ static int socket_setup(int tcp_fd)
 		goto out_err;
 	}
 
-	y = 1;
-	retval = setsockopt(tcp_fd, IPPROTO_TCP, TCP_NODELAY, py, len);
-	if (retval < 0) {
-		lv = "IPPROTO_TCP";
-		on = "TCP_NODELAY";
-		goto out_err;
+	if (cfg->nr_workers > 1) {
+		/*
+		 * Every shard binds its own listening socket to the
+		 * same address, the kernel spreads the connections.
+		 */
+		y = 1;
+		retval = setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEPORT, py, len);
+		if (retval < 0) {
+			lv = "SOL_SOCKET";
+			on = "SO_REUSEPORT";
+			goto out_err;
+		}
 	}
 
-	return 0;
+	return socket_tune(tcp_fd, state);
 out_err:
 	err = errno;
-	printf("Error: setsockopt(tcp_fd, %s, %s): %s\n", lv, on, strerror(err));
+	pr_err("setsockopt(tcp_fd, %s, %s): %s\n", lv, on, strerror(err));
 	return -err;
 }
 
@@ -218,7 +453,25 @@ static int epoll_add(int epoll_fd, int fd, uint32_t events)
 	event.data.fd = fd;
 	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
 		err = errno;
-		printf("Error: epoll_ctl(EPOLL_CTL_ADD): %s\n", strerror(err));
+		pr_err("epoll_ctl(EPOLL_CTL_ADD): %s\n", strerror(err));
+		return -err;
+	}
+	return 0;
+}
+
+
+static int epoll_mod(int epoll_fd, int fd, uint32_t events)
+{
+	int err;
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(struct epoll_event));
+
+	event.events  = events;
+	event.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+		err = errno;
+		pr_err("epoll_ctl(EPOLL_CTL_MOD): %s\n", strerror(err));
 		return -err;
 	}
 	return 0;
@@ -231,7 +484,7 @@ static int epoll_delete(int epl_fd, int fd)
 
 	if (epoll_ctl(epl_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
 		err = errno;
-		printf("Error: epoll_ctl(EPOLL_CTL_DEL): %s\n", strerror(err));
+		pr_err("epoll_ctl(EPOLL_CTL_DEL): %s\n", strerror(err));
 		return -err;
 	}
 	return 0;
@@ -246,33 +499,59 @@ static int init_epoll(struct server_state *state)
 	epoll_fd = epoll_create(255);
 	if (epoll_fd < 0) {
 		err = errno;
-		printf("Error: epoll_create(): %s\n", strerror(err));
+		pr_err("epoll_create(): %s\n", strerror(err));
 		return -err;
 	}
 
 	state->epoll_fd = epoll_fd;
+	state->batch    = EPOLL_BATCH_MIN;
+	state->events   = calloc_wrp(EPOLL_BATCH_MAX, sizeof(*state->events));
+	if (state->events == NULL)
+		return -ENOMEM;
+
+	/*
+	 * Lets an idle shard sleep without a timeout, stop and
+	 * the stats thread kick it instead.
+	 */
+	state->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (state->wake_fd < 0) {
+		err = errno;
+		state->wake_fd = -1;
+		pr_err("eventfd(): %s\n", strerror(err));
+		return -err;
+	}
+
+	err = epoll_add(epoll_fd, state->wake_fd, EPOLLIN);
+	if (err)
+		return err;
+
+	state->epoll_map[state->wake_fd] = EPOLL_MAP_TO_WAKE;
 	return 0;
 }
 
 
-static int init_socket(const char *bind_addr, uint16_t bind_port,
-		       struct server_state *state)
+static int init_socket(struct server_state *state)
 {
 	int ret;
 	int tcp_fd;
+	const struct server_cfg *cfg = state->cfg;
+	const char *bind_addr = cfg->bind_addr;
+	uint16_t bind_port = cfg->bind_port;
 	struct sockaddr_in addr;
 	socklen_t addr_len = sizeof(addr);
 
 	tcp_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
 	if (tcp_fd < 0) {
 		ret = errno;
-		printf("Error: socket(): %s\n", strerror(ret));
+		pr_err("socket(): %s\n", strerror(ret));
 		return -ret;
 	}
 
-	ret = socket_setup(tcp_fd);
-	if (ret)
+	ret = socket_setup(tcp_fd, state);
+	if (ret) {
+		close(tcp_fd);
 		return ret;
+	}
 
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
@@ -282,26 +561,32 @@ static int init_socket(const char *bind_addr, uint16_t bind_port,
 	ret = bind(tcp_fd, (struct sockaddr *)&addr, addr_len);
 	if (ret) {
 		ret = errno;
-		printf("Error: bind(): %s\n", strerror(ret));
+		pr_err("bind(): %s\n", strerror(ret));
 		ret = -ret;
 		goto out;
 	}
 
-	ret = listen(tcp_fd, 30);
+	ret = listen(tcp_fd, (int)cfg->backlog);
 	if (ret) {
 		ret = errno;
-		printf("Error: listen(): %s\n", strerror(ret));
+		pr_err("listen(): %s\n", strerror(ret));
 		ret = -ret;
 		goto out;
 	}
 
-	ret = epoll_add(state->epoll_fd, tcp_fd, EPOLL_INPUT_EVT);
-	if (ret)
-		goto out;
+	if (cfg->engine == ENGINE_EPOLL) {
+		ret = epoll_add(state->epoll_fd, tcp_fd, EPOLL_INPUT_EVT);
+		if (ret)
+			goto out;
+	}
 
 	state->tcp_fd = tcp_fd;
 	state->epoll_map[tcp_fd] = EPOLL_MAP_TO_TCP;
-	printf("Listening on %s:%u...\n", bind_addr, bind_port);
+	if (cfg->nr_workers > 1)
+		pr_info("Listening on %s:%u (worker %u)...\n", bind_addr,
+			bind_port, state->worker_id);
+	else
+		pr_info("Listening on %s:%u...\n", bind_addr, bind_port);
 out:
 	if (ret)
 		close(tcp_fd);
@@ -319,7 +604,7 @@ static const char *convert_addr_ntop(struct sockaddr_in *addr, char *src_ip_buf)
 	if (ret == NULL) {
 		err = errno;
 		err = err ? err : EINVAL;
-		printf("Error: inet_ntop(): %s\n", strerror(err));
+		pr_err("inet_ntop(): %s\n", strerror(err));
 		return NULL;
 	}
 
@@ -327,159 +612,773 @@ static const char *convert_addr_ntop(struct sockaddr_in *addr, char *src_ip_buf)
 }
 
 
-static int resolve_src_info(struct sockaddr_in *addr, char *src_ip,
-			    uint16_t *src_port)
+static void load_src_addr(struct client_channel *chan)
 {
-	*src_port = ntohs(addr->sin_port);
-	if (convert_addr_ntop(addr, src_ip) == NULL)
-		return -EINVAL;
+	socklen_t addr_len = sizeof(chan->src_addr);
 
-	return 0;
+	if (chan->src_addr.sin_family != 0)
+		return;
+
+	/*
+	 * io_uring multishot accept doesn't hand out the peer
+	 * address, ask for it only when someone wants to print it.
+	 */
+	if (getpeername(chan->cli_fd, (struct sockaddr *)&chan->src_addr,
+			&addr_len) < 0 || addr_len > sizeof(chan->src_addr)) {
+		memset(&chan->src_addr, 0, sizeof(chan->src_addr));
+		chan->src_addr.sin_family = AF_INET;
+	}
 }
 
 
-static int run_acceptor(int tcp_fd, struct server_state *state)
+const char *chan_src_ip(struct client_channel *chan)
 {
-	int ret;
-	int cli_fd;
-	struct sockaddr_in addr;
-	socklen_t addr_len = sizeof(addr);
-	struct client_channel *chans, *chan;
+	if (chan->src_ip[0] != '\0')
+		return chan->src_ip;
 
-	uint16_t i;
-	uint16_t src_port;
-	char src_ip[IPV4_L + 1];
+	load_src_addr(chan);
+	if (convert_addr_ntop(&chan->src_addr, chan->src_ip) == NULL)
+		strcpy(chan->src_ip, "?");
 
-	memset(&addr, 0, sizeof(addr));
-	cli_fd = accept(tcp_fd, (struct sockaddr *)&addr, &addr_len);
-	if (cli_fd == -1) {
-		ret = errno;
-		if (ret == EAGAIN)
-			return 0;
+	return chan->src_ip;
+}
 
-		printf("Error: accept(): %s\n", strerror(ret));
-		return -ret;
+
+uint16_t chan_src_port(struct client_channel *chan)
+{
+	load_src_addr(chan);
+	return ntohs(chan->src_addr.sin_port);
+}
+
+
+/*
+ * Returns the reason if the channel has missed one of its
+ * deadlines, otherwise NULL and the next deadline in @next.
+ */
+static const char *check_channel_deadlines(struct server_state *state,
+					   struct client_channel *chan,
+					   uint64_t *next)
+{
+	uint64_t deadline;
+	uint64_t elapsed_ms;
+	uint64_t now = state->timers.now;
+	const struct server_cfg *cfg = state->cfg;
+
+	*next = UINT64_MAX;
+	if (!chan->got_file_info && cfg->header_timeout) {
+		deadline = chan->header_tick + sec_to_ticks(cfg->header_timeout);
+		if (now >= deadline)
+			return "header timeout";
+		*next = deadline;
 	}
 
+	if (cfg->idle_timeout) {
+		deadline = chan->active_tick + sec_to_ticks(cfg->idle_timeout);
+		if (now >= deadline)
+			return "idle timeout";
+		if (deadline < *next)
+			*next = deadline;
+	}
 
-	if (addr_len > sizeof(addr)) {
-		printf("Error: accept(): %s\n", strerror(EOVERFLOW));
-		ret = -EOVERFLOW;
-		goto out;
+	if (cfg->min_rate) {
+		deadline = chan->win_tick + sec_to_ticks(cfg->rate_window);
+		if (now >= deadline) {
+			elapsed_ms = (now - chan->win_tick) * TW_TICK_MS;
+			if ((chan->rx_bytes - chan->win_bytes) * 1000u <
+			    (uint64_t)cfg->min_rate * elapsed_ms)
+				return "too slow";
+
+			/*
+			 * Fast enough, start a new window.
+			 */
+			chan->win_tick  = now;
+			chan->win_bytes = chan->rx_bytes;
+			deadline = now + sec_to_ticks(cfg->rate_window);
+		}
+		if (deadline < *next)
+			*next = deadline;
 	}
 
+	return NULL;
+}
 
-	ret = resolve_src_info(&addr, src_ip, &src_port);
-	if (ret)
-		goto out;
 
+static void arm_channel_timer(struct server_state *state,
+			      struct client_channel *chan)
+{
+	uint64_t next;
+
+	chan->accept_tick = state->timers.now;
+	chan->header_tick = state->timers.now;
+	chan->active_tick = state->timers.now;
+	chan->win_tick    = state->timers.now;
+	if (check_channel_deadlines(state, chan, &next) == NULL &&
+	    next != UINT64_MAX)
+		tw_add(&state->timers, &chan->timer, next);
+}
 
-	if ((uint16_t)cli_fd > (EPOLL_MAP_SIZE - EPOLL_MAP_SHIFT)) {
-		printf("Error: accept() yielded too big file descriptor, "
-		       "max_allowed: %u, cli_fd: %d",
-		       (EPOLL_MAP_SIZE - EPOLL_MAP_SHIFT), cli_fd);
-		ret = -EOVERFLOW;
-		goto out;
-	}
 
-	/*
-	 * Find unused client slot in the array
-	 *
-	 * TODO: Implement stack to retrieve unused slot in O(1).
-	 *
-	 */
-	chans = state->chans;
-	for (i = 0; i < MAX_CLIENTS; i++) {
-		chan = &chans[i];
-		if (!chan->is_used)
-			goto got_unused;
+/*
+ * Stop reading from the channel, it is released once the
+ * writer pool is done with its queued writes.
+ */
+static void close_epoll_channel(struct server_state *state,
+				struct client_channel *chan)
+{
+	if (!chan->is_closing) {
+		chan->is_closing = true;
+		state->epoll_map[chan->cli_fd] = EPOLL_MAP_TO_NOP;
+		epoll_delete(state->epoll_fd, chan->cli_fd);
 	}
 
-	printf("Error: Cannot accept connection from %s:%u (channel is full)\n",
-	       src_ip, src_port);
-	ret = -EAGAIN;
-	goto out;
+	if (chan->io_inflight == 0)
+		release_channel(state, chan);
+}
 
 
-got_unused:
-	chan->cli_fd   = cli_fd;
-	chan->is_used  = true;
-	chan->recv_s   = 0;
-	chan->src_port = src_port;
-	strncpy(chan->src_ip, src_ip, sizeof(chan->src_ip) - 1);
-	chan->src_ip[sizeof(chan->src_ip) - 1] = '\0';
-	state->av_client--;
-	printf("Accepted connection from " PRWIU "\n", W_IU(chan));
-	epoll_add(state->epoll_fd, cli_fd, EPOLL_INPUT_EVT);
-	state->epoll_map[cli_fd] = i + EPOLL_MAP_SHIFT;
-out:
-	if (ret)
-		close(cli_fd);
-	return ret;
+static void evict_channel(struct server_state *state,
+			  struct client_channel *chan)
+{
+	if (state->cfg->engine == ENGINE_URING) {
+		uring_close_channel(state, chan);
+		return;
+	}
+
+	close_epoll_channel(state, chan);
 }
 
 
-static int handle_tcp_event(int tcp_fd, struct server_state *state,
-			    uint32_t revents)
+static void handle_channel_timer(struct tw_timer *timer, void *arg)
 {
-	const uint32_t err_mask = EPOLLERR | EPOLLHUP;
+	uint64_t next;
+	const char *reason;
+	struct server_state *state = arg;
+	struct client_channel *chan;
 
-	if (revents & err_mask) {
-		printf("Error: TCP event error");
-		return -ENOTCONN;
+	chan = (struct client_channel *)(void *)
+	       ((char *)timer - offsetof(struct client_channel, timer));
+
+	/*
+	 * io_uring: already waiting for its in-flight I/O.
+	 */
+	if (chan->is_closing)
+		return;
+
+	/*
+	 * The deadlines are not moved on every recv(), they
+	 * are re-checked here and the timer is re-armed to
+	 * the nearest one.
+	 */
+	reason = check_channel_deadlines(state, chan, &next);
+	if (reason == NULL) {
+		if (next != UINT64_MAX)
+			tw_add(&state->timers, &chan->timer, next);
+		return;
 	}
 
-	return run_acceptor(tcp_fd, state);
+	pr_err_ratelimited("Client is evicted (%s)" PRCHAN "\n", reason,
+			   W_CHAN(chan));
+	stat_add(&state->stats.timeouts, 1);
+	evict_channel(state, chan);
+}
+
+
+void run_channel_timers(struct server_state *state)
+{
+	tw_advance(&state->timers, get_tick(), handle_channel_timer, state);
 }
 
 
-static bool validate_file_name(const char *file_name)
+static void print_rejected(int cli_fd, struct sockaddr_in *addr)
 {
+	struct sockaddr_in peer;
+	socklen_t addr_len = sizeof(peer);
+	char src_ip[IPV4_L];
+	static _Thread_local struct log_ratelimit rl;
+
 	/*
-	 * Restrict file name that contains ".."
+	 * A full server gets a lot of these, don't even
+	 * look the peer up when it is not printed.
 	 */
-	return strstr(file_name, "..") == NULL;
+	if (log_level < LOG_ERR || !log_ratelimit(&rl, __func__))
+		return;
+
+	memset(&peer, 0, sizeof(peer));
+	if (addr)
+		peer = *addr;
+	else
+		getpeername(cli_fd, (struct sockaddr *)&peer, &addr_len);
+
+	if (convert_addr_ntop(&peer, src_ip) == NULL)
+		strcpy(src_ip, "?");
+
+	pr_err("Cannot accept connection from %s:%u "
+	       "(channel is full)\n", src_ip, ntohs(peer.sin_port));
 }
 
 
-static int open_client_file_handle(struct server_state *state,
-				   struct client_channel *chan,
-				   const char *file_name)
+/*
+ * @addr may be NULL, the peer address is then looked up
+ * when it is printed for the first time.
+ */
+int assign_channel(struct server_state *state, int cli_fd,
+		   struct sockaddr_in *addr, struct client_channel **chan_p)
 {
-	int err;
-	FILE *handle;
-	char target_file[1024];
+	struct client_channel *chan;
 
-	if (!validate_file_name(file_name)) {
-		printf("Client " PRWIU " sends invalid file name: \"%s\"\n",
-		       W_IU(chan), file_name);
-		return -EPERM;
+	/*
+	 * Pop unused client slot from the free slot stack
+	 */
+	chan = alloc_channel(state);
+	if (chan == NULL) {
+		print_rejected(cli_fd, addr);
+		stat_add(&state->stats.rejected, 1);
+		return -EAGAIN;
 	}
 
-	snprintf(target_file, sizeof(target_file), "%s/%s", state->storage_path,
-		 file_name);
-
-	handle = fopen(target_file, "wb");
-	if (handle == NULL) {
-		err = errno;
-		printf("Cannot create file: %s: %s\n", target_file,
-		       strerror(err));
-		return -err;
+	chan->cli_fd   = cli_fd;
+	chan->is_used  = true;
+	chan->recv_s   = 0;
+	if (addr)
+		chan->src_addr = *addr;
+	if (state->cfg->nr_classes > 1) {
+		load_src_addr(chan);
+		chan->sched_class = sched_classify(state->cfg, &chan->src_addr);
 	}
-	setvbuf(handle, NULL, _IOFBF, RECV_BUFFER_SIZE * 2u);
-
-	chan->handle = handle;
+	state->av_client--;
+	stat_add(&state->stats.accepted, 1);
+	arm_channel_timer(state, chan);
+	pr_info("Accepted connection from " PRWIU "\n", W_IU(chan));
+	*chan_p = chan;
 	return 0;
 }
 
 
-static int handle_file_info(struct server_state *state,
-			    struct client_channel *chan, size_t recv_s)
+static int accept_client(struct server_state *state, int cli_fd,
+			 struct sockaddr_in *addr, socklen_t addr_len)
 {
-	int ret = 0;
-	uint64_t file_size;
-	uint64_t total_expected;
-	packet_t *pkt = &chan->pktbuf.packet;
+	int ret;
+	struct client_channel *chan;
+
+	if (addr_len > sizeof(*addr)) {
+		pr_err("accept(): %s\n", strerror(EOVERFLOW));
+		return -EOVERFLOW;
+	}
+
+	if ((uint32_t)cli_fd >= state->epoll_map_size) {
+		pr_err("accept() yielded too big file descriptor, "
+		       "max_allowed: %u, cli_fd: %d\n",
+		       state->epoll_map_size - 1u, cli_fd);
+		return -EOVERFLOW;
+	}
+
+	ret = assign_channel(state, cli_fd, addr, &chan);
+	if (ret)
+		return ret;
+
+	ret = epoll_add(state->epoll_fd, cli_fd, EPOLL_INPUT_EVT);
+	if (ret) {
+		release_channel(state, chan);
+		return 0;
+	}
+
+	state->epoll_map[cli_fd] = chan->arr_idx + EPOLL_MAP_SHIFT;
+	return 0;
+}
+
+
+static int run_acceptor(int tcp_fd, struct server_state *state)
+{
+	int ret;
+	int cli_fd;
+	struct sockaddr_in addr;
+	socklen_t addr_len;
+
+	/*
+	 * Drain the backlog, but leave the rest for the next
+	 * epoll_wait() round so the connected clients are not
+	 * starved by a connect storm. The listener is level
+	 * triggered, nothing is lost.
+	 */
+	for (uint32_t i = 0; i < ACCEPT_BATCH; i++) {
+		addr_len = sizeof(addr);
+		cli_fd = accept4(tcp_fd, (struct sockaddr *)&addr, &addr_len,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (cli_fd < 0) {
+			ret = errno;
+			if (ret == EAGAIN || ret == EWOULDBLOCK)
+				return 0;
+			if (ret == EINTR || ret == ECONNABORTED)
+				continue;
+
+			pr_err_ratelimited("accept4(): %s\n", strerror(ret));
+			if (ret == EMFILE || ret == ENFILE || ret == ENOBUFS ||
+			    ret == ENOMEM)
+				return 0;
+			return -ret;
+		}
+
+		if (accept_client(state, cli_fd, &addr, addr_len))
+			close(cli_fd);
+	}
+
+	return 0;
+}
+
+
+static int handle_tcp_event(int tcp_fd, struct server_state *state,
+			    uint32_t revents)
+{
+	const uint32_t err_mask = EPOLLERR | EPOLLHUP;
+
+	if (revents & err_mask) {
+		pr_err("TCP event error");
+		return -ENOTCONN;
+	}
+
+	return run_acceptor(tcp_fd, state);
+}
+
+
+bool validate_file_name(const char *file_name)
+{
+	/*
+	 * Restrict file name that contains ".."
+	 */
+	return strstr(file_name, "..") == NULL;
+}
+
+
+/*
+ * Reserve the rest of the file, from @off, up front. The extents
+ * are then laid out in one go instead of being interleaved with
+ * the other uploads landing on the same filesystem.
+ *
+ * @mode is passed to fallocate(), FALLOC_FL_KEEP_SIZE keeps the
+ * file size at what is actually written.
+ */
+static int reserve_file_space(struct server_state *state,
+			      struct client_channel *chan, int fd,
+			      uint64_t off, uint64_t len, int mode)
+{
+	int err;
+	uint64_t avail;
+	struct statvfs st;
+
+	if (len == 0)
+		return 0;
+
+	if (fstatvfs(fd, &st) == 0) {
+		avail = (uint64_t)st.f_bavail * st.f_frsize;
+		if (avail < len) {
+			pr_err("Not enough space for \"%s\" from " PRWIU
+			       " (need %" PRIu64 " bytes, available %" PRIu64
+			       " bytes)\n", chan->file_name, W_IU(chan),
+			       len, avail);
+			return -ENOSPC;
+		}
+	}
+
+	if (!state->cfg->preallocate || off + len > INT64_MAX)
+		return 0;
+
+	if (fallocate(fd, mode, (off_t)off, (off_t)len) == 0)
+		return 0;
+
+	err = errno;
+	if (err == EOPNOTSUPP || err == ENOSYS) {
+		/*
+		 * Not every filesystem can do it, just write
+		 * without a reservation.
+		 */
+		pr_dbg("fallocate(): %s\n", strerror(err));
+		return 0;
+	}
+
+	pr_err("fallocate(\"%s\", %" PRIu64 "): %s\n", chan->file_name,
+	       len, strerror(err));
+	return -err;
+}
+
+
+static int client_file_path(struct server_state *state,
+			    struct client_channel *chan, const char *file_name,
+			    char *path, size_t size)
+{
+	if (!validate_file_name(file_name)) {
+		pr_info("Client " PRWIU " sends invalid file name: \"%s\"\n",
+			W_IU(chan), file_name);
+		return -EPERM;
+	}
+
+	snprintf(path, size, "%s/%s", state->cfg->storage_path, file_name);
+	return 0;
+}
+
+
+static FILE *open_file_handle(const char *path, int flags)
+{
+	int fd;
+	int err;
+	FILE *handle;
+
+	fd = open(path, O_WRONLY | O_CLOEXEC | flags, 0644);
+	if (fd < 0) {
+		err = errno;
+		pr_info("Cannot create file: %s: %s\n", path, strerror(err));
+		errno = err;
+		return NULL;
+	}
+
+	handle = fdopen(fd, "wb");
+	if (handle == NULL) {
+		err = errno;
+		pr_err("fdopen(): %s\n", strerror(err));
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	/*
+	 * The receive buffer already batches a whole recv(),
+	 * a second stdio buffer per open file would only cost
+	 * another copy and memory for every slow client.
+	 */
+	setvbuf(handle, NULL, _IONBF, 0);
+	return handle;
+}
+
+
+static int open_client_file_handle(struct server_state *state,
+				   struct client_channel *chan,
+				   const char *file_name)
+{
+	int err;
+	FILE *handle;
+	char target_file[1024];
+
+	err = client_file_path(state, chan, file_name, target_file,
+			       sizeof(target_file));
+	if (err)
+		return err;
+
+	handle = open_file_handle(target_file, O_CREAT | O_TRUNC);
+	if (handle == NULL)
+		return -errno;
+
+	err = reserve_file_space(state, chan, fileno(handle), 0,
+				 chan->file_size, 0);
+	if (err) {
+		fclose(handle);
+		unlink(target_file);
+		return err;
+	}
+
+	chan->handle = handle;
+	return 0;
+}
+
+
+/*
+ * Every range has its own handle on the shared file, so the
+ * file position of the splice and stdio paths is its own too.
+ */
+static int open_range_file_handle(struct server_state *state,
+				  struct client_channel *chan,
+				  const range_hdr_t *rng)
+{
+	int err;
+	bool created;
+	FILE *handle;
+	char target_file[1024];
+	uint64_t file_size = be64toh(rng->file_size);
+
+	err = client_file_path(state, chan, chan->file_name, target_file,
+			       sizeof(target_file));
+	if (err)
+		return err;
+
+	err = xfer_get(&chan->xfer, be64toh(rng->xfer_id), target_file,
+		       file_size, &created);
+	if (err)
+		return err;
+
+	handle = open_file_handle(target_file, 0);
+	if (handle == NULL)
+		return -errno;
+
+	if (fseeko(handle, (off_t)chan->file_off, SEEK_SET) < 0) {
+		err = errno;
+		pr_err("fseeko(): %s\n", strerror(err));
+		fclose(handle);
+		return -err;
+	}
+
+	/*
+	 * Other ranges may be in already, fallocate() doesn't
+	 * touch written blocks.
+	 */
+	if (created) {
+		err = reserve_file_space(state, chan, fileno(handle), 0,
+					 file_size, 0);
+		if (err) {
+			fclose(handle);
+			return err;
+		}
+	}
+
+	chan->handle = handle;
+	return 0;
+}
+
+
+/*
+ * A range header carries the file name in the packet_t in front
+ * of it. Returns 1 if the range header hasn't fully arrived.
+ */
+static int handle_range_info(struct server_state *state,
+			     struct client_channel *chan, size_t recv_s)
+{
+	int ret;
+	uint64_t off, len, size;
+	packet_t *pkt = &chan->pktbuf->packet;
+	range_hdr_t *rng = (range_hdr_t *)(void *)(pkt + 1);
+
+	if (!chan->ranges) {
+		pr_err("Client " PRWIU " sends invalid packet\n", W_IU(chan));
+		return -EINVAL;
+	}
+
+	if (recv_s < sizeof(*pkt) + sizeof(*rng))
+		return 1;
+
+	off  = be64toh(rng->offset);
+	len  = be64toh(rng->length);
+	size = be64toh(rng->file_size);
+	if (size >= FT_RANGE_SIZE || off > size || len > size - off) {
+		pr_err("Client " PRWIU " sends invalid range\n", W_IU(chan));
+		return -EINVAL;
+	}
+
+	memcpy(chan->file_name, pkt->file_name, pkt->file_name_len);
+	chan->file_name[pkt->file_name_len] = '\0';
+	chan->file_name[sizeof(chan->file_name) - 1] = '\0';
+	chan->file_off      = off;
+	chan->file_size     = off + len;
+	chan->recv_file_len = off;
+	chan->write_off     = off;
+
+	ret = open_range_file_handle(state, chan, rng);
+	if (ret)
+		return ret;
+
+	chan->got_file_info = true;
+	chan->file_start_us = stats_now_us();
+	pr_info("Receiving range" PRCHAN " offset=%" PRIu64 " length=%"
+		PRIu64 " size=%" PRIu64 "\n", W_CHAN(chan), off, len, size);
+	return 0;
+}
+
+
+/*
+ * The partial file keeps the size and the fingerprint of the file
+ * it belongs to in an xattr, the bytes it already holds are its
+ * size. It is reserved with FALLOC_FL_KEEP_SIZE, so the size only
+ * covers what was written, even after a crash. Returns 0 for a
+ * different or an unmarked file.
+ */
+static uint64_t resumable_bytes(int fd, const resume_hdr_t *rsm)
+{
+	struct stat st;
+	resume_hdr_t mark;
+	uint64_t file_size = be64toh(rsm->file_size);
+
+	if (fgetxattr(fd, RESUME_XATTR, &mark, sizeof(mark)) != sizeof(mark) ||
+	    memcmp(&mark, rsm, sizeof(mark)) || fstat(fd, &st) < 0)
+		return 0;
+
+	return ((uint64_t)st.st_size < file_size) ? (uint64_t)st.st_size :
+						    file_size;
+}
+
+
+static int open_resume_file_handle(struct server_state *state,
+				   struct client_channel *chan,
+				   const resume_hdr_t *rsm)
+{
+	int fd;
+	int err;
+	FILE *handle;
+	uint64_t held;
+	char target_file[1024];
+
+	err = client_file_path(state, chan, chan->file_name, target_file,
+			       sizeof(target_file));
+	if (err)
+		return err;
+
+	handle = open_file_handle(target_file, O_CREAT);
+	if (handle == NULL)
+		return -errno;
+
+	fd   = fileno(handle);
+	held = resumable_bytes(fd, rsm);
+	if (held == 0) {
+		/*
+		 * Start over. Without xattr support the upload still
+		 * works, it just can't be resumed.
+		 */
+		if (ftruncate(fd, 0) < 0) {
+			err = -errno;
+			pr_err("ftruncate(\"%s\"): %s\n", target_file,
+			       strerror(-err));
+			goto out_close;
+		}
+
+		if (fsetxattr(fd, RESUME_XATTR, rsm, sizeof(*rsm), 0) == 0)
+			chan->resumable = true;
+		else
+			pr_dbg("fsetxattr(\"%s\"): %s\n", target_file,
+			       strerror(errno));
+	} else {
+		chan->resumable = true;
+	}
+
+	err = reserve_file_space(state, chan, fd, held, chan->file_size - held,
+				 FALLOC_FL_KEEP_SIZE);
+	if (err)
+		goto out_close;
+
+	if (fseeko(handle, (off_t)held, SEEK_SET) < 0) {
+		err = -errno;
+		pr_err("fseeko(): %s\n", strerror(-err));
+		goto out_close;
+	}
+
+	chan->handle        = handle;
+	chan->file_off      = held;
+	chan->recv_file_len = held;
+	chan->write_off     = held;
+	return 0;
+
+out_close:
+	fclose(handle);
+	return err;
+}
+
+
+static int send_reply(struct client_channel *chan, const void *buf,
+		      size_t len)
+{
+	int err;
+	ssize_t ret;
+
+	/*
+	 * The client waits for it before sending anything else,
+	 * so the socket buffer is empty.
+	 */
+	ret = send(chan->cli_fd, buf, len, MSG_NOSIGNAL);
+	if (ret == (ssize_t)len)
+		return 0;
+
+	err = (ret < 0) ? errno : EAGAIN;
+	pr_err("send(): %s\n", strerror(err));
+	return -err;
+}
+
+
+/*
+ * Returns 1 if the resume header hasn't fully arrived.
+ */
+static int handle_resume_info(struct server_state *state,
+			      struct client_channel *chan, size_t recv_s)
+{
+	int ret;
+	uint64_t held;
+	packet_t *pkt = &chan->pktbuf->packet;
+	resume_hdr_t *rsm = (resume_hdr_t *)(void *)(pkt + 1);
+
+	if (!chan->resume) {
+		pr_err("Client " PRWIU " sends invalid packet\n", W_IU(chan));
+		return -EINVAL;
+	}
+
+	if (recv_s < sizeof(*pkt) + sizeof(*rsm))
+		return 1;
+
+	chan->file_size = be64toh(rsm->file_size);
+	if (chan->file_size >= FT_RESUME_SIZE) {
+		pr_err("Client " PRWIU " sends invalid packet\n", W_IU(chan));
+		return -EINVAL;
+	}
+
+	memcpy(chan->file_name, pkt->file_name, pkt->file_name_len);
+	chan->file_name[pkt->file_name_len] = '\0';
+	chan->file_name[sizeof(chan->file_name) - 1] = '\0';
+
+	ret = open_resume_file_handle(state, chan, rsm);
+	if (ret)
+		return ret;
+
+	chan->got_file_info = true;
+	chan->file_start_us = stats_now_us();
+	if (chan->file_off)
+		pr_info("Resuming file" PRCHAN " at %" PRIu64 "\n",
+			W_CHAN(chan), chan->file_off);
+	else
+		pr_info("Receiving file" PRCHAN " size=%" PRIu64 "\n",
+			W_CHAN(chan), chan->file_size);
+
+	held = htobe64(chan->file_off);
+	return send_reply(chan, &held, sizeof(held));
+}
+
+
+/*
+ * Only the session hello is known so far. The reply is the set
+ * of features enabled for this connection.
+ */
+static int handle_ctrl_packet(struct server_state *state,
+			      struct client_channel *chan)
+{
+	uint32_t feat = 0;
+	uint32_t reply;
+	packet_t *pkt = &chan->pktbuf->packet;
+
+	if (pkt->file_name_len != sizeof(FT_HELLO) - 1u ||
+	    memcmp(pkt->file_name, FT_HELLO, sizeof(FT_HELLO) - 1u)) {
+		pr_err("Client " PRWIU " sends unknown control packet\n",
+		       W_IU(chan));
+		return -EINVAL;
+	}
+
+	/*
+	 * io_uring writes straight from the provided buffers, a
+	 * buffer can't be split between two files there, and
+	 * it only ever copies a packet_t sized header.
+	 */
+	if (state->cfg->engine != ENGINE_URING)
+		feat |= FT_FEAT_PERSIST | FT_FEAT_RANGES | FT_FEAT_RESUME;
+
+	chan->persistent = !!(feat & FT_FEAT_PERSIST);
+	chan->ranges     = !!(feat & FT_FEAT_RANGES);
+	chan->resume     = !!(feat & FT_FEAT_RESUME);
+	pr_dbg("Client " PRWIU " opens a session (features: %#x)\n",
+	       W_IU(chan), feat);
+
+	reply = htobe32(feat);
+	return send_reply(chan, &reply, sizeof(reply));
+}
+
+
+int handle_file_info(struct server_state *state, struct client_channel *chan,
+		     size_t recv_s)
+{
+	int ret = 0;
+	uint64_t file_size;
+	uint64_t total_expected;
+	size_t hdr_len = sizeof(packet_t);
+	packet_t *pkt = &chan->pktbuf->packet;
 
 	if (recv_s < sizeof(*pkt)) {
 		/*
@@ -492,339 +1391,1690 @@ static int handle_file_info(struct server_state *state,
 	}
 
 
-	/*
-	 * Now, it is safe to read the packet info
-	 */
-	file_size = be64toh(pkt->file_size);
+	/*
+	 * Now, it is safe to read the packet info
+	 */
+	file_size = be64toh(pkt->file_size);
+	if (file_size == FT_CTRL_SIZE) {
+		ret = handle_ctrl_packet(state, chan);
+		if (ret)
+			goto out;
+		goto out_consume;
+	}
+
+	if (file_size == FT_RANGE_SIZE) {
+		ret = handle_range_info(state, chan, recv_s);
+		if (ret > 0) {
+			ret = 0;
+			goto out;
+		}
+		if (ret)
+			goto out;
+		hdr_len += sizeof(range_hdr_t);
+		goto out_consume;
+	}
+
+	if (file_size == FT_RESUME_SIZE) {
+		ret = handle_resume_info(state, chan, recv_s);
+		if (ret > 0) {
+			ret = 0;
+			goto out;
+		}
+		if (ret)
+			goto out;
+		hdr_len += sizeof(resume_hdr_t);
+		goto out_consume;
+	}
+
+	total_expected = sizeof(*pkt) + file_size;
+	if (!chan->persistent && recv_s > total_expected) {
+		/*
+		 * Expected total bytes sent by client
+		 * is `total_expected`. If we receive
+		 * more than that at this point, then
+		 * client has done something totally
+		 * wrong! On a persistent connection
+		 * the next file may follow.
+		 */
+		pr_err("Client " PRWIU " sends invalid packet\n",
+		       W_IU(chan));
+		ret = -EINVAL;
+		goto out;
+	}
+
+
+
+	chan->file_size = file_size;
+	memcpy(chan->file_name, pkt->file_name, pkt->file_name_len);
+
+	/*
+	 * Ensure null terminator for safety.
+	 */
+	chan->file_name[pkt->file_name_len] = '\0';
+	chan->file_name[sizeof(chan->file_name) - 1] = '\0';
+	chan->got_file_info = true;
+	chan->file_start_us = stats_now_us();
+
+	ret = open_client_file_handle(state, chan, chan->file_name);
+	if (ret)
+		goto out;
+
+
+	pr_info("Receiving file" PRCHAN " size=%" PRIu64 "\n", W_CHAN(chan),
+		file_size);
+
+out_consume:
+	if (recv_s > hdr_len) {
+		/*
+		 * Partial bytes of the file has
+		 * arrived together with the file info.
+		 *
+		 * Must memmove to the front before
+		 * we run out of buffer!
+		 */
+		recv_s -= hdr_len;
+		memmove(chan->pktbuf->raw_buf,
+			chan->pktbuf->raw_buf + hdr_len, recv_s);
+
+		chan->recv_s = recv_s;
+		ret = -EAGAIN;
+		goto out;
+	}
+
+	/*
+	 * The header has been consumed, nothing is left
+	 * in the buffer.
+	 */
+	chan->recv_s = 0;
+out:
+	return ret;
+}
+
+
+static void close_channel_splice(struct client_channel *chan)
+{
+	if (chan->pipe_fd[0] != -1)
+		close(chan->pipe_fd[0]);
+	if (chan->pipe_fd[1] != -1)
+		close(chan->pipe_fd[1]);
+	chan->pipe_fd[0] = -1;
+	chan->pipe_fd[1] = -1;
+	chan->splicing   = false;
+}
+
+
+/*
+ * The file is complete on a persistent connection, close it and
+ * wait for the next header.
+ */
+static void finish_channel_file(struct server_state *state,
+				struct client_channel *chan)
+{
+	uint64_t next;
+
+	/*
+	 * handle_file_splice() only finishes a file with an empty
+	 * pipe, keep it for the next file of the session.
+	 */
+	chan->splicing = false;
+	fclose(chan->handle);
+	if (chan->xfer != NULL)
+		xfer_put(chan->xfer);
+	stat_add(&state->stats.bytes_in, chan->recv_file_len - chan->file_off);
+	chan->handle        = NULL;
+	chan->xfer          = NULL;
+	chan->resumable     = false;
+	chan->got_file_info = false;
+	chan->file_size     = 0;
+	chan->file_off      = 0;
+	chan->recv_file_len = 0;
+	chan->write_off     = 0;
+	chan->file_start_us = 0;
+
+	/*
+	 * The header timeout starts over for the next file.
+	 */
+	chan->header_tick = state->timers.now;
+	if (!state->cfg->header_timeout)
+		return;
+
+	if (check_channel_deadlines(state, chan, &next) == NULL &&
+	    next != UINT64_MAX)
+		tw_add(&state->timers, &chan->timer, next);
+}
+
+
+/*
+ * Whatever follows the end of the file in the buffer is the
+ * start of the next header.
+ */
+static int next_channel_file(struct server_state *state,
+			     struct client_channel *chan, size_t used,
+			     size_t recv_s)
+{
+	finish_channel_file(state, chan);
+	recv_s -= used;
+	chan->recv_s = recv_s;
+	if (recv_s == 0)
+		return 0;
+
+	memmove(chan->pktbuf->raw_buf, chan->pktbuf->raw_buf + used, recv_s);
+	return -EAGAIN;
+}
+
+
+static inline size_t file_content_len(struct client_channel *chan,
+				      uint64_t done, size_t recv_s)
+{
+	uint64_t rem = chan->file_size - done;
+
+	return (recv_s < rem) ? recv_s : (size_t)rem;
+}
+
+
+/*
+ * Persistent connection: the last write of the file has been
+ * queued, the next file waits until it completes.
+ */
+static inline bool chan_draining_file(struct client_channel *chan)
+{
+	return chan->persistent && chan->got_file_info &&
+	       chan->write_off >= chan->file_size;
+}
+
+
+static void account_file_write(struct server_state *state,
+			       struct client_channel *chan, size_t len)
+{
+	uint64_t prev = chan->recv_file_len;
+
+	/*
+	 * Only the write that crosses file_size completes
+	 * the file, whatever order they finish in.
+	 */
+	chan->recv_file_len += len;
+	if (prev < chan->file_size && chan->recv_file_len >= chan->file_size)
+		mark_file_complete(state, chan);
+}
+
+
+void complete_channel_write(struct server_state *state,
+			    struct client_channel *chan, uint32_t len, int err)
+{
+	chan->io_inflight--;
+	chan->wr_bytes   -= len;
+	chan->active_tick = state->timers.now;
+	if (err)
+		pr_err("pwrite(): %s\n", strerror(-err));
+	else
+		account_file_write(state, chan, len);
+
+	if (err || chan->is_closing) {
+		close_epoll_channel(state, chan);
+		return;
+	}
+
+	if (chan_draining_file(chan)) {
+		if (chan->io_inflight)
+			return;
+
+		/*
+		 * The file is done, the next header may already
+		 * be waiting in the buffer.
+		 */
+		if (next_channel_file(state, chan, 0, chan->recv_s) &&
+		    handle_client_data(state, chan, chan->recv_s)) {
+			close_epoll_channel(state, chan);
+			return;
+		}
+
+		if (chan->recv_s == 0)
+			detach_channel_buf(state, chan);
+		if (chan_draining_file(chan))
+			return;
+	}
+
+	/*
+	 * Resume reading at half the budget, not to flip
+	 * EPOLLIN on every completion.
+	 */
+	if (chan->rx_paused && chan->wr_bytes <= state->cfg->writer_budget / 2u) {
+		if (epoll_mod(state->epoll_fd, chan->cli_fd, EPOLL_INPUT_EVT)) {
+			close_epoll_channel(state, chan);
+			return;
+		}
+		chan->rx_paused = false;
+	}
+}
+
+
+static int queue_file_content(struct server_state *state,
+			      struct client_channel *chan, size_t recv_s)
+{
+	int ret;
+	uint64_t off = chan->write_off;
+	union uni_pkt *next = NULL;
+	size_t len = file_content_len(chan, off, recv_s);
+
+	if (len == 0) {
+		/*
+		 * An empty file, nothing to write.
+		 */
+		mark_file_complete(state, chan);
+		goto out_end;
+	}
+
+	if (recv_s > len && chan->persistent) {
+		/*
+		 * The buffer goes to the writer, the next header
+		 * behind the file content moves to a fresh one.
+		 */
+		next = buf_pool_get(&state->buf_pools[chan->buf_class]);
+		if (next == NULL) {
+			pr_err_ratelimited("Cannot attach receive buffer to "
+					   PRWIU "\n", W_IU(chan));
+			return -ENOBUFS;
+		}
+		memcpy(next->raw_buf, chan->pktbuf->raw_buf + len, recv_s - len);
+	}
+
+	chan->write_off += len;
+	stat_add(&state->stats.write_calls, 1);
+	ret = writer_submit(state, chan, chan->pktbuf, (uint32_t)len, off);
+	if (ret == 0) {
+		/*
+		 * The buffer belongs to the writer until the
+		 * completion comes back.
+		 */
+		chan->pktbuf = next;
+		chan->recv_s = next ? recv_s - len : 0;
+		chan->io_inflight++;
+		chan->wr_bytes += len;
+		if (chan->wr_bytes >= state->cfg->writer_budget &&
+		    !chan->rx_paused) {
+			ret = epoll_mod(state->epoll_fd, chan->cli_fd, 0);
+			if (ret)
+				return ret;
+			chan->rx_paused = true;
+		}
+	} else {
+		/*
+		 * The ring is full, the offset is known so the
+		 * write can be done right here.
+		 */
+		ret = pwrite_full(fileno(chan->handle), chan->pktbuf->raw_buf,
+				  len, off);
+		detach_channel_buf(state, chan);
+		chan->pktbuf = next;
+		chan->recv_s = next ? recv_s - len : 0;
+		if (ret) {
+			pr_err("pwrite(): %s\n", strerror(-ret));
+			return ret;
+		}
+		account_file_write(state, chan, len);
+	}
+
+out_end:
+	if (chan->write_off < chan->file_size)
+		return 0;
+
+	/*
+	 * Everything is received, the channel is released
+	 * when the last write completes.
+	 */
+	if (!chan->persistent)
+		return -EALREADY;
+
+	/*
+	 * Completions are accounted to the open file, stop
+	 * reading until the last one is back.
+	 */
+	if (chan->io_inflight) {
+		if (chan->rx_paused)
+			return 0;
+		ret = epoll_mod(state->epoll_fd, chan->cli_fd, 0);
+		if (ret)
+			return ret;
+		chan->rx_paused = true;
+		return 0;
+	}
+
+	return next_channel_file(state, chan, 0, chan->recv_s);
+}
+
+
+static int handle_file_content(struct server_state *state,
+			       struct client_channel *chan, size_t recv_s)
+{
+	FILE *handle;
+	size_t len;
+	size_t fwrite_ret;
+
+	if (state->cfg->nr_writers)
+		return queue_file_content(state, chan, recv_s);
+
+	handle     = chan->handle;
+	len        = file_content_len(chan, chan->recv_file_len, recv_s);
+	fwrite_ret = fwrite(chan->pktbuf->raw_buf, sizeof(char), len, handle);
+	stat_add(&state->stats.write_calls, 1);
+	if (fwrite_ret != len) {
+		int ret = ferror(handle);
+		if (ret != 0) {
+			clearerr(handle);
+			pr_err("fwrite(): %s\n", strerror(ret));
+			return -ret;
+		}
+	}
+	chan->recv_s = 0;
+	chan->recv_file_len += fwrite_ret;
+
+	if (chan->recv_file_len < chan->file_size)
+		return 0;
+
+	mark_file_complete(state, chan);
+	if (!chan->persistent)
+		return -EALREADY;
+
+	return next_channel_file(state, chan, len, recv_s);
+}
+
+
+static int init_channel_splice(struct client_channel *chan)
+{
+	int err;
+	int pipe_size;
+
+	/*
+	 * The stdio buffer must reach the file before the
+	 * spliced content does.
+	 */
+	if (fflush(chan->handle)) {
+		err = errno;
+		pr_err("fflush(): %s\n", strerror(err));
+		return -err;
+	}
+
+	/*
+	 * Left over by the previous file of the session.
+	 */
+	if (chan->pipe_fd[0] != -1)
+		goto out;
+
+	if (pipe2(chan->pipe_fd, O_NONBLOCK | O_CLOEXEC) < 0) {
+		/*
+		 * Out of pipes, the buffer still works.
+		 */
+		err = errno;
+		chan->pipe_fd[0] = -1;
+		chan->pipe_fd[1] = -1;
+		chan->no_splice  = true;
+		pr_warn_ratelimited("pipe2(): %s, using buffered write for "
+				    PRWIU "\n", strerror(err), W_IU(chan));
+		return 0;
+	}
+
+	/*
+	 * A bigger pipe means fewer splice() calls per byte.
+	 * It's fine to keep the default size on failure.
+	 */
+	pipe_size = fcntl(chan->pipe_fd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	if (pipe_size < 0)
+		pipe_size = fcntl(chan->pipe_fd[1], F_GETPIPE_SZ);
+	if (pipe_size <= 0)
+		pipe_size = RECV_BUFFER_SIZE;
+
+	chan->pipe_size = (size_t)pipe_size;
+	pr_dbg("Switching " PRWIU " to splice mode (pipe: %d bytes)\n",
+	       W_IU(chan), pipe_size);
+out:
+	chan->splicing = true;
+	return 0;
+}
+
+
+static int splice_fallback(struct server_state *state,
+			   struct client_channel *chan, size_t len)
+{
+	int ret = 0;
+	ssize_t read_ret;
+	size_t fwrite_ret;
+
+	/*
+	 * The file system can't splice. Move what is sitting
+	 * in the pipe through the buffer and stop splicing,
+	 * for good on this channel.
+	 */
+	pr_warn_ratelimited("splice() to file is not supported, "
+			    "using buffered write for " PRWIU "\n",
+			    W_IU(chan));
+	chan->no_splice = true;
+	ret = attach_channel_buf(state, chan);
+	if (ret)
+		return ret;
+
+	while (len > 0) {
+		read_ret = read(chan->pipe_fd[0], chan->pktbuf->raw_buf,
+				chan_buf_size(state, chan));
+		if (read_ret <= 0)
+			break;
+
+		fwrite_ret = fwrite(chan->pktbuf->raw_buf, sizeof(char),
+				    (size_t)read_ret, chan->handle);
+		stat_add(&state->stats.write_calls, 1);
+		chan->recv_file_len += fwrite_ret;
+		if (fwrite_ret != (size_t)read_ret) {
+			pr_err("fwrite(): %s\n",
+			       strerror(ferror(chan->handle)));
+			ret = -EIO;
+			break;
+		}
+		len -= (size_t)read_ret;
+	}
+
+	detach_channel_buf(state, chan);
+	close_channel_splice(chan);
+	return ret;
+}
+
+
+/*
+ * Splices at most @budget bytes, 0 is no limit. Returns the
+ * spliced bytes in @budget, 0 once the socket is drained.
+ */
+static int handle_file_splice(struct server_state *state,
+			      struct client_channel *chan, size_t *budget)
+{
+	int err;
+	size_t len;
+	uint64_t rem;
+	ssize_t in, out;
+	int file_fd = fileno(chan->handle);
+
+	rem = chan->file_size - chan->recv_file_len;
+	len = (rem < chan->pipe_size) ? (size_t)rem : chan->pipe_size;
+	if (*budget && len > *budget)
+		len = *budget;
+	*budget = 0;
+	if (len == 0) {
+		pr_err("Client " PRWIU " sends invalid packet\n",
+		       W_IU(chan));
+		return -EINVAL;
+	}
+
+	/*
+	 * socket -> pipe -> file, the content never
+	 * goes through user space.
+	 */
+	in = splice(chan->cli_fd, NULL, chan->pipe_fd[1], NULL, len,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (in == 0)
+		return -ECONNRESET;
+
+	if (in < 0) {
+		err = errno;
+		if (err == EAGAIN)
+			return 0;
+		pr_err("splice(): %s\n", strerror(err));
+		return -err;
+	}
+
+	pr_dbg("splice() %zd bytes from " PRWIU "\n", in, W_IU(chan));
+	note_channel_rx(state, chan, (size_t)in);
+	if ((size_t)in == len)
+		*budget = len;
+	while (in > 0) {
+		out = splice(chan->pipe_fd[0], NULL, file_fd, NULL, (size_t)in,
+			     SPLICE_F_MOVE);
+		stat_add(&state->stats.write_calls, 1);
+		if (out < 0) {
+			err = errno;
+			if (err == EINTR)
+				continue;
+			if (err == EINVAL) {
+				err = splice_fallback(state, chan, (size_t)in);
+				if (err)
+					return err;
+				break;
+			}
+			pr_err("splice(): %s\n", strerror(err));
+			return -err;
+		}
+
+		in -= out;
+		chan->recv_file_len += (uint64_t)out;
+	}
+
+	if (chan->recv_file_len < chan->file_size)
+		return 0;
+
+	mark_file_complete(state, chan);
+	if (!chan->persistent)
+		return -EALREADY;
+
+	/*
+	 * The splice never reads past the end of the file, the
+	 * next header is still in the socket.
+	 */
+	finish_channel_file(state, chan);
+	return 0;
+}
+
+
+int handle_client_data(struct server_state *state, struct client_channel *chan,
+		       size_t recv_s)
+{
+	int ret = 0;
+	chan->recv_s = recv_s;
+again:
+	if (chan->got_file_info) {
+		ret = handle_file_content(state, chan, recv_s);
+	} else {
+		ret = handle_file_info(state, chan, recv_s);
+
+		/*
+		 * An empty file or range, or a resumed file that
+		 * is already in, has no content to wait for.
+		 */
+		if (!ret && chan->got_file_info &&
+		    chan->recv_file_len >= chan->file_size)
+			ret = -EAGAIN;
+	}
+
+	if (ret == -EAGAIN) {
+		recv_s = chan->recv_s;
+		goto again;
+	}
+
+	if (!ret && chan->got_file_info && state->cfg->use_splice &&
+	    !state->cfg->nr_writers && !chan->no_splice) {
+		/*
+		 * The header and the early content went through the
+		 * buffer, the rest can be spliced. Keep using the
+		 * buffer if we can't splice.
+		 */
+		ret = init_channel_splice(chan);
+	}
+
+	return ret;
+}
+
+
+int attach_channel_buf(struct server_state *state, struct client_channel *chan)
+{
+	if (chan->pktbuf != NULL)
+		return 0;
+
+	chan->pktbuf = buf_pool_get(&state->buf_pools[chan->buf_class]);
+	if (chan->pktbuf == NULL) {
+		pr_err_ratelimited("Cannot attach receive buffer to " PRWIU
+				   "\n", W_IU(chan));
+		return -ENOBUFS;
+	}
+	return 0;
+}
+
+
+void detach_channel_buf(struct server_state *state,
+			struct client_channel *chan)
+{
+	if (chan->pktbuf == NULL)
+		return;
+
+	buf_pool_put(&state->buf_pools[chan->buf_class], chan->pktbuf);
+	chan->pktbuf = NULL;
+}
+
+
+/*
+ * A recv() that fills the whole buffer means more is likely
+ * waiting in the socket. After BUF_GROW_AFTER of them in a
+ * row the channel moves to the next bigger buffer, it takes
+ * effect when the current one is detached.
+ */
+static void note_recv_fill(struct client_channel *chan, bool full)
+{
+	if (!full) {
+		chan->full_recvs = 0;
+		return;
+	}
+
+	if (chan->full_recvs < BUF_GROW_AFTER)
+		chan->full_recvs++;
+}
+
+
+static void grow_channel_buf(struct server_state *state,
+			     struct client_channel *chan)
+{
+	if (chan->full_recvs < BUF_GROW_AFTER ||
+	    chan->buf_class + 1u >= state->nr_buf_pools)
+		return;
+
+	chan->buf_class++;
+	chan->full_recvs = 0;
+	pr_dbg("Receive buffer of " PRWIU " grows to %u bytes\n", W_IU(chan),
+	       chan_buf_size(state, chan));
+}
+
+
+/*
+ * The file was preallocated to the announced size, don't leave
+ * the unwritten tail behind if the client went away early.
+ */
+static void truncate_partial_file(struct client_channel *chan)
+{
+	/*
+	 * The other ranges of a multi-stream file may be
+	 * further in.
+	 */
+	if (chan->recv_file_len >= chan->file_size || chan->xfer != NULL)
+		return;
+
+	pr_info("Truncating partial file" PRCHAN " size=%" PRIu64 "\n",
+		W_CHAN(chan), chan->file_size);
+	if (ftruncate(fileno(chan->handle), (off_t)chan->recv_file_len) < 0)
+		pr_err("ftruncate(): %s\n", strerror(errno));
+}
+
+
+void release_channel(struct server_state *state, struct client_channel *chan)
+{
+	tw_del(&state->timers, &chan->timer);
+	detach_channel_buf(state, chan);
+	close_channel_splice(chan);
+	if (chan->handle != NULL) {
+		pr_info("Syncing buffer to disk...\n");
+		fflush(chan->handle);
+		truncate_partial_file(chan);
+		fclose(chan->handle);
+	}
+	if (chan->xfer != NULL)
+		xfer_put(chan->xfer);
+	pr_info("Closing connection" PRCHAN "\n", W_CHAN(chan));
+	stat_add(&state->stats.bytes_in, chan->recv_file_len - chan->file_off);
+	stat_add(&state->stats.closed, 1);
+	state->av_client++;
+	close(chan->cli_fd);
+	reset_client(chan, chan->arr_idx);
+	free_channel(state, chan);
+}
+
+
+/*
+ * Tops up the DRR deficit of a ready channel for this round.
+ * Returns 0 if the scheduler is off, a single recv() then.
+ */
+static uint32_t sched_refill(struct server_state *state,
+			     struct client_channel *chan)
+{
+	const struct server_cfg *cfg = state->cfg;
+	uint32_t quantum = cfg->quantum * cfg->classes[chan->sched_class].weight;
+
+	if (!quantum)
+		return 0;
+
+	/*
+	 * What's left was cut short by the writer budget or a
+	 * finished file, carry at most one round of it over.
+	 */
+	if (chan->deficit > quantum)
+		chan->deficit = quantum;
+	chan->deficit += quantum;
+	return quantum;
+}
+
+
+/*
+ * The socket has no more for now. An idle channel doesn't keep
+ * its deficit, or it could burst after a quiet spell.
+ */
+static inline void sched_drained(struct client_channel *chan)
+{
+	chan->deficit = 0;
+}
+
+
+static int splice_channel(struct server_state *state,
+			  struct client_channel *chan, bool drr)
+{
+	int ret;
+	size_t len;
+
+	do {
+		len = drr ? chan->deficit : 0;
+		ret = handle_file_splice(state, chan, &len);
+		if (ret)
+			return ret;
+		if (!drr)
+			return 0;
+		if (len == 0) {
+			sched_drained(chan);
+			return 0;
+		}
+		chan->deficit -= (uint32_t)len;
+	} while (chan->deficit > 0 && chan->splicing);
+
+	return 0;
+}
+
+
+/*
+ * With the scheduler on, a ready channel keeps receiving until
+ * its deficit is spent or the socket is drained, else it gets
+ * a single recv() per event.
+ */
+static int handle_client_event(int cli_fd, struct server_state *state,
+			       struct client_channel *chan, uint32_t revents)
+{
+	int err;
+	bool drr;
+	char *recv_buf;
+	size_t recv_s;
+	size_t recv_len;
+	size_t buf_room;
+	ssize_t recv_ret;
+	const uint32_t err_mask = EPOLLERR | EPOLLHUP;
+
+	if ((revents & err_mask) || (chan->cli_fd == -1))
+		goto out_close;
+
+	drr = sched_refill(state, chan) != 0;
+	if (chan->splicing) {
+		if (splice_channel(state, chan, drr))
+			goto out_close;
+		return 0;
+	}
+
+	do {
+		/*
+		 * The buffer is only attached while there are
+		 * unconsumed bytes in it.
+		 */
+		if (attach_channel_buf(state, chan))
+			goto out_close;
+
+		recv_s   = chan->recv_s;
+		recv_buf = chan->pktbuf->raw_buf + recv_s;
+		buf_room = chan_buf_size(state, chan) - recv_s;
+		recv_len = buf_room;
+		if (drr && recv_len > chan->deficit)
+			recv_len = chan->deficit;
+		recv_ret = recv(cli_fd, recv_buf, recv_len, 0);
+		if (recv_ret == 0)
+			goto out_close;
+
+		if (recv_ret < 0) {
+			err = errno;
+			if (err == EAGAIN) {
+				sched_drained(chan);
+				goto out_detach;
+			}
+			pr_err("recv(): %s\n", strerror(err));
+			goto out_close;
+		}
+
+		pr_dbg("recv() %zd bytes from " PRWIU "\n", recv_ret, W_IU(chan));
+		note_channel_rx(state, chan, (size_t)recv_ret);
+		note_recv_fill(chan, (size_t)recv_ret == buf_room);
+		recv_s += (size_t)recv_ret;
+		if (handle_client_data(state, chan, recv_s))
+			goto out_close;
+
+		if (!drr)
+			break;
+		if ((size_t)recv_ret < recv_len) {
+			sched_drained(chan);
+			break;
+		}
+		chan->deficit -= (uint32_t)recv_ret;
+
+		/*
+		 * Switched to splicing, or over the writer budget,
+		 * the rest waits for the next round.
+		 */
+	} while (chan->deficit > 0 && !chan->splicing &&
+		 !chan->rx_paused);
+
+out_detach:
+	if (chan->recv_s == 0)
+		detach_channel_buf(state, chan);
+	if (chan->pktbuf == NULL)
+		grow_channel_buf(state, chan);
+	return 0;
+out_close:
+	close_epoll_channel(state, chan);
+	return 0;
+}
+
+
+static int handle_event(struct server_state *state, struct epoll_event *event)
+{
+	int fd = event->data.fd;
+	uint32_t map_to;
+	uint32_t *epoll_map = state->epoll_map;
+	uint32_t revents = event->events;
+
+	map_to = epoll_map[fd];
+	if (map_to == EPOLL_MAP_TO_NOP) {
+		pr_crit("epoll_map[%d] contains EPOLL_MAP_TO_NOP\n", fd);
+		abort();
+		return -EFAULT;
+	}
+
+
+	if (map_to == EPOLL_MAP_TO_TCP)
+		/*
+		 * A client is connecting to us.
+		 */
+		return handle_tcp_event(fd, state, revents);
+
+	if (map_to == EPOLL_MAP_TO_WRITER) {
+		/*
+		 * The disk writers have completed some writes.
+		 */
+		writer_reap(state);
+		return 0;
+	}
+
+	if (map_to == EPOLL_MAP_TO_WAKE) {
+		/*
+		 * Stop or a stats request, the loop looks at
+		 * both after every batch.
+		 */
+		uint64_t val;
+
+		if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+			pr_err("read(eventfd): %s\n", strerror(errno));
+		return 0;
+	}
+
+
+	/*
+	 * A client calls send(), let's recv() it.
+	 */
+	map_to -= EPOLL_MAP_SHIFT;
+	return handle_client_event(fd, state, get_channel(state, map_to),
+				   revents);
+}
+
+
+static int handle_events(struct server_state *state, struct epoll_event *events,
+			 int epoll_ret)
+{
+	int ret;
+	for (int i = 0; i < epoll_ret; i++) {
+		ret = handle_event(state, &events[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+
+/*
+ * A full batch means more is likely ready, take twice as many
+ * next time. Shrink again once batches are mostly empty, so a
+ * burst doesn't leave a cold, oversized array behind.
+ */
+static void adapt_batch(struct server_state *state, int nr)
+{
+	uint32_t batch = state->batch;
+
+	if ((uint32_t)nr == batch && batch < EPOLL_BATCH_MAX)
+		state->batch = batch * 2u;
+	else if ((uint32_t)nr < batch / 8u && batch > EPOLL_BATCH_MIN)
+		state->batch = batch / 2u;
+}
+
+
+/*
+ * Only the timers need a periodic wake up, without any the
+ * shard sleeps until something happens.
+ */
+static int event_loop_timeout(struct server_state *state)
+{
+	return state->timers.nr_timers ? EPOLL_TIMEOUT : -1;
+}
+
+
+static int wait_events(struct server_state *state)
+{
+	int ret;
+	uint64_t deadline;
+	uint32_t spin = state->cfg->busy_poll;
+	int epoll_fd = state->epoll_fd;
+	int maxevents = (int)state->batch;
+
+	/*
+	 * Busy poll: keep looking for up to @spin usec before
+	 * going to sleep, a small file that arrives meanwhile
+	 * doesn't pay for the wake up.
+	 */
+	if (spin) {
+		deadline = stats_now_us() + spin;
+		do {
+			ret = epoll_wait(epoll_fd, state->events, maxevents, 0);
+			if (ret != 0)
+				return ret;
+		} while (!state->stop_el && stats_now_us() < deadline);
+	}
+
+	return epoll_wait(epoll_fd, state->events, maxevents,
+			  event_loop_timeout(state));
+}
+
+
+static int run_event_loop(struct server_state *state)
+{
+	int err;
+	int ret = 0;
+	int epoll_ret;
+
+	while (!state->stop_el) {
+
+		epoll_ret = wait_events(state);
+		if (epoll_ret == 0) {
+			/*
+			 * Epoll reached timeout
+			 */
+			run_channel_timers(state);
+			stats_poll(state);
+			continue;
+		}
+
+		if (epoll_ret < 0) {
+			err = errno;
+			if (err == EINTR) {
+				pr_info("Interrupted!\n");
+				continue;
+			}
+
+			ret = -err;
+			pr_err("epoll_wait(): %s\n", strerror(err));
+			break;
+		}
+
+		adapt_batch(state, epoll_ret);
+		ret = handle_events(state, state->events, epoll_ret);
+		run_channel_timers(state);
+		stats_poll(state);
+		if (ret) {
+			if (ret == -EAGAIN)
+				continue;
+			if (ret == -ECANCELED)
+				continue;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+
+static void destroy_state(struct server_state *state)
+{
+	int tcp_fd = state->tcp_fd;
+	int epoll_fd = state->epoll_fd;
+	struct client_channel *chan;
+
+	/*
+	 * The io_uring engine must be torn down first, it may
+	 * still reference the client and file descriptors.
+	 */
+	destroy_uring(state);
+
+	/*
+	 * The writers have stopped, account what they have
+	 * written before the files are closed.
+	 */
+	writer_reap(state);
+
+	for (uint32_t i = 0; i < state->nr_chans; i++) {
+		chan = get_channel(state, i);
+		if (!chan->is_used)
+			continue;
+
+		/*
+		 * We have active client here.
+		 *
+		 * Let's disconnect it and sync any
+		 * received data to the disk.
+		 */
+		close_channel_splice(chan);
+		if (chan->handle) {
+			pr_info("Syncing buffer to disk...\n");
+			fflush(chan->handle);
+			truncate_partial_file(chan);
+			fclose(chan->handle);
+		}
+		if (chan->xfer != NULL)
+			xfer_put(chan->xfer);
+		pr_info("Closing connection" PRCHAN "\n", W_CHAN(chan));
+		close(chan->cli_fd);
+		stat_add(&state->stats.bytes_in,
+			 chan->recv_file_len - chan->file_off);
+	}
+
+	if (tcp_fd != -1) {
+		pr_info("Closing tcp_fd (%d)...\n", tcp_fd);
+		close(tcp_fd);
+	}
+
+	if (epoll_fd != -1) {
+		pr_info("Closing epoll_fd (%d)...\n", epoll_fd);
+		close(epoll_fd);
+	}
+
+	if (state->wake_fd != -1) {
+		int wake_fd = state->wake_fd;
+
+		__atomic_store_n(&state->wake_fd, -1, __ATOMIC_RELAXED);
+		close(wake_fd);
+	}
+
+	for (uint32_t i = 0; i < state->nr_chans; i += CHAN_SLAB_SIZE)
+		free(state->chan_slabs[i >> CHAN_SLAB_SHIFT]);
+
+	writer_destroy_shard(state);
+	for (uint32_t i = 0; i < BUF_POOL_CLASSES; i++)
+		buf_pool_destroy(&state->buf_pools[i]);
+	free(state->snaps);
+	free(state->events);
+	free(state->epoll_map);
+	free(state->free_slots);
+	free(state->chan_slabs);
+}
+
+
+static int parse_on_off(const char *opt, const char *val, bool *out)
+{
+	if (!strcmp(val, "on")) {
+		*out = true;
+		return 0;
+	}
+
+	if (!strcmp(val, "off")) {
+		*out = false;
+		return 0;
+	}
+
+	pr_err("Invalid value for %s: \"%s\"\n", opt, val);
+	return -EINVAL;
+}
+
+
+static int parse_u32(const char *opt, const char *val, uint32_t min,
+		     uint32_t max, uint32_t *out)
+{
+	char *end;
+	unsigned long num;
+
+	num = strtoul(val, &end, 10);
+	if (*end != '\0' || *val == '\0' || num < min || num > max) {
+		pr_err("%s must be between %u and %u\n", opt, min, max);
+		return -EINVAL;
+	}
+
+	*out = (uint32_t)num;
+	return 0;
+}
+
+
+static int parse_buf_kib(const char *opt, const char *val, uint32_t *out)
+{
+	uint32_t kib;
+
+	if (parse_u32(opt, val, RECV_BUFFER_MIN / 1024u,
+		      RECV_BUFFER_MAX / 1024u, &kib))
+		return -EINVAL;
+
+	if (kib & (kib - 1u)) {
+		pr_err("%s must be a power of two\n", opt);
+		return -EINVAL;
+	}
+
+	*out = kib * 1024u;
+	return 0;
+}
+
+
+static int parse_server_opts(int argc, char *argv[], struct server_cfg *cfg)
+{
+	char *end;
+	unsigned long num;
+	const char *opt, *val;
+
+	for (int i = 0; i < argc; i += 2) {
+		opt = argv[i];
+		if (i + 1 >= argc) {
+			pr_err("Missing value for option \"%s\"\n", opt);
+			return -EINVAL;
+		}
+		val = argv[i + 1];
+
+		if (!strcmp(opt, "--engine")) {
+			if (!strcmp(val, "epoll")) {
+				cfg->engine = ENGINE_EPOLL;
+			} else if (!strcmp(val, "io_uring")) {
+				cfg->engine = ENGINE_URING;
+			} else {
+				pr_err("Invalid engine \"%s\"\n", val);
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		if (!strcmp(opt, "--splice")) {
+			if (parse_on_off(opt, val, &cfg->use_splice))
+				return -EINVAL;
+			continue;
+		}
+
+		if (!strcmp(opt, "--workers")) {
+			num = strtoul(val, &end, 10);
+			if (*end != '\0' || num < 1 || num > MAX_WORKERS) {
+				pr_err("--workers must be between 1 "
+				       "and %u\n", MAX_WORKERS);
+				return -EINVAL;
+			}
+			cfg->nr_workers = (uint32_t)num;
+			continue;
+		}
+
+		if (!strcmp(opt, "--max-clients")) {
+			num = strtoul(val, &end, 10);
+			if (*end != '\0' || num < 1 || num > EPOLL_MAP_MAX) {
+				pr_err("--max-clients must be between 1 "
+				       "and %u\n", EPOLL_MAP_MAX);
+				return -EINVAL;
+			}
+			cfg->max_clients = (uint32_t)num;
+			continue;
+		}
+
+		if (!strcmp(opt, "--backlog")) {
+			if (parse_u32(opt, val, 1, INT32_MAX, &cfg->backlog))
+				return -EINVAL;
+			continue;
+		}
+
+		if (!strcmp(opt, "--preallocate")) {
+			if (parse_on_off(opt, val, &cfg->preallocate))
+				return -EINVAL;
+			continue;
+		}
+
+		if (!strcmp(opt, "--durability")) {
+			if (!strcmp(val, "none")) {
+				cfg->durability = DURABILITY_NONE;
+			} else if (!strcmp(val, "fdatasync")) {
+				cfg->durability = DURABILITY_FDATASYNC;
+			} else if (!strcmp(val, "group")) {
+				cfg->durability = DURABILITY_GROUP;
+			} else {
+				pr_err("Invalid durability \"%s\"\n",
+				       val);
+				return -EINVAL;
+			}
+			continue;
+		}
+
+		if (!strcmp(opt, "--sync-interval")) {
+			if (parse_u32(opt, val, 1, 60000u, &cfg->sync_interval))
+				return -EINVAL;
+			continue;
+		}
+
+		if (!strcmp(opt, "--sync-batch")) {
+			if (parse_u32(opt, val, 1, 1u << 20u, &cfg->sync_batch))
+				return -EINVAL;
+			continue;
+		}
+
+		if (!strcmp(opt, "--writers")) {
+			if (parse_u32(opt, val, 0, MAX_WRITERS, &cfg->nr_writers))
+				return -EINVAL;
+			continue;
+		}
+
+		if (!strcmp(opt, "--writer-budget")) {
+			if (parse_u32(opt, val, RECV_BUFFER_MIN / 1024u,
+				      1u << 20u, &cfg->writer_budget))
+				return -EINVAL;
+			cfg->writer_budget *= 1024u;
+			continue;
+		}
+
+		if (!strcmp(opt, "--recv-buffer")) {
+			if (parse_buf_kib(opt, val, &cfg->recv_buf_size))
+				return -EINVAL;
+			continue;
+		}
+
+		if (!strcmp(opt, "--quantum")) {
+			if (parse_u32(opt, val, 0, RECV_BUFFER_MAX / 1024u,
+				      &cfg->quantum))
+				return -EINVAL;
+			cfg->quantum *= 1024u;
+			continue;
+		}
 
-	total_expected = sizeof(*pkt) + file_size;
-	if (recv_s > total_expected) {
-		/*
-		 * Expected total bytes sent by client
-		 * is `total_expected`. If we receive
-		 * more than that at this point, then
-		 * client has done something totally
-		 * wrong!
-		 */
-		printf("Error: Client " PRWIU " sends invalid packet\n",
-		       W_IU(chan));
-		ret = -EINVAL;
-		goto out;
-	}
+		if (!strcmp(opt, "--class")) {
+			if (sched_add_class(cfg, val))
+				return -EINVAL;
+			continue;
+		}
 
+		if (!strcmp(opt, "--recv-buffer-max")) {
+			if (parse_buf_kib(opt, val, &cfg->recv_buf_max))
+				return -EINVAL;
+			continue;
+		}
 
+		if (!strcmp(opt, "--sock-rcvbuf")) {
+			if (parse_u32(opt, val, 0, 1u << 20u, &cfg->sock_rcvbuf))
+				return -EINVAL;
+			cfg->sock_rcvbuf *= 1024u;
+			continue;
+		}
 
-	chan->file_size = pkt->file_size;
-	memcpy(chan->file_name, pkt->file_name, pkt->file_name_len);
+		if (!strcmp(opt, "--congestion")) {
+			cfg->congestion = val;
+			continue;
+		}
 
-	/*
-	 * Ensure null terminator for safety.
-	 */
-	chan->file_name[pkt->file_name_len] = '\0';
-	chan->file_name[sizeof(chan->file_name) - 1] = '\0';
-	chan->got_file_info = true;
+		if (!strcmp(opt, "--busy-poll")) {
+			if (parse_u32(opt, val, 0, 1000000u, &cfg->busy_poll))
+				return -EINVAL;
+			continue;
+		}
 
-	ret = open_client_file_handle(state, chan, chan->file_name);
-	if (ret)
-		goto out;
+		if (!strcmp(opt, "--huge-pages")) {
+			if (parse_on_off(opt, val, &cfg->huge_pages))
+				return -EINVAL;
+			continue;
+		}
 
+		if (!strcmp(opt, "--pin-cpu")) {
+			if (parse_on_off(opt, val, &cfg->pin_cpu))
+				return -EINVAL;
+			continue;
+		}
 
-	printf("=================================\n");
-	printf("File name: %s\n", chan->file_name);
-	printf("File size: %" PRIu64 "\n", file_size);
-	printf("=================================\n");
-	printf("Receiving file from " PRWIU "...\n", W_IU(chan));
+		if (!strcmp(opt, "--log-level")) {
+			if (log_parse_level(val, &log_level)) {
+				pr_err("Invalid log level \"%s\"\n", val);
+				return -EINVAL;
+			}
+			continue;
+		}
 
-	if (recv_s > sizeof(*pkt)) {
-		/*
-		 * Partial bytes of the file has
-		 * arrived together with the file info.
-		 *
-		 * Must memmove to the front before
-		 * we run out of buffer!
-		 */
-		recv_s -= sizeof(*pkt);
-		memmove(chan->pktbuf.raw_buf,
-			chan->pktbuf.raw_buf + sizeof(*pkt), recv_s);
+		if (!strcmp(opt, "--stats-socket")) {
+			cfg->stats_socket = val;
+			continue;
+		}
 
-		chan->recv_s = recv_s;
-		ret = -EAGAIN;
-		goto out;
-	}
-out:
-	return ret;
-}
+		if (!strcmp(opt, "--header-timeout")) {
+			if (parse_u32(opt, val, 0, 86400u, &cfg->header_timeout))
+				return -EINVAL;
+			continue;
+		}
 
+		if (!strcmp(opt, "--idle-timeout")) {
+			if (parse_u32(opt, val, 0, 86400u, &cfg->idle_timeout))
+				return -EINVAL;
+			continue;
+		}
 
-static int handle_file_content(struct server_state *state,
-			       struct client_channel *chan, size_t recv_s)
-{
-	FILE *handle;
-	size_t fwrite_ret;
+		if (!strcmp(opt, "--min-rate")) {
+			if (parse_u32(opt, val, 0, UINT32_MAX, &cfg->min_rate))
+				return -EINVAL;
+			continue;
+		}
 
-	handle     = chan->handle;
-	fwrite_ret = fwrite(chan->pktbuf.raw_buf, sizeof(char), recv_s, handle);
-	if (fwrite_ret != recv_s) {
-		int ret = ferror(handle);
-		if (ret != 0) {
-			clearerr(handle);
-			printf("Error: fwrite(): %s\n", strerror(ret));
-			return -ret;
+		if (!strcmp(opt, "--rate-window")) {
+			if (parse_u32(opt, val, 1, 86400u, &cfg->rate_window))
+				return -EINVAL;
+			continue;
 		}
-	}
-	chan->recv_s = 0;
-	chan->recv_file_len += fwrite_ret;
 
-	if (chan->recv_file_len >= chan->file_size) {
-		printf("File received completely from " PRWIU "\n",
-		       W_IU(chan));
-		return -EALREADY;
+		pr_err("Unknown server option \"%s\"\n", opt);
+		return -EINVAL;
 	}
 
-	(void)state;
 	return 0;
 }
 
 
-static int handle_client_data(struct server_state *state,
-			      struct client_channel *chan, size_t recv_s)
+static void assign_worker_cpus(struct server_state *shards, uint32_t nr)
 {
-	int ret = 0;
-	chan->recv_s = recv_s;
-again:
-	if (chan->got_file_info) {
-		ret = handle_file_content(state, chan, recv_s);
-	} else {
-		ret = handle_file_info(state, chan, recv_s);
-		if (ret == -EAGAIN) {
-			recv_s = chan->recv_s;
-			goto again;
-		}
+	int cpu = -1;
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+		pr_err("sched_getaffinity(): %s\n", strerror(errno));
+		return;
 	}
 
-	return ret;
+	/*
+	 * Round-robin the workers over the CPUs we are
+	 * allowed to run on.
+	 */
+	for (uint32_t i = 0; i < nr; i++) {
+		do {
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		} while (!CPU_ISSET(cpu, &set));
+		shards[i].cpu = cpu;
+	}
 }
 
 
-static int handle_client_event(int cli_fd, struct server_state *state,
-			       struct client_channel *chan, uint32_t revents)
+static void pin_worker_cpu(struct server_state *state)
 {
-	int err;
-	char *recv_buf;
-	size_t recv_s;
-	size_t recv_len;
-	ssize_t recv_ret;
-	const uint32_t err_mask = EPOLLERR | EPOLLHUP;
-
-	if ((revents & err_mask) || (chan->cli_fd == -1))
-		goto out_close;
+	cpu_set_t set;
 
-	recv_s   = chan->recv_s;
-	recv_buf = chan->pktbuf.raw_buf;
-	recv_len = sizeof(chan->pktbuf.raw_buf) - recv_s;
-	recv_ret = recv(cli_fd, recv_buf, recv_len, 0);
-	if (recv_ret == 0)
-		goto out_close;
+	if (state->cpu < 0)
+		return;
 
-	if (recv_ret < 0) {
-		err = errno;
-		if (err == EAGAIN)
-			return 0;
-		printf("Error: recv(): %s\n", strerror(err));
-		goto out_close;
+	CPU_ZERO(&set);
+	CPU_SET(state->cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		pr_err("sched_setaffinity(%d): %s\n", state->cpu,
+		       strerror(errno));
+		return;
 	}
+	pr_dbg("Worker %u is pinned to CPU %d\n", state->worker_id,
+	       state->cpu);
+}
 
-	printf_dbg("recv() %zd bytes from " PRWIU "\n", recv_ret, W_IU(chan));
-	recv_s += (size_t)recv_ret;
-	if (handle_client_data(state, chan, recv_s))
-		goto out_close;
 
-	return 0;
-out_close:
-	if (chan->handle != NULL) {
-		printf("Syncing buffer to disk...\n");
-		fflush(chan->handle);
-		fclose(chan->handle);
+static int init_shard(struct server_state *state)
+{
+	int ret;
+
+	ret = init_state(state);
+	if (ret)
+		return ret;
+
+	if (state->cfg->engine == ENGINE_URING)
+		ret = init_uring(state);
+	else
+		ret = init_epoll(state);
+	if (ret)
+		return ret;
+
+	ret = writer_init_shard(state);
+	if (ret)
+		return ret;
+
+	if (state->wr_event_fd != -1) {
+		ret = epoll_add(state->epoll_fd, state->wr_event_fd, EPOLLIN);
+		if (ret)
+			return ret;
+		state->epoll_map[state->wr_event_fd] = EPOLL_MAP_TO_WRITER;
 	}
-	printf("Closing connection from " PRWIU "...\n", W_IU(chan));
-	state->av_client++;
-	state->epoll_map[cli_fd] = EPOLL_MAP_TO_NOP;
-	epoll_delete(state->epoll_fd, cli_fd);
-	reset_client(chan, chan->arr_idx);
-	close(cli_fd);
-	return 0;
+
+	return init_socket(state);
 }
 
 
-static int handle_event(struct server_state *state, struct epoll_event *event)
+static void *run_shard(void *arg)
 {
-	int fd = event->data.fd;
-	uint16_t map_to;
-	uint16_t *epoll_map = state->epoll_map;
-	uint32_t revents = event->events;
+	int ret;
+	struct server_state *state = arg;
 
-	map_to = epoll_map[fd];
-	if (map_to == EPOLL_MAP_TO_NOP) {
-		printf("Bug: epoll_map[%d] contains EPOLL_MAP_TO_NOP\n", fd);
-		abort();
-		return -EFAULT;
-	}
+	pin_worker_cpu(state);
 
+	if (state->cfg->engine == ENGINE_URING)
+		ret = run_uring_event_loop(state);
+	else
+		ret = run_event_loop(state);
 
-	if (map_to == EPOLL_MAP_TO_TCP)
+	if (ret) {
 		/*
-		 * A client is connecting to us.
+		 * One shard is broken, take the others down with it.
 		 */
-		return handle_tcp_event(fd, state, revents);
-
+		stop_all_shards();
+	}
 
-	/*
-	 * A client calls send(), let's recv() it.
-	 */
-	map_to -= EPOLL_MAP_SHIFT;
-	return handle_client_event(fd, state, &state->chans[map_to], revents);
+	state->ret = ret;
+	return NULL;
 }
 
 
-static int handle_events(struct server_state *state, struct epoll_event *events,
-			 int epoll_ret)
+static int start_workers(struct server_state *shards, uint32_t nr)
 {
 	int ret;
-	for (int i = 0; i < epoll_ret; i++) {
-		ret = handle_event(state, &events[i]);
-		if (ret)
-			return ret;
+	sigset_t set, old;
+
+	/*
+	 * Signals are handled by the main thread only, it
+	 * wakes the workers up through their wake_fd.
+	 */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (uint32_t i = 1; i < nr; i++) {
+		ret = pthread_create(&shards[i].thread, NULL, run_shard,
+				     &shards[i]);
+		if (ret) {
+			pr_err("pthread_create(): %s\n", strerror(ret));
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			return -ret;
+		}
+		shards[i].has_thread = true;
 	}
 
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
 	return 0;
 }
 
 
-static int run_event_loop(struct server_state *state)
+static int join_workers(struct server_state *shards, uint32_t nr)
 {
-	int err;
 	int ret = 0;
-	int epoll_ret;
-	int timeout = 1000; /* in milliseconds */
-	int maxevents = 32;
-	int epoll_fd = state->epoll_fd;
-	struct epoll_event events[32];
-
-	while (!state->stop_el) {
 
-		epoll_ret = epoll_wait(epoll_fd, events, maxevents, timeout);
-		if (epoll_ret == 0) {
-			/* 
-			 * Epoll reached timeout
-			 *
-			 * TODO: Client timeout monitoring.
-			 */
-			continue;
-		}
+	for (uint32_t i = 0; i < nr; i++) {
+		if (shards[i].has_thread)
+			pthread_join(shards[i].thread, NULL);
+		if (shards[i].ret && !ret)
+			ret = shards[i].ret;
+	}
 
-		if (epoll_ret < 0) {
-			err = errno;
-			if (err == EINTR) {
-				printf("Interrupted!\n");
-				continue;
-			}
+	return ret;
+}
 
-			ret = -err;
-			printf("Error: epoll_wait(): %s\n", strerror(err));
-			break;
-		}
 
-		ret = handle_events(state, events, epoll_ret);
-		if (ret) {
-			if (ret == -EAGAIN)
-				continue;
-			if (ret == -ECANCELED)
-				continue;
-			break;
-		}
+static void print_stats(struct server_state *shards, uint32_t nr)
+{
+	struct server_stats total;
+	struct server_stats *st;
+	const struct server_cfg *cfg = shards[0].cfg;
+
+	memset(&total, 0, sizeof(total));
+	for (uint32_t i = 0; i < nr; i++) {
+		st = &shards[i].stats;
+		if (nr > 1)
+			pr_info("Worker %u: accepted=%" PRIu64 " rejected=%"
+				PRIu64 " timeouts=%" PRIu64 " files=%" PRIu64
+				" bytes_in=%" PRIu64 "\n", i, st->accepted,
+				st->rejected, st->timeouts, st->files_done,
+				st->bytes_in);
+
+		total.accepted   += st->accepted;
+		total.rejected   += st->rejected;
+		total.timeouts   += st->timeouts;
+		total.files_done += st->files_done;
+		total.bytes_in   += st->bytes_in;
+		total.rx_bytes   += st->rx_bytes;
+		for (uint32_t c = 0; c < cfg->nr_classes; c++)
+			total.class_bytes[c] += st->class_bytes[c];
 	}
 
-	return ret;
+	for (uint32_t c = 0; cfg->nr_classes > 1 && c < cfg->nr_classes; c++)
+		pr_info("Class %s: weight=%u rx_bytes=%" PRIu64 "\n",
+			cfg->classes[c].name, cfg->classes[c].weight,
+			total.class_bytes[c]);
+
+	pr_info("Total: accepted=%" PRIu64 " rejected=%" PRIu64 " timeouts=%"
+		PRIu64 " files=%" PRIu64 " bytes_in=%" PRIu64 " rx_bytes=%"
+		PRIu64 "\n", total.accepted, total.rejected, total.timeouts,
+		total.files_done, total.bytes_in, total.rx_bytes);
 }
 
 
-static void destroy_state(struct server_state *state)
+static int internal_run_server(int argc, char *argv[])
 {
-	int tcp_fd = state->tcp_fd;
-	int epoll_fd = state->epoll_fd;
-	struct client_channel *chan, *chans = state->chans;
+	int ret;
+	uint32_t nr;
+	struct server_cfg cfg;
+	struct server_state *shards;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.bind_addr    = argv[0];
+	cfg.bind_port    = (uint16_t)atoi(argv[1]);
+	cfg.engine       = ENGINE_EPOLL;
+	cfg.use_splice   = true;
+	cfg.pin_cpu      = false;
+	cfg.huge_pages   = false;
+	cfg.nr_workers   = 1;
+	cfg.max_clients  = DEFAULT_MAX_CLIENTS;
+	cfg.backlog      = DEFAULT_BACKLOG;
+	cfg.preallocate  = true;
+	cfg.durability   = DURABILITY_GROUP;
+	cfg.sync_interval = DEFAULT_SYNC_INTERVAL;
+	cfg.sync_batch   = DEFAULT_SYNC_BATCH;
+	cfg.nr_writers   = 0;
+	cfg.writer_budget = DEFAULT_WRITER_BUDGET * 1024u;
+	cfg.header_timeout = DEFAULT_HEADER_TIMEOUT;
+	cfg.idle_timeout = DEFAULT_IDLE_TIMEOUT;
+	cfg.min_rate     = 0;
+	cfg.rate_window  = DEFAULT_RATE_WINDOW;
+	cfg.stats_socket = NULL;
+	cfg.recv_buf_size = RECV_BUFFER_SIZE;
+	cfg.recv_buf_max = 0;
+	cfg.sock_rcvbuf  = 0;
+	cfg.congestion   = NULL;
+	cfg.busy_poll    = 0;
+	cfg.storage_path = "uploaded_files";
+	sched_init_cfg(&cfg);
+
+	ret = parse_server_opts(argc - 2, argv + 2, &cfg);
+	if (ret) {
+		print_help();
+		return ret;
+	}
 
-	for (uint16_t i = 0; i < MAX_CLIENTS; i++) {
-		chan = &chans[i];
-		if (!chan->is_used)
-			continue;
+	if (cfg.recv_buf_max == 0)
+		cfg.recv_buf_max = cfg.recv_buf_size;
+
+	if (cfg.recv_buf_max < cfg.recv_buf_size) {
+		pr_err("--recv-buffer-max is smaller than --recv-buffer\n");
+		return -EINVAL;
+	}
 
+	if (cfg.engine == ENGINE_URING && cfg.recv_buf_max > cfg.recv_buf_size) {
 		/*
-		 * We have active client here.
-		 *
-		 * Let's disconnect it and sync any
-		 * received data to the disk.
+		 * The kernel picks the io_uring buffers, they all
+		 * have the same size.
 		 */
-		if (chan->handle) {
-			printf("Syncing buffer to disk...\n");
-			fflush(chan->handle);
-			fclose(chan->handle);
-		}
-		close(chan->cli_fd);
-		printf("Closing connection from " PRWIU "...\n", W_IU(chan));
+		pr_warn("--recv-buffer-max is ignored by the io_uring engine\n");
+		cfg.recv_buf_max = cfg.recv_buf_size;
 	}
 
-	if (tcp_fd != -1) {
-		printf("Closing tcp_fd (%d)...\n", tcp_fd);
-		close(tcp_fd);
+	if (cfg.engine == ENGINE_URING && cfg.nr_writers) {
+		/*
+		 * io_uring already writes asynchronously.
+		 */
+		pr_warn("--writers is ignored by the io_uring engine\n");
+		cfg.nr_writers = 0;
 	}
 
-	if (epoll_fd != -1) {
-		printf("Closing epoll_fd (%d)...\n", epoll_fd);
-		close(epoll_fd);
+	sched_fix_quantum(&cfg);
+	if (cfg.engine == ENGINE_URING && cfg.quantum &&
+	    cfg.nr_classes > 1) {
+		/*
+		 * Multishot recv, the kernel decides how much each
+		 * channel gets. The classes still count bytes.
+		 */
+		pr_warn("--class weights are ignored by the io_uring engine\n");
 	}
 
-	free(state->epoll_map);
-	free(state->chans);
-}
+	nr = cfg.nr_workers;
+	shards = calloc_wrp(nr, sizeof(*shards));
+	if (shards == NULL)
+		return -ENOMEM;
 
+	for (uint32_t i = 0; i < nr; i++) {
+		shards[i].worker_id = i;
+		shards[i].cpu       = -1;
+		shards[i].cfg       = &cfg;
+		shards[i].tcp_fd    = -1;
+		shards[i].epoll_fd  = -1;
+		shards[i].wr_event_fd = -1;
+		shards[i].wake_fd   = -1;
+	}
 
-static int internal_run_server(char *argv[])
-{
-	int ret;
-	struct server_state *state;
+	g_shards    = shards;
+	g_nr_shards = nr;
 
-	state = malloc(sizeof(*state));
-	if (state == NULL) {
-		printf("Error: malloc(): %s", strerror(ENOMEM));
-		return -ENOMEM;
+	ret = log_start();
+	if (ret) {
+		free(shards);
+		return ret;
 	}
-	memset(state, 0, sizeof(*state));
-	g_state = state;
-
-	state->storage_path = "uploaded_files";
 
 	signal(SIGINT, handle_interrupt);
 	signal(SIGTERM, handle_interrupt);
 	signal(SIGHUP, handle_interrupt);
 	signal(SIGPIPE, SIG_IGN);
 
-	ret = init_state(state);
+	if (cfg.pin_cpu)
+		assign_worker_cpus(shards, nr);
+
+	for (uint32_t i = 0; i < nr; i++) {
+		ret = init_shard(&shards[i]);
+		if (ret)
+			goto out;
+	}
+
+	ret = syncer_start(&cfg);
 	if (ret)
 		goto out;
 
-	ret = init_epoll(state);
+	ret = writer_start(shards, nr, &cfg);
 	if (ret)
 		goto out;
 
-	ret = init_socket(argv[0], (uint16_t)atoi(argv[1]), state);
+	ret = stats_start(shards, nr, &cfg);
 	if (ret)
 		goto out;
 
-	ret = run_event_loop(state);
+	ret = start_workers(shards, nr);
+	if (ret) {
+		stop_all_shards();
+		join_workers(shards, nr);
+		goto out;
+	}
+
+	/*
+	 * The main thread runs the first shard.
+	 */
+	run_shard(&shards[0]);
+	ret = join_workers(shards, nr);
 out:
-	destroy_state(state);
-	free(state);
+	stats_stop();
+	writer_stop();
+	for (uint32_t i = 0; i < nr; i++)
+		destroy_state(&shards[i]);
+
+	syncer_stop();
+	xfer_destroy();
+	print_stats(shards, nr);
+	log_stop();
+	g_nr_shards = 0;
+	free(shards);
 	return ret;
 }
 
@@ -834,13 +3084,14 @@ int run_server(int argc, char *argv[])
 	/*
 	 * argv[0] is the bind address
 	 * argv[1] is the bind port
+	 * argv[2...] are the server options
 	 */
 
-	if (argc != 2) {
-		printf("Error: Invalid argument on run_server\n");
+	if (argc < 2) {
+		pr_err("Invalid argument on run_server\n");
 		print_help();
 		return EINVAL;
 	}
 
-	return -internal_run_server(argv);
+	return -internal_run_server(argc, argv);
 }
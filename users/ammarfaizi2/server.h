@@ -0,0 +1,524 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer server (internal header)
+ *
+ * Shared state for the server event engines.
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+
+#include "ftransfer.h"
+#include "log.h"
+
+
+#define DEFAULT_MAX_CLIENTS	(100u)
+#define CHAN_SLAB_SHIFT		(8u)
+#define CHAN_SLAB_SIZE		(1u << CHAN_SLAB_SHIFT)
+#define EPOLL_MAP_MAX		(1u << 22u)
+#define BUF_POOL_CHUNK_SIZE	(0x200000u)	/* One 2 MiB huge page */
+#define EPOLL_MAP_TO_NOP	(0x0u)
+#define EPOLL_MAP_TO_TCP	(0x1u)
+#define EPOLL_MAP_TO_WRITER	(0x2u)
+#define EPOLL_MAP_TO_WAKE	(0x3u)
+#define EPOLL_MAP_SHIFT		(0x4u)
+#define EPOLL_BATCH_MIN		(32u)		/* Events per epoll_wait  */
+#define EPOLL_BATCH_MAX		(1024u)
+#define EPOLL_TIMEOUT		(1000)		/* ms, with timers armed  */
+#define EPOLL_INPUT_EVT		(EPOLLIN | EPOLLPRI)
+#ifndef RECV_BUFFER_SIZE
+#  define RECV_BUFFER_SIZE	(0x4000u)	/* `make RECV_BUFFER_SIZE=N` */
+#endif
+#define RECV_BUFFER_MIN		(0x1000u)
+#define RECV_BUFFER_MAX		(0x100000u)
+#define BUF_POOL_CLASSES	(9u)		/* RECV_BUFFER_MIN..MAX   */
+#define BUF_GROW_AFTER		(4u)		/* Full recvs in a row    */
+#define SPLICE_PIPE_SIZE	(0x100000u)
+#define MAX_WORKERS		(256u)
+#define DEFAULT_BACKLOG		(4096u)
+#define DEFAULT_SYNC_INTERVAL	(10u)		/* Milliseconds           */
+#define DEFAULT_SYNC_BATCH	(64u)		/* Files                  */
+#define MAX_WRITERS		(64u)
+#define WR_RING_SIZE		(1024u)		/* Jobs, power of two     */
+#define DEFAULT_WRITER_BUDGET	(256u)		/* KiB per channel        */
+#define ACCEPT_BATCH		(256u)
+#define TW_TICK_MS		(100u)
+#define TW_BITS			(6u)
+#define TW_SIZE			(1u << TW_BITS)
+#define TW_MASK			(TW_SIZE - 1u)
+#define TW_LEVELS		(4u)
+#define DEFAULT_HEADER_TIMEOUT	(30u)		/* Seconds                */
+#define DEFAULT_IDLE_TIMEOUT	(120u)		/* Seconds                */
+#define DEFAULT_RATE_WINDOW	(30u)		/* Seconds                */
+#define RESUME_XATTR		"user.ftransfer.resume"
+#define SCHED_MAX_CLASSES	(8u)		/* "default" included     */
+#define SCHED_WEIGHT_MAX	(64u)
+#define DEFAULT_QUANTUM		(64u)		/* KiB per round, at least */
+#define QUANTUM_AUTO		(UINT32_MAX)	/* See sched_fix_quantum()  */
+#define HIST_SUB_BITS		(3u)		/* 12.5% bucket precision */
+#define HIST_SUB		(1u << HIST_SUB_BITS)
+#define HIST_BUCKETS		((64u - HIST_SUB_BITS + 1u) * HIST_SUB)
+
+/* Macros for printing  */
+#define W_IP(CHAN) chan_src_ip(CHAN), chan_src_port(CHAN)
+#define W_IU(CHAN) W_IP(CHAN)
+#define PRWIU "%s:%u"
+
+/* Structured channel fields for the log */
+#define W_CHAN(CHAN) W_IP(CHAN), chan_file_name(CHAN), (CHAN)->recv_file_len
+#define PRCHAN " peer=%s:%u file=\"%s\" bytes=%" PRIu64
+
+#ifndef INET_ADDRSTRLEN
+#  define IPV4_L (sizeof("xxx.xxx.xxx.xxx"))
+#else
+#  define IPV4_L (INET_ADDRSTRLEN)
+#endif
+
+
+/*
+ * Only ever used through a pointer into a buffer pool, the
+ * real capacity is the buf_size of that pool.
+ */
+union uni_pkt {
+	packet_t	packet;
+	char		raw_buf[RECV_BUFFER_MAX];
+};
+
+static_assert(RECV_BUFFER_MIN >= sizeof(packet_t), "Bad RECV_BUFFER_MIN");
+static_assert(RECV_BUFFER_SIZE >= RECV_BUFFER_MIN &&
+	      RECV_BUFFER_SIZE <= RECV_BUFFER_MAX &&
+	      (RECV_BUFFER_SIZE & (RECV_BUFFER_SIZE - 1u)) == 0,
+	      "Bad RECV_BUFFER_SIZE");
+static_assert(RECV_BUFFER_MIN << (BUF_POOL_CLASSES - 1u) == RECV_BUFFER_MAX,
+	      "Bad BUF_POOL_CLASSES");
+static_assert(BUF_POOL_CHUNK_SIZE % RECV_BUFFER_MAX == 0,
+	      "Bad BUF_POOL_CHUNK_SIZE");
+
+/*
+ * Per-shard pool of page aligned receive buffers.
+ */
+struct buf_pool {
+	char		**chunks;	/* mmap()ed chunks                    */
+	uint32_t	nr_chunks;	/* How many chunks?                   */
+	union uni_pkt	**free_bufs;	/* LIFO stack of free buffers         */
+	uint32_t	nr_free;	/* Top of free_bufs                   */
+	uint32_t	nr_bufs;	/* Allocated buffers                  */
+	uint32_t	max_bufs;	/* Upper bound, one per channel       */
+	uint32_t	buf_size;	/* Bytes, a power of two              */
+	uint32_t	chunk_bufs;	/* Buffers per chunk                  */
+	bool		huge_pages;	/* Try MAP_HUGETLB first?             */
+};
+
+/*
+ * Timer wheel entry, embedded in the object it belongs to.
+ */
+struct tw_timer {
+	struct tw_timer		*next;
+	struct tw_timer		**pprev;	/* NULL if not pending        */
+	uint64_t		expires;	/* Absolute tick              */
+};
+
+/*
+ * Hierarchical timer wheel, level N slots cover
+ * TW_SIZE^N ticks each.
+ */
+struct timer_wheel {
+	uint64_t		now;		/* Next tick to process       */
+	uint32_t		nr_timers;	/* Pending timers             */
+	struct tw_timer		*slots[TW_LEVELS][TW_SIZE];
+};
+
+enum server_engine {
+	ENGINE_EPOLL	= 0,
+	ENGINE_URING	= 1,
+};
+
+enum server_durability {
+	DURABILITY_NONE		= 0,	/* Leave it to the page cache  */
+	DURABILITY_FDATASYNC	= 1,	/* Commit every file inline    */
+	DURABILITY_GROUP	= 2,	/* Background batched commits  */
+};
+
+struct xfer;
+
+struct client_channel {
+	bool		is_used;	/* Is this channel used?              */
+	bool		got_file_info;	/* Have we received file info?        */
+	bool		is_closing;	/* Waiting for in-flight I/O to end?  */
+	bool		recv_armed;	/* io_uring: multishot recv active?   */
+	bool		persistent;	/* Many files on this connection?     */
+	bool		ranges;		/* Byte range headers allowed?        */
+	bool		resume;		/* Resume headers allowed?            */
+	bool		resumable;	/* Is the file marked for resuming?   */
+	int		cli_fd;		/* Client file descriptor             */
+	size_t		recv_s;		/* How many active bytes in packet?   */
+	uint32_t	arr_idx;	/* Index in the channel array         */
+	char		src_ip[IPV4_L];	/* Formatted on first use, or ""      */
+	struct sockaddr_in src_addr;	/* Peer, sin_family 0 if unknown      */
+	uint32_t	io_inflight;	/* io_uring: pending write requests   */
+	uint64_t	recv_file_len;	/* Received file bytes                */
+	uint64_t	write_off;	/* io_uring: bytes queued for writing */
+	uint64_t	file_size;	/* File size, or end of the range     */
+	uint64_t	file_off;	/* Start of the range, or 0           */
+	struct xfer	*xfer;		/* Multi-stream transfer, or NULL     */
+	char		file_name[256];	/* File name                          */
+	FILE		*handle;	/* File handle                        */
+	int		pipe_fd[2];	/* Splice pipe, -1 if none yet        */
+	bool		splicing;	/* Is the content going through it?   */
+	size_t		pipe_size;	/* Capacity of the splice pipe        */
+	bool		no_splice;	/* Did splice() fail on this channel? */
+	union uni_pkt	*pktbuf;	/* Packet buffer, NULL if idle        */
+	uint64_t	wr_bytes;	/* Writer pool: bytes being written   */
+	bool		rx_paused;	/* Writer pool: over budget?          */
+	struct tw_timer	timer;		/* Timeout timer                      */
+	uint64_t	accept_tick;	/* Tick the connection was accepted   */
+	uint64_t	header_tick;	/* Tick it started waiting for header */
+	uint64_t	active_tick;	/* Tick of the last received bytes    */
+	uint64_t	win_tick;	/* Start of the throughput window     */
+	uint64_t	win_bytes;	/* rx_bytes at win_tick               */
+	uint64_t	rx_bytes;	/* Received bytes, header included    */
+	uint64_t	file_start_us;	/* When the file header arrived       */
+	uint8_t		buf_class;	/* Receive buffer pool index          */
+	uint8_t		full_recvs;	/* recv()s in a row that filled it    */
+	uint8_t		sched_class;	/* Index in cfg->classes              */
+	uint32_t	deficit;	/* DRR bytes left to receive          */
+};
+
+/*
+ * Scheduling class, the peers in net/mask.
+ */
+struct sched_class {
+	char		name[24];	/* "<addr>/<bits>" or "default"       */
+	uint32_t	net;		/* Host byte order                    */
+	uint32_t	mask;
+	uint32_t	weight;		/* Quanta per round                   */
+};
+
+/*
+ * Server options, shared by all shards.
+ */
+struct server_cfg {
+	const char		*bind_addr;	/* Bind address               */
+	uint16_t		bind_port;	/* Bind port                  */
+	enum server_engine	engine;		/* Selected event engine      */
+	bool			use_splice;	/* Splice file content?       */
+	bool			pin_cpu;	/* Pin each worker to a CPU?  */
+	bool			huge_pages;	/* Huge page receive buffers? */
+	bool			preallocate;	/* fallocate() the file size? */
+	enum server_durability	durability;	/* When is a file "received"? */
+	uint32_t		sync_interval;	/* Group commit, milliseconds */
+	uint32_t		sync_batch;	/* Group commit, files        */
+	uint32_t		nr_writers;	/* Disk writers, 0 for inline */
+	uint32_t		writer_budget;	/* Queued bytes per channel   */
+	uint32_t		nr_workers;	/* How many shards?           */
+	uint32_t		max_clients;	/* Channel capacity per shard */
+	uint32_t		backlog;	/* listen() backlog           */
+	uint32_t		header_timeout;	/* Seconds, 0 to disable      */
+	uint32_t		idle_timeout;	/* Seconds, 0 to disable      */
+	uint32_t		min_rate;	/* Bytes/s, 0 to disable      */
+	uint32_t		rate_window;	/* Seconds                    */
+	uint32_t		busy_poll;	/* Spin usec, 0 to disable    */
+	uint32_t		recv_buf_size;	/* Initial receive buffer     */
+	uint32_t		recv_buf_max;	/* Auto grow up to this       */
+	uint32_t		sock_rcvbuf;	/* SO_RCVBUF, 0 to autotune   */
+	const char		*congestion;	/* TCP_CONGESTION, or NULL    */
+	const char		*stats_socket;	/* Unix socket, NULL if off   */
+	const char		*storage_path;	/* Path to save uploaded files*/
+	uint32_t		quantum;	/* DRR bytes per round, 0 off */
+	uint32_t		nr_classes;
+	struct sched_class	classes[SCHED_MAX_CLASSES];
+};
+
+/*
+ * Log-linear histogram, HIST_SUB buckets for every power
+ * of two, values below HIST_SUB have a bucket each.
+ */
+struct hist {
+	uint64_t		counts[HIST_BUCKETS];
+};
+
+/*
+ * Per-shard counters, only written by the shard that
+ * owns them (files_done and file_time_us are also written
+ * by the syncer). The stats socket reads them while the
+ * shards are running.
+ */
+struct server_stats {
+	uint64_t		accepted;	/* Accepted connections       */
+	uint64_t		rejected;	/* Rejected, channel is full  */
+	uint64_t		closed;		/* Released channels          */
+	uint64_t		files_done;	/* Completely received files  */
+	uint64_t		bytes_in;	/* Received file bytes        */
+	uint64_t		rx_bytes;	/* Received bytes, live       */
+	uint64_t		timeouts;	/* Evicted by a timeout       */
+	uint64_t		recv_calls;	/* recv()/splice() with data  */
+	uint64_t		write_calls;	/* File write requests        */
+	struct hist		file_time_us;	/* Header to durable, usec    */
+	struct hist		recv_size;	/* Bytes per recv             */
+	uint64_t		class_bytes[SCHED_MAX_CLASSES];
+};
+
+/*
+ * One channel in a stats snapshot.
+ */
+struct chan_snap {
+	uint32_t		worker;
+	bool			has_file;	/* Header received?           */
+	bool			paused;		/* Writer pool backpressure   */
+	uint32_t		inflight;	/* Pending disk writes        */
+	uint64_t		age_ms;		/* Since accept               */
+	uint64_t		idle_ms;	/* Since the last recv        */
+	uint64_t		rx_bytes;
+	uint64_t		file_len;	/* Written file bytes         */
+	uint64_t		file_size;
+	uint32_t		buf_size;	/* Receive buffer             */
+	uint8_t			sched_class;
+	char			peer[IPV4_L + sizeof(":65535")];
+	char			file_name[256];
+};
+
+struct uring_ctx;
+struct wr_pair;
+struct epoll_event;
+
+/*
+ * One shard per worker thread. Each shard has its own
+ * listening socket (SO_REUSEPORT), event engine and
+ * channel array.
+ */
+struct server_state {
+	volatile bool		stop_el;	/* Stop the event loop?       */
+	uint32_t		worker_id;	/* Shard index                */
+	int			cpu;		/* Pinned CPU, -1 if none     */
+	pthread_t		thread;		/* Worker thread              */
+	bool			has_thread;	/* Is the thread running?     */
+	int			ret;		/* Event loop return value    */
+	const struct server_cfg	*cfg;		/* Server options             */
+	int			tcp_fd;		/* Main TCP file descriptor   */
+	int			epoll_fd;	/* Epoll file descriptor      */
+	int			wake_fd;	/* eventfd, kicks epoll_wait  */
+	struct epoll_event	*events;	/* EPOLL_BATCH_MAX long       */
+	uint32_t		batch;		/* Current maxevents          */
+	struct uring_ctx	*uring;		/* io_uring engine context    */
+	struct client_channel	**chan_slabs;	/* Channel slabs              */
+	uint32_t		nr_chans;	/* Allocated channels         */
+	uint32_t		*free_slots;	/* Stack of unused channels   */
+	uint32_t		nr_free;	/* Top of free_slots          */
+	uint32_t		*epoll_map;	/* Mapping for O(1) retrieval */
+	uint32_t		epoll_map_size;	/* Sized from RLIMIT_NOFILE   */
+	uint32_t		av_client;	/* How many unused array slot?*/
+	struct buf_pool		buf_pools[BUF_POOL_CLASSES];
+	uint32_t		nr_buf_pools;	/* Receive buffer sizes       */
+	struct server_stats	stats;		/* Shard counters             */
+	struct timer_wheel	timers;		/* Channel timeouts           */
+	struct wr_pair		*wr_pairs;	/* One per disk writer        */
+	int			wr_event_fd;	/* Writer completions         */
+	uint32_t		snap_req;	/* Stats thread: wants a snap */
+	uint32_t		snap_ack;	/* Last snap_req answered     */
+	struct chan_snap	*snaps;		/* The answer, nr_snaps long  */
+	uint32_t		nr_snaps;
+};
+
+
+static inline struct client_channel *get_channel(struct server_state *state,
+						 uint32_t idx)
+{
+	return &state->chan_slabs[idx >> CHAN_SLAB_SHIFT]
+				 [idx & (CHAN_SLAB_SIZE - 1u)];
+}
+
+
+static inline const char *chan_file_name(const struct client_channel *chan)
+{
+	return chan->got_file_info ? chan->file_name : "";
+}
+
+
+static inline uint32_t chan_buf_size(const struct server_state *state,
+				     const struct client_channel *chan)
+{
+	return state->buf_pools[chan->buf_class].buf_size;
+}
+
+
+/*
+ * Counters with a single writer. A relaxed load and store
+ * compile to a plain add, but the stats thread can still
+ * read them without tearing.
+ */
+static inline void stat_add(uint64_t *cnt, uint64_t val)
+{
+	__atomic_store_n(cnt, __atomic_load_n(cnt, __ATOMIC_RELAXED) + val,
+			 __ATOMIC_RELAXED);
+}
+
+
+static inline uint32_t hist_index(uint64_t val)
+{
+	uint32_t msb;
+
+	if (val < HIST_SUB)
+		return (uint32_t)val;
+
+	msb = 63u - (uint32_t)__builtin_clzll(val);
+	return (msb - HIST_SUB_BITS + 1u) * HIST_SUB +
+	       (uint32_t)((val >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1u));
+}
+
+
+static inline void hist_record(struct hist *hist, uint64_t val)
+{
+	stat_add(&hist->counts[hist_index(val)], 1);
+}
+
+
+/*
+ * The wheel clock is only read once per event loop
+ * iteration, this is cheap enough for every recv().
+ */
+static inline void note_channel_rx(struct server_state *state,
+				   struct client_channel *chan, size_t len)
+{
+	chan->active_tick = state->timers.now;
+	chan->rx_bytes   += len;
+	stat_add(&state->stats.recv_calls, 1);
+	stat_add(&state->stats.rx_bytes, len);
+	stat_add(&state->stats.class_bytes[chan->sched_class], len);
+	hist_record(&state->stats.recv_size, len);
+}
+
+
+/*
+ * server.c
+ */
+int assign_channel(struct server_state *state, int cli_fd,
+		   struct sockaddr_in *addr, struct client_channel **chan_p);
+bool validate_file_name(const char *file_name);
+int handle_file_info(struct server_state *state, struct client_channel *chan,
+		     size_t recv_s);
+int handle_client_data(struct server_state *state, struct client_channel *chan,
+		       size_t recv_s);
+void release_channel(struct server_state *state, struct client_channel *chan);
+int attach_channel_buf(struct server_state *state, struct client_channel *chan);
+void detach_channel_buf(struct server_state *state,
+			struct client_channel *chan);
+void run_channel_timers(struct server_state *state);
+void complete_channel_write(struct server_state *state,
+			    struct client_channel *chan, uint32_t len, int err);
+const char *chan_src_ip(struct client_channel *chan);
+uint16_t chan_src_port(struct client_channel *chan);
+void wake_shard(struct server_state *state);
+
+
+/*
+ * timer_wheel.c
+ */
+static inline bool tw_pending(const struct tw_timer *timer)
+{
+	return timer->pprev != NULL;
+}
+
+void tw_init(struct timer_wheel *wheel, uint64_t now);
+void tw_add(struct timer_wheel *wheel, struct tw_timer *timer,
+	    uint64_t expires);
+void tw_del(struct timer_wheel *wheel, struct tw_timer *timer);
+void tw_advance(struct timer_wheel *wheel, uint64_t now,
+		void (*expire)(struct tw_timer *timer, void *arg), void *arg);
+
+
+/*
+ * xfer.c
+ */
+int xfer_get(struct xfer **out, uint64_t id, const char *path,
+	     uint64_t file_size, bool *created);
+bool xfer_range_done(struct xfer *x, uint64_t len);
+uint64_t xfer_file_size(const struct xfer *x);
+void xfer_put(struct xfer *x);
+void xfer_destroy(void);
+
+
+/*
+ * sched.c
+ */
+void sched_init_cfg(struct server_cfg *cfg);
+void sched_fix_quantum(struct server_cfg *cfg);
+int sched_add_class(struct server_cfg *cfg, const char *val);
+uint8_t sched_classify(const struct server_cfg *cfg,
+		       const struct sockaddr_in *addr);
+
+
+/*
+ * syncer.c
+ */
+int syncer_start(const struct server_cfg *cfg);
+void syncer_stop(void);
+void mark_file_complete(struct server_state *state,
+			struct client_channel *chan);
+
+
+/*
+ * writer.c
+ */
+int pwrite_full(int fd, const char *buf, size_t len, uint64_t off);
+int writer_submit(struct server_state *state, struct client_channel *chan,
+		  union uni_pkt *buf, uint32_t len, uint64_t off);
+void writer_reap(struct server_state *state);
+int writer_init_shard(struct server_state *state);
+void writer_destroy_shard(struct server_state *state);
+int writer_start(struct server_state *shards, uint32_t nr_shards,
+		 const struct server_cfg *cfg);
+void writer_stop(void);
+
+
+/*
+ * stats.c
+ */
+uint64_t stats_now_us(void);
+void stats_snap_shard(struct server_state *state);
+int stats_start(struct server_state *shards, uint32_t nr_shards,
+		const struct server_cfg *cfg);
+void stats_stop(void);
+
+/*
+ * Answers a pending snapshot request of the stats thread,
+ * checked once per event loop iteration.
+ */
+static inline void stats_poll(struct server_state *state)
+{
+	if (__atomic_load_n(&state->snap_req, __ATOMIC_ACQUIRE) !=
+	    state->snap_ack)
+		stats_snap_shard(state);
+}
+
+
+/*
+ * buf_pool.c
+ */
+int buf_pool_init(struct buf_pool *pool, uint32_t max_bufs, uint32_t buf_size,
+		  bool huge_pages);
+union uni_pkt *buf_pool_get(struct buf_pool *pool);
+void buf_pool_put(struct buf_pool *pool, union uni_pkt *buf);
+void buf_pool_destroy(struct buf_pool *pool);
+
+
+/*
+ * server_uring.c
+ */
+int init_uring(struct server_state *state);
+int run_uring_event_loop(struct server_state *state);
+void destroy_uring(struct server_state *state);
+void uring_close_channel(struct server_state *state,
+			 struct client_channel *chan);
+
+
+#endif
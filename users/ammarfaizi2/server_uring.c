@@ -0,0 +1,911 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer server (io_uring engine)
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef _DEFAULT_SOURCE
+#  define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "server.h"
+
+
+#define URING_SQ_ENTRIES	(256u)
+#define URING_CQ_ENTRIES	(4096u)
+#define URING_NR_BUFS		(1024u)	/* Must be a power of 2 */
+#define URING_BUF_MEM		(URING_NR_BUFS * RECV_BUFFER_SIZE)
+#define URING_BGID		(0u)
+#define URING_DRAIN_STALLS	(50u)	/* 50 x 100 ms without progress */
+
+/*
+ * user_data layout:
+ *   [63..56] operation
+ *   [55..32] provided buffer ID (write only)
+ *   [31..0]  channel index
+ */
+#define UD_ACCEPT		(1u)
+#define UD_RECV			(2u)
+#define UD_WRITE		(3u)
+#define UD_CANCEL		(4u)
+
+#define UD_MAKE(OP, BID, IDX)	(((uint64_t)(OP) << 56u) |		\
+				 ((uint64_t)(BID) << 32u) |		\
+				 (uint64_t)(IDX))
+#define UD_OP(UD)		((uint32_t)((UD) >> 56u))
+#define UD_BID(UD)		((uint16_t)((UD) >> 32u))
+#define UD_IDX(UD)		((uint32_t)(UD))
+
+
+struct uring_sq {
+	unsigned		*khead;
+	unsigned		*ktail;
+	unsigned		*array;
+	unsigned		mask;
+	unsigned		entries;
+	unsigned		sqe_head;	/* Consumed by the kernel     */
+	unsigned		sqe_tail;	/* Prepared by us             */
+	struct io_uring_sqe	*sqes;
+};
+
+struct uring_cq {
+	unsigned		*khead;
+	unsigned		*ktail;
+	unsigned		mask;
+	struct io_uring_cqe	*cqes;
+};
+
+/*
+ * Pending write of a provided buffer.
+ */
+struct uring_buf_md {
+	uint32_t	pos;		/* Offset of pending bytes in buffer  */
+	uint32_t	len;		/* How many bytes are still pending?  */
+	uint64_t	off;		/* File offset of the pending bytes   */
+};
+
+struct uring_ctx {
+	int			ring_fd;	/* io_uring file descriptor   */
+	void			*ring_ptr;	/* SQ and CQ ring mapping     */
+	size_t			ring_sz;
+	struct io_uring_sqe	*sqes;		/* SQE array mapping          */
+	size_t			sqes_sz;
+	struct uring_sq		sq;
+	struct uring_cq		cq;
+	struct io_uring_buf_ring *br;		/* Provided buffer ring       */
+	size_t			br_sz;
+	uint16_t		br_tail;	/* Local copy of br->tail     */
+	char			*bufs;		/* Provided buffer memory     */
+	size_t			bufs_sz;
+	uint32_t		buf_size;	/* Bytes per provided buffer  */
+	uint32_t		nr_bufs;	/* Power of 2                 */
+	bool			accept_armed;	/* Multishot accept active?   */
+	bool			bufs_returned;	/* Recycled since last reap?  */
+	uint32_t		nr_starved;	/* Channels hit -ENOBUFS      */
+	uint32_t		*starved;	/* Stack of starved channels  */
+	struct uring_buf_md	md[URING_NR_BUFS];
+};
+
+
+static inline int sys_io_uring_setup(unsigned entries,
+				     struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static inline int sys_io_uring_enter(int fd, unsigned to_submit,
+				     unsigned min_complete, unsigned flags,
+				     void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, arg, argsz);
+}
+
+
+static inline int sys_io_uring_register(int fd, unsigned opcode,
+					const void *arg, unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+static inline char *uring_buf_addr(struct uring_ctx *ctx, uint16_t bid)
+{
+	return ctx->bufs + (size_t)bid * ctx->buf_size;
+}
+
+
+static void uring_buf_recycle(struct uring_ctx *ctx, uint16_t bid)
+{
+	struct io_uring_buf *buf;
+
+	/*
+	 * Don't touch buf->resv, the ring tail lives there
+	 * for the first entry.
+	 */
+	buf = &ctx->br->bufs[ctx->br_tail & (ctx->nr_bufs - 1u)];
+	buf->addr = (uint64_t)(uintptr_t)uring_buf_addr(ctx, bid);
+	buf->len  = ctx->buf_size;
+	buf->bid  = bid;
+	ctx->br_tail++;
+	__atomic_store_n(&ctx->br->tail, ctx->br_tail, __ATOMIC_RELEASE);
+	ctx->bufs_returned = true;
+}
+
+
+static int uring_submit_and_wait(struct uring_ctx *ctx, unsigned min_complete,
+				 unsigned timeout_ms)
+{
+	int err;
+	int ret;
+	void *argp = NULL;
+	size_t argsz = 0;
+	unsigned flags = 0;
+	unsigned to_submit;
+	struct uring_sq *sq = &ctx->sq;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+
+	__atomic_store_n(sq->ktail, sq->sqe_tail, __ATOMIC_RELEASE);
+	to_submit = sq->sqe_tail - sq->sqe_head;
+
+	if (min_complete) {
+		memset(&arg, 0, sizeof(arg));
+		ts.tv_sec  = timeout_ms / 1000u;
+		ts.tv_nsec = (timeout_ms % 1000u) * 1000000ll;
+		arg.ts     = (uint64_t)(uintptr_t)&ts;
+		argp       = &arg;
+		argsz      = sizeof(arg);
+		flags      = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+	}
+
+	ret = sys_io_uring_enter(ctx->ring_fd, to_submit, min_complete, flags,
+				 argp, argsz);
+	err = errno;
+	sq->sqe_head = __atomic_load_n(sq->khead, __ATOMIC_ACQUIRE);
+	return (ret < 0) ? -err : ret;
+}
+
+
+static struct io_uring_sqe *uring_get_sqe(struct uring_ctx *ctx)
+{
+	int ret;
+	struct uring_sq *sq = &ctx->sq;
+	struct io_uring_sqe *sqe;
+
+	if (sq->sqe_tail - sq->sqe_head >= sq->entries) {
+		/*
+		 * The SQ ring is full, flush it to the kernel
+		 * without waiting for completions.
+		 */
+		ret = uring_submit_and_wait(ctx, 0, 0);
+		if (ret < 0 || sq->sqe_tail - sq->sqe_head >= sq->entries) {
+			pr_err("io_uring SQ ring is full\n");
+			return NULL;
+		}
+	}
+
+	sqe = &sq->sqes[sq->sqe_tail & sq->mask];
+	sq->sqe_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+
+static int uring_set_file(struct uring_ctx *ctx, uint32_t slot, int fd)
+{
+	int err;
+	struct io_uring_files_update up;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds    = (uint64_t)(uintptr_t)&fd;
+	if (sys_io_uring_register(ctx->ring_fd, IORING_REGISTER_FILES_UPDATE,
+				  &up, 1) < 0) {
+		err = errno;
+		pr_err("io_uring_register(FILES_UPDATE): %s\n",
+		       strerror(err));
+		return -err;
+	}
+	return 0;
+}
+
+
+static int uring_arm_accept(struct server_state *state)
+{
+	struct uring_ctx *ctx = state->uring;
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ctx);
+	if (sqe == NULL)
+		return -EBUSY;
+
+	sqe->opcode       = IORING_OP_ACCEPT;
+	sqe->fd           = state->tcp_fd;
+	sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data    = UD_MAKE(UD_ACCEPT, 0, 0);
+	ctx->accept_armed = true;
+	return 0;
+}
+
+
+static int uring_arm_recv(struct server_state *state,
+			  struct client_channel *chan)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(state->uring);
+	if (sqe == NULL)
+		return -EBUSY;
+
+	sqe->opcode    = IORING_OP_RECV;
+	sqe->fd        = chan->cli_fd;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->flags     = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = UD_MAKE(UD_RECV, 0, chan->arr_idx);
+	chan->recv_armed = true;
+	return 0;
+}
+
+
+static int uring_cancel(struct uring_ctx *ctx, uint64_t target,
+			uint32_t idx)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ctx);
+	if (sqe == NULL)
+		return -EBUSY;
+
+	sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+	sqe->fd        = -1;
+	sqe->addr      = target;
+	sqe->user_data = UD_MAKE(UD_CANCEL, 0, idx);
+	return 0;
+}
+
+
+static int uring_submit_write(struct server_state *state,
+			      struct client_channel *chan, uint16_t bid)
+{
+	struct uring_ctx *ctx = state->uring;
+	struct uring_buf_md *md = &ctx->md[bid];
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ctx);
+	if (sqe == NULL)
+		return -EBUSY;
+
+	/*
+	 * The output file is registered as a fixed file at
+	 * the slot that matches the channel index.
+	 */
+	sqe->opcode    = IORING_OP_WRITE;
+	sqe->fd        = chan->arr_idx;
+	sqe->flags     = IOSQE_FIXED_FILE;
+	sqe->addr      = (uint64_t)(uintptr_t)(uring_buf_addr(ctx, bid) + md->pos);
+	sqe->len       = md->len;
+	sqe->off       = md->off;
+	sqe->user_data = UD_MAKE(UD_WRITE, bid, chan->arr_idx);
+	chan->io_inflight++;
+	stat_add(&state->stats.write_calls, 1);
+	return 0;
+}
+
+
+static void uring_maybe_release(struct server_state *state,
+				struct client_channel *chan)
+{
+	if (!chan->is_closing || chan->recv_armed || chan->io_inflight)
+		return;
+
+	if (chan->handle != NULL)
+		uring_set_file(state->uring, chan->arr_idx, -1);
+
+	release_channel(state, chan);
+}
+
+
+void uring_close_channel(struct server_state *state,
+			 struct client_channel *chan)
+{
+	if (!chan->is_closing) {
+		chan->is_closing = true;
+		if (chan->recv_armed)
+			uring_cancel(state->uring,
+				     UD_MAKE(UD_RECV, 0, chan->arr_idx),
+				     chan->arr_idx);
+	}
+
+	uring_maybe_release(state, chan);
+}
+
+
+static int uring_consume(struct server_state *state,
+			 struct client_channel *chan, uint16_t bid,
+			 uint32_t len)
+{
+	int ret;
+	size_t need;
+	uint32_t pos = 0;
+	struct uring_ctx *ctx = state->uring;
+	char *buf = uring_buf_addr(ctx, bid);
+
+again:
+	if (!chan->got_file_info) {
+		/*
+		 * Only copy the packet header to the channel buffer,
+		 * the file content is written straight from the
+		 * provided buffer.
+		 */
+		ret = attach_channel_buf(state, chan);
+		if (ret) {
+			uring_buf_recycle(ctx, bid);
+			return ret;
+		}
+
+		need = sizeof(packet_t) - chan->recv_s;
+		if (len - pos < need)
+			need = len - pos;
+		memcpy(chan->pktbuf->raw_buf + chan->recv_s, buf + pos, need);
+		chan->recv_s += need;
+		pos += (uint32_t)need;
+
+		if (chan->recv_s < sizeof(packet_t)) {
+			uring_buf_recycle(ctx, bid);
+			return 0;
+		}
+
+		ret = handle_file_info(state, chan, chan->recv_s);
+		chan->recv_s = 0;
+		detach_channel_buf(state, chan);
+		if (!ret && chan->handle != NULL)
+			ret = uring_set_file(ctx, chan->arr_idx,
+					     fileno(chan->handle));
+		if (ret) {
+			uring_buf_recycle(ctx, bid);
+			return ret;
+		}
+
+		/*
+		 * A control packet, a file header may follow.
+		 */
+		if (!chan->got_file_info && pos < len)
+			goto again;
+	}
+
+	len -= pos;
+	if (len == 0) {
+		uring_buf_recycle(ctx, bid);
+		return 0;
+	}
+
+	if (chan->handle == NULL || len > chan->file_size - chan->write_off) {
+		pr_err("Client " PRWIU " sends invalid packet\n",
+		       W_IU(chan));
+		uring_buf_recycle(ctx, bid);
+		return -EINVAL;
+	}
+
+	ctx->md[bid].pos = pos;
+	ctx->md[bid].len = len;
+	ctx->md[bid].off = chan->write_off;
+	chan->write_off += len;
+	ret = uring_submit_write(state, chan, bid);
+	if (ret)
+		uring_buf_recycle(ctx, bid);
+	return ret;
+}
+
+
+static void uring_handle_accept(struct server_state *state,
+				struct io_uring_cqe *cqe)
+{
+	int ret;
+	int cli_fd = cqe->res;
+	struct client_channel *chan;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		state->uring->accept_armed = false;
+		if (!state->stop_el)
+			uring_arm_accept(state);
+	}
+
+	if (cli_fd < 0) {
+		if (cli_fd != -ECANCELED)
+			pr_err("accept(): %s\n", strerror(-cli_fd));
+		return;
+	}
+
+	if (state->stop_el) {
+		close(cli_fd);
+		return;
+	}
+
+	ret = assign_channel(state, cli_fd, NULL, &chan);
+	if (ret) {
+		close(cli_fd);
+		return;
+	}
+
+	ret = uring_arm_recv(state, chan);
+	if (ret) {
+		chan->is_closing = true;
+		uring_maybe_release(state, chan);
+	}
+}
+
+
+static void uring_handle_recv(struct server_state *state,
+			      struct io_uring_cqe *cqe)
+{
+	int ret;
+	uint16_t bid;
+	struct uring_ctx *ctx = state->uring;
+	struct client_channel *chan = get_channel(state, UD_IDX(cqe->user_data));
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		chan->recv_armed = false;
+
+	if (cqe->res == -ENOBUFS) {
+		/*
+		 * All provided buffers are waiting for their
+		 * writes to complete. Re-arm once some of them
+		 * are recycled.
+		 */
+		if (chan->is_closing || chan->recv_armed) {
+			uring_maybe_release(state, chan);
+			return;
+		}
+
+		if (ctx->nr_starved >= state->cfg->max_clients) {
+			uring_close_channel(state, chan);
+			return;
+		}
+
+		ctx->starved[ctx->nr_starved++] = chan->arr_idx;
+		return;
+	}
+
+	if (cqe->res <= 0) {
+		if (cqe->res < 0 && cqe->res != -ECANCELED)
+			pr_err("recv(): %s\n", strerror(-cqe->res));
+		uring_close_channel(state, chan);
+		return;
+	}
+
+	pr_dbg("recv() %d bytes from " PRWIU "\n", cqe->res, W_IU(chan));
+	note_channel_rx(state, chan, (uint32_t)cqe->res);
+	bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	ret = uring_consume(state, chan, bid, (uint32_t)cqe->res);
+	if (ret) {
+		uring_close_channel(state, chan);
+		return;
+	}
+
+	if (!chan->is_closing && chan->got_file_info && chan->file_size == 0) {
+		mark_file_complete(state, chan);
+		uring_close_channel(state, chan);
+		return;
+	}
+
+	uring_maybe_release(state, chan);
+}
+
+
+static void uring_handle_write(struct server_state *state,
+			       struct io_uring_cqe *cqe)
+{
+	uint16_t bid = UD_BID(cqe->user_data);
+	struct uring_ctx *ctx = state->uring;
+	struct uring_buf_md *md = &ctx->md[bid];
+	struct client_channel *chan = get_channel(state, UD_IDX(cqe->user_data));
+
+	chan->io_inflight--;
+	if (cqe->res <= 0) {
+		pr_err("write(): %s\n",
+		       strerror(cqe->res ? -cqe->res : EIO));
+		goto out_close;
+	}
+
+	md->pos += (uint32_t)cqe->res;
+	md->len -= (uint32_t)cqe->res;
+	md->off += (uint64_t)cqe->res;
+	chan->recv_file_len += (uint64_t)cqe->res;
+	if (md->len > 0) {
+		/*
+		 * Short write, submit the rest of the buffer.
+		 */
+		if (uring_submit_write(state, chan, bid))
+			goto out_close;
+		return;
+	}
+
+	uring_buf_recycle(ctx, bid);
+	if (chan->recv_file_len >= chan->file_size) {
+		mark_file_complete(state, chan);
+		uring_close_channel(state, chan);
+		return;
+	}
+
+	uring_maybe_release(state, chan);
+	return;
+
+out_close:
+	uring_buf_recycle(ctx, bid);
+	uring_close_channel(state, chan);
+}
+
+
+static void uring_rearm_starved(struct server_state *state)
+{
+	struct uring_ctx *ctx = state->uring;
+	struct client_channel *chan;
+
+	while (ctx->nr_starved > 0) {
+		chan = get_channel(state, ctx->starved[--ctx->nr_starved]);
+		if (!chan->is_used || chan->recv_armed)
+			continue;
+
+		if (chan->is_closing || uring_arm_recv(state, chan)) {
+			uring_close_channel(state, chan);
+			continue;
+		}
+	}
+}
+
+
+static void uring_reap(struct server_state *state)
+{
+	unsigned head, tail;
+	struct uring_ctx *ctx = state->uring;
+	struct uring_cq *cq = &ctx->cq;
+	struct io_uring_cqe *cqe;
+
+again:
+	head = *cq->khead;
+	tail = __atomic_load_n(cq->ktail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		goto out;
+
+	for (; head != tail; head++) {
+		cqe = &cq->cqes[head & cq->mask];
+		switch (UD_OP(cqe->user_data)) {
+		case UD_ACCEPT:
+			uring_handle_accept(state, cqe);
+			break;
+		case UD_RECV:
+			uring_handle_recv(state, cqe);
+			break;
+		case UD_WRITE:
+			uring_handle_write(state, cqe);
+			break;
+		case UD_CANCEL:
+			break;
+		default:
+			pr_crit("Unknown io_uring user_data: %llx\n",
+				(unsigned long long)cqe->user_data);
+			abort();
+		}
+	}
+	__atomic_store_n(cq->khead, head, __ATOMIC_RELEASE);
+	goto again;
+
+out:
+	if (ctx->bufs_returned && ctx->nr_starved > 0)
+		uring_rearm_starved(state);
+	ctx->bufs_returned = false;
+}
+
+
+static bool uring_is_busy(struct server_state *state)
+{
+	struct client_channel *chan;
+
+	if (state->uring->accept_armed)
+		return true;
+
+	for (uint32_t i = 0; i < state->nr_chans; i++) {
+		chan = get_channel(state, i);
+		if (chan->is_used && (chan->recv_armed || chan->io_inflight))
+			return true;
+	}
+	return false;
+}
+
+
+static void uring_drain(struct server_state *state)
+{
+	int ret;
+	unsigned stalls = 0;
+	struct uring_ctx *ctx = state->uring;
+	struct client_channel *chan;
+
+	/*
+	 * Stop accepting and receiving, but let the pending
+	 * writes land on the disk before we close the files.
+	 */
+	if (ctx->accept_armed)
+		uring_cancel(ctx, UD_MAKE(UD_ACCEPT, 0, 0), 0);
+
+	for (uint32_t i = 0; i < state->nr_chans; i++) {
+		chan = get_channel(state, i);
+		if (chan->is_used && !chan->is_closing)
+			uring_close_channel(state, chan);
+	}
+
+	while (stalls < URING_DRAIN_STALLS && uring_is_busy(state)) {
+		ret = uring_submit_and_wait(ctx, 1, 100);
+		if (ret == -ETIME) {
+			stalls++;
+			continue;
+		}
+
+		if (ret < 0 && ret != -EINTR && ret != -EAGAIN &&
+		    ret != -EBUSY) {
+			pr_err("io_uring_enter(): %s\n", strerror(-ret));
+			break;
+		}
+
+		stalls = 0;
+		uring_reap(state);
+	}
+}
+
+
+int run_uring_event_loop(struct server_state *state)
+{
+	int ret;
+	int err = 0;
+	struct uring_ctx *ctx = state->uring;
+
+	ret = uring_arm_accept(state);
+	if (ret)
+		return ret;
+
+	while (!state->stop_el) {
+		ret = uring_submit_and_wait(ctx, 1, 1000);
+		if (ret < 0) {
+			if (ret == -EINTR) {
+				pr_info("Interrupted!\n");
+				continue;
+			}
+
+			if (ret != -ETIME && ret != -EAGAIN && ret != -EBUSY) {
+				pr_err("io_uring_enter(): %s\n",
+				       strerror(-ret));
+				err = ret;
+				break;
+			}
+		}
+
+		uring_reap(state);
+		run_channel_timers(state);
+		stats_poll(state);
+	}
+
+	uring_drain(state);
+	return err;
+}
+
+
+static int init_uring_rings(struct uring_ctx *ctx, struct io_uring_params *p)
+{
+	int err;
+	size_t sq_sz, cq_sz;
+	char *ring;
+
+	if (!(p->features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p->features & IORING_FEAT_EXT_ARG)) {
+		pr_err("io_uring engine requires a newer kernel\n");
+		return -EOPNOTSUPP;
+	}
+
+	sq_sz = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	cq_sz = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	ctx->ring_sz = (sq_sz > cq_sz) ? sq_sz : cq_sz;
+
+	ring = mmap(NULL, ctx->ring_sz, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ctx->ring_fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED) {
+		err = errno;
+		pr_err("mmap(IORING_OFF_SQ_RING): %s\n", strerror(err));
+		return -err;
+	}
+	ctx->ring_ptr = ring;
+
+	ctx->sqes_sz = p->sq_entries * sizeof(struct io_uring_sqe);
+	ctx->sqes = mmap(NULL, ctx->sqes_sz, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+			 IORING_OFF_SQES);
+	if (ctx->sqes == MAP_FAILED) {
+		err = errno;
+		ctx->sqes = NULL;
+		pr_err("mmap(IORING_OFF_SQES): %s\n", strerror(err));
+		return -err;
+	}
+
+	ctx->sq.khead   = (unsigned *)(ring + p->sq_off.head);
+	ctx->sq.ktail   = (unsigned *)(ring + p->sq_off.tail);
+	ctx->sq.array   = (unsigned *)(ring + p->sq_off.array);
+	ctx->sq.mask    = *(unsigned *)(ring + p->sq_off.ring_mask);
+	ctx->sq.entries = *(unsigned *)(ring + p->sq_off.ring_entries);
+	ctx->sq.sqes    = ctx->sqes;
+	ctx->sq.sqe_head = *ctx->sq.khead;
+	ctx->sq.sqe_tail = *ctx->sq.ktail;
+
+	/*
+	 * Identity mapping, the SQE index is the array index.
+	 */
+	for (unsigned i = 0; i < ctx->sq.entries; i++)
+		ctx->sq.array[i] = i;
+
+	ctx->cq.khead = (unsigned *)(ring + p->cq_off.head);
+	ctx->cq.ktail = (unsigned *)(ring + p->cq_off.tail);
+	ctx->cq.mask  = *(unsigned *)(ring + p->cq_off.ring_mask);
+	ctx->cq.cqes  = (struct io_uring_cqe *)(ring + p->cq_off.cqes);
+	return 0;
+}
+
+
+static int init_uring_bufs(struct uring_ctx *ctx, uint32_t buf_size)
+{
+	int err;
+	struct io_uring_buf_reg reg;
+
+	/*
+	 * Bigger buffers, fewer of them. Both are powers of
+	 * two, so is the result.
+	 */
+	ctx->buf_size = buf_size;
+	ctx->nr_bufs  = URING_BUF_MEM / buf_size;
+	if (ctx->nr_bufs > URING_NR_BUFS)
+		ctx->nr_bufs = URING_NR_BUFS;
+
+	ctx->br_sz = ctx->nr_bufs * sizeof(struct io_uring_buf);
+	ctx->br = mmap(NULL, ctx->br_sz, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ctx->br == MAP_FAILED) {
+		err = errno;
+		ctx->br = NULL;
+		pr_err("mmap(): %s\n", strerror(err));
+		return -err;
+	}
+
+	ctx->bufs_sz = (size_t)ctx->nr_bufs * buf_size;
+	ctx->bufs = mmap(NULL, ctx->bufs_sz, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ctx->bufs == MAP_FAILED) {
+		err = errno;
+		ctx->bufs = NULL;
+		pr_err("mmap(): %s\n", strerror(err));
+		return -err;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr    = (uint64_t)(uintptr_t)ctx->br;
+	reg.ring_entries = ctx->nr_bufs;
+	reg.bgid         = URING_BGID;
+	if (sys_io_uring_register(ctx->ring_fd, IORING_REGISTER_PBUF_RING,
+				  &reg, 1) < 0) {
+		err = errno;
+		pr_err("io_uring_register(PBUF_RING): %s\n",
+		       strerror(err));
+		return -err;
+	}
+
+	for (uint32_t i = 0; i < ctx->nr_bufs; i++)
+		uring_buf_recycle(ctx, (uint16_t)i);
+
+	ctx->bufs_returned = false;
+	return 0;
+}
+
+
+static int init_uring_files(struct uring_ctx *ctx, uint32_t nr)
+{
+	int err;
+	struct io_uring_rsrc_register reg;
+
+	/*
+	 * One fixed file slot per channel, all of them
+	 * are empty for now.
+	 */
+	memset(&reg, 0, sizeof(reg));
+	reg.nr    = nr;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+	if (sys_io_uring_register(ctx->ring_fd, IORING_REGISTER_FILES2, &reg,
+				  sizeof(reg)) < 0) {
+		err = errno;
+		pr_err("io_uring_register(FILES2): %s\n", strerror(err));
+		return -err;
+	}
+	return 0;
+}
+
+
+int init_uring(struct server_state *state)
+{
+	int err;
+	int ring_fd;
+	struct uring_ctx *ctx;
+	struct io_uring_params p;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		pr_err("calloc(): %s\n", strerror(ENOMEM));
+		return -ENOMEM;
+	}
+	ctx->ring_fd = -1;
+	state->uring = ctx;
+
+	ctx->starved = calloc(state->cfg->max_clients, sizeof(*ctx->starved));
+	if (ctx->starved == NULL) {
+		pr_err("calloc(): %s\n", strerror(ENOMEM));
+		return -ENOMEM;
+	}
+
+	memset(&p, 0, sizeof(p));
+	p.flags      = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+		       IORING_SETUP_COOP_TASKRUN;
+	p.cq_entries = URING_CQ_ENTRIES;
+
+	ring_fd = sys_io_uring_setup(URING_SQ_ENTRIES, &p);
+	if (ring_fd < 0) {
+		err = errno;
+		pr_err("io_uring_setup(): %s\n", strerror(err));
+		return -err;
+	}
+	ctx->ring_fd = ring_fd;
+
+	err = init_uring_rings(ctx, &p);
+	if (err)
+		return err;
+
+	err = init_uring_bufs(ctx, state->cfg->recv_buf_size);
+	if (err)
+		return err;
+
+	return init_uring_files(ctx, state->cfg->max_clients);
+}
+
+
+void destroy_uring(struct server_state *state)
+{
+	struct uring_ctx *ctx = state->uring;
+
+	if (ctx == NULL)
+		return;
+
+	if (ctx->ring_fd != -1) {
+		pr_info("Closing io_uring fd (%d)...\n", ctx->ring_fd);
+		close(ctx->ring_fd);
+	}
+
+	if (ctx->bufs)
+		munmap(ctx->bufs, ctx->bufs_sz);
+	if (ctx->br)
+		munmap(ctx->br, ctx->br_sz);
+	if (ctx->sqes)
+		munmap(ctx->sqes, ctx->sqes_sz);
+	if (ctx->ring_ptr)
+		munmap(ctx->ring_ptr, ctx->ring_sz);
+
+	free(ctx->starved);
+	free(ctx);
+	state->uring = NULL;
+}
@@ -0,0 +1,703 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer server (live stats)
+ *
+ * Every connection to the stats socket gets a plain text report
+ * and is closed. The counters live in the shards and are only
+ * merged here, the event loops never take a lock for them.
+ *
+ * The channel list is not read from here, a channel can be reset
+ * at any time by its shard. The shard copies its channels into a
+ * snapshot when asked to, on its next event loop iteration.
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <time.h>
+#include <poll.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "server.h"
+
+
+#define SNAP_TIMEOUT_MS		(2000u)
+#define STATS_SEND_TIMEOUT	(1u)		/* Seconds                */
+
+struct stats_srv {
+	struct server_state	*shards;
+	uint32_t		nr_shards;
+	const struct server_cfg	*cfg;
+	int			listen_fd;
+	int			stop_fd;	/* eventfd, wakes the thread  */
+	pthread_t		thread;
+	bool			has_thread;
+	bool			stop;
+	uint64_t		start_us;
+};
+
+static struct stats_srv g_stats = {
+	.listen_fd = -1,
+	.stop_fd   = -1,
+};
+
+
+uint64_t stats_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+
+static inline uint64_t load_cnt(const uint64_t *cnt)
+{
+	return __atomic_load_n(cnt, __ATOMIC_RELAXED);
+}
+
+
+static void fill_snap(struct server_state *state, struct client_channel *chan,
+		      struct chan_snap *snap)
+{
+	uint64_t now = state->timers.now;
+
+	snap->worker    = state->worker_id;
+	snap->has_file  = chan->got_file_info;
+	snap->paused    = chan->rx_paused;
+	snap->inflight  = chan->io_inflight;
+	snap->age_ms    = (now - chan->accept_tick) * TW_TICK_MS;
+	snap->idle_ms   = (now - chan->active_tick) * TW_TICK_MS;
+	snap->rx_bytes  = chan->rx_bytes;
+	snap->file_len  = chan->recv_file_len - chan->file_off;
+	snap->file_size = chan->file_size - chan->file_off;
+	snap->buf_size  = chan_buf_size(state, chan);
+	snap->sched_class = chan->sched_class;
+	snprintf(snap->peer, sizeof(snap->peer), PRWIU, W_IU(chan));
+	if (chan->got_file_info)
+		strcpy(snap->file_name, chan->file_name);
+	else
+		snap->file_name[0] = '\0';
+}
+
+
+/*
+ * Runs on the shard thread.
+ */
+void stats_snap_shard(struct server_state *state)
+{
+	uint32_t nr = 0;
+	uint32_t req = __atomic_load_n(&state->snap_req, __ATOMIC_ACQUIRE);
+	struct chan_snap *snaps;
+	struct client_channel *chan;
+	uint32_t max = state->cfg->max_clients - state->av_client;
+
+	snaps = max ? malloc(max * sizeof(*snaps)) : NULL;
+	if (snaps == NULL && max)
+		pr_err("malloc(): %s\n", strerror(ENOMEM));
+
+	for (uint32_t i = 0; snaps && i < state->nr_chans && nr < max; i++) {
+		chan = get_channel(state, i);
+		if (chan->is_used && !chan->is_closing)
+			fill_snap(state, chan, &snaps[nr++]);
+	}
+
+	state->snaps    = snaps;
+	state->nr_snaps = nr;
+	__atomic_store_n(&state->snap_ack, req, __ATOMIC_RELEASE);
+}
+
+
+static inline uint32_t snap_ack(struct server_state *state)
+{
+	return __atomic_load_n(&state->snap_ack, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Asks every shard for a snapshot of its channels. A shard that
+ * has not answered the previous request is skipped.
+ */
+static void request_snaps(bool *asked)
+{
+	struct server_state *state;
+
+	for (uint32_t i = 0; i < g_stats.nr_shards; i++) {
+		state = &g_stats.shards[i];
+		asked[i] = (snap_ack(state) == state->snap_req);
+		if (!asked[i])
+			continue;
+
+		free(state->snaps);
+		state->snaps    = NULL;
+		state->nr_snaps = 0;
+		__atomic_store_n(&state->snap_req, state->snap_req + 1u,
+				 __ATOMIC_RELEASE);
+		wake_shard(state);
+	}
+}
+
+
+static void wait_for_snaps(const bool *asked)
+{
+	bool done;
+	struct pollfd pfd;
+	struct server_state *state;
+	uint64_t deadline = stats_now_us() + SNAP_TIMEOUT_MS * 1000u;
+
+	pfd.fd     = g_stats.stop_fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		done = true;
+		for (uint32_t i = 0; i < g_stats.nr_shards; i++) {
+			state = &g_stats.shards[i];
+			if (asked[i] && snap_ack(state) != state->snap_req)
+				done = false;
+		}
+
+		if (done)
+			return;
+
+		if (stats_now_us() >= deadline || poll(&pfd, 1, 1) != 0)
+			return;
+	}
+}
+
+
+static uint64_t snap_rate(const struct chan_snap *snap)
+{
+	/*
+	 * Average bytes/s since accept, the tick clock is too
+	 * coarse for channels younger than one tick.
+	 */
+	if (snap->age_ms == 0)
+		return 0;
+	return snap->rx_bytes * 1000u / snap->age_ms;
+}
+
+
+static int cmp_snap_rate(const void *a, const void *b)
+{
+	uint64_t ra = snap_rate(a);
+	uint64_t rb = snap_rate(b);
+
+	return (ra > rb) - (ra < rb);
+}
+
+
+static const char *snap_state(const struct chan_snap *snap)
+{
+	if (!snap->has_file)
+		return "header";
+	if (snap->paused)
+		return "disk";
+	return "recv";
+}
+
+
+/*
+ * rate is the sum over the channels of the class that are
+ * open now, like the rate of each channel below.
+ */
+static void print_classes(FILE *out, const struct server_stats *total,
+			  const struct chan_snap *all, uint32_t nr)
+{
+	uint32_t nr_chans;
+	uint64_t rate;
+	const struct sched_class *cls;
+
+	for (uint32_t c = 0; c < g_stats.cfg->nr_classes; c++) {
+		cls = &g_stats.cfg->classes[c];
+		nr_chans = 0;
+		rate = 0;
+		for (uint32_t i = 0; i < nr; i++) {
+			if (all[i].sched_class != c)
+				continue;
+			nr_chans++;
+			rate += snap_rate(&all[i]);
+		}
+
+		fprintf(out, "class %s weight=%u rx_bytes=%" PRIu64
+			" channels=%u rate=%" PRIu64 "\n", cls->name,
+			cls->weight, total->class_bytes[c], nr_chans, rate);
+	}
+}
+
+
+static void print_channels(FILE *out, const bool *asked,
+			   const struct server_stats *total)
+{
+	uint32_t nr = 0;
+	struct chan_snap *all, *snap;
+	struct server_state *state;
+
+	for (uint32_t i = 0; i < g_stats.nr_shards; i++) {
+		state = &g_stats.shards[i];
+		if (!asked[i] || snap_ack(state) != state->snap_req) {
+			fprintf(out, "worker %u busy\n", i);
+			continue;
+		}
+		nr += state->nr_snaps;
+	}
+
+	all = malloc((nr ? nr : 1u) * sizeof(*all));
+	if (all == NULL) {
+		fprintf(out, "error %s\n", strerror(ENOMEM));
+		return;
+	}
+
+	nr = 0;
+	for (uint32_t i = 0; i < g_stats.nr_shards; i++) {
+		state = &g_stats.shards[i];
+		if (!asked[i] || snap_ack(state) != state->snap_req)
+			continue;
+		memcpy(&all[nr], state->snaps,
+		       state->nr_snaps * sizeof(*all));
+		nr += state->nr_snaps;
+	}
+
+	print_classes(out, total, all, nr);
+
+	/*
+	 * Slowest first, they are the ones we are looking for.
+	 */
+	qsort(all, nr, sizeof(*all), cmp_snap_rate);
+	fprintf(out, "channels %u\n", nr);
+	for (uint32_t i = 0; i < nr; i++) {
+		snap = &all[i];
+		fprintf(out, "  %s worker=%u class=%s state=%s rate=%" PRIu64
+			" rx_bytes=%" PRIu64 " file=\"%s\" progress=%" PRIu64
+			"/%" PRIu64 " age_ms=%" PRIu64 " idle_ms=%" PRIu64
+			" inflight=%u buf=%u\n", snap->peer, snap->worker,
+			g_stats.cfg->classes[snap->sched_class].name,
+			snap_state(snap), snap_rate(snap), snap->rx_bytes,
+			snap->file_name, snap->file_len, snap->file_size,
+			snap->age_ms, snap->idle_ms, snap->inflight,
+			snap->buf_size);
+	}
+	free(all);
+}
+
+
+static uint64_t hist_upper(uint32_t idx)
+{
+	uint32_t msb, shift;
+	uint64_t lower;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	msb   = idx / HIST_SUB + HIST_SUB_BITS - 1u;
+	shift = msb - HIST_SUB_BITS;
+	lower = (uint64_t)(HIST_SUB + idx % HIST_SUB) << shift;
+	return lower + ((1ull << shift) - 1u);
+}
+
+
+/*
+ * The percentiles are the upper bound of the bucket they fall
+ * into, at most 12.5% above the real value.
+ */
+static void print_hist(FILE *out, const char *name, const struct hist *hist)
+{
+	static const struct {
+		const char	*name;
+		uint64_t	per_mille;
+	} pct[] = {
+		{ "p50",  500 },
+		{ "p90",  900 },
+		{ "p99",  990 },
+		{ "p999", 999 },
+	};
+	uint32_t p = 0, max_idx = 0;
+	uint64_t count = 0, seen = 0, rank;
+
+	for (uint32_t i = 0; i < HIST_BUCKETS; i++) {
+		count += hist->counts[i];
+		if (hist->counts[i])
+			max_idx = i;
+	}
+
+	fprintf(out, "%s count=%" PRIu64, name, count);
+	for (uint32_t i = 0; count && i < HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		for (; p < sizeof(pct) / sizeof(pct[0]); p++) {
+			rank = (count * pct[p].per_mille + 999u) / 1000u;
+			if (seen < rank)
+				break;
+			fprintf(out, " %s=%" PRIu64, pct[p].name, hist_upper(i));
+		}
+	}
+	fprintf(out, " max=%" PRIu64 "\n", count ? hist_upper(max_idx) : 0);
+}
+
+
+static void sum_hist(struct hist *dst, const struct hist *src)
+{
+	for (uint32_t i = 0; i < HIST_BUCKETS; i++)
+		dst->counts[i] += load_cnt(&src->counts[i]);
+}
+
+
+static void sum_stats(struct server_stats *dst, const struct server_stats *src)
+{
+	dst->accepted    += load_cnt(&src->accepted);
+	dst->rejected    += load_cnt(&src->rejected);
+	dst->closed      += load_cnt(&src->closed);
+	dst->files_done  += load_cnt(&src->files_done);
+	dst->bytes_in    += load_cnt(&src->bytes_in);
+	dst->rx_bytes    += load_cnt(&src->rx_bytes);
+	dst->timeouts    += load_cnt(&src->timeouts);
+	dst->recv_calls  += load_cnt(&src->recv_calls);
+	dst->write_calls += load_cnt(&src->write_calls);
+	for (uint32_t c = 0; c < SCHED_MAX_CLASSES; c++)
+		dst->class_bytes[c] += load_cnt(&src->class_bytes[c]);
+}
+
+
+static void print_counters(FILE *out, const char *prefix,
+			   const struct server_stats *st)
+{
+	fprintf(out, "%saccepted %" PRIu64 "\n", prefix, st->accepted);
+	fprintf(out, "%srejected %" PRIu64 "\n", prefix, st->rejected);
+	fprintf(out, "%sactive %" PRIu64 "\n", prefix,
+		st->accepted - st->closed);
+	fprintf(out, "%stimeouts %" PRIu64 "\n", prefix, st->timeouts);
+	fprintf(out, "%sfiles_done %" PRIu64 "\n", prefix, st->files_done);
+	fprintf(out, "%sbytes_in %" PRIu64 "\n", prefix, st->bytes_in);
+	fprintf(out, "%srx_bytes %" PRIu64 "\n", prefix, st->rx_bytes);
+	fprintf(out, "%srecv_calls %" PRIu64 "\n", prefix, st->recv_calls);
+	fprintf(out, "%swrite_calls %" PRIu64 "\n", prefix, st->write_calls);
+}
+
+
+static void print_report(FILE *out)
+{
+	bool *asked;
+	char prefix[32];
+	struct server_stats *total, one;
+	const struct server_stats *st;
+
+	asked = calloc(g_stats.nr_shards, sizeof(*asked));
+	total = calloc(1, sizeof(*total));
+	if (asked == NULL || total == NULL) {
+		fprintf(out, "error %s\n", strerror(ENOMEM));
+		goto out;
+	}
+
+	request_snaps(asked);
+
+	/*
+	 * The counters are read while the shards answer.
+	 */
+	fprintf(out, "uptime_ms %" PRIu64 "\n",
+		(stats_now_us() - g_stats.start_us) / 1000u);
+	fprintf(out, "workers %u\n", g_stats.nr_shards);
+	for (uint32_t i = 0; i < g_stats.nr_shards; i++) {
+		st = &g_stats.shards[i].stats;
+		sum_stats(total, st);
+		sum_hist(&total->file_time_us, &st->file_time_us);
+		sum_hist(&total->recv_size, &st->recv_size);
+	}
+	print_counters(out, "", total);
+	fprintf(out, "log_dropped %" PRIu64 "\n", log_dropped());
+	print_hist(out, "file_time_us", &total->file_time_us);
+	print_hist(out, "recv_size", &total->recv_size);
+
+	for (uint32_t i = 0; g_stats.nr_shards > 1 && i < g_stats.nr_shards;
+	     i++) {
+		memset(&one, 0, sizeof(one));
+		sum_stats(&one, &g_stats.shards[i].stats);
+		snprintf(prefix, sizeof(prefix), "worker%u.", i);
+		print_counters(out, prefix, &one);
+	}
+
+	wait_for_snaps(asked);
+	print_channels(out, asked, total);
+out:
+	free(total);
+	free(asked);
+}
+
+
+static int send_full(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += ret;
+		len -= (size_t)ret;
+	}
+
+	return 0;
+}
+
+
+static void serve_stats_client(int fd)
+{
+	int ret;
+	FILE *out;
+	char *buf = NULL;
+	size_t len = 0;
+	struct timeval tv = { .tv_sec = STATS_SEND_TIMEOUT };
+
+	/*
+	 * Don't let a reader that never reads hold the thread.
+	 */
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	out = open_memstream(&buf, &len);
+	if (out == NULL) {
+		pr_err("open_memstream(): %s\n", strerror(errno));
+		return;
+	}
+
+	print_report(out);
+	fclose(out);
+
+	ret = send_full(fd, buf, len);
+	if (ret && ret != -EPIPE)
+		pr_err("send(stats): %s\n", strerror(-ret));
+	free(buf);
+}
+
+
+static void *run_stats_server(void *arg)
+{
+	int fd;
+	struct pollfd pfd[2];
+
+	pfd[0].fd     = g_stats.listen_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd     = g_stats.stop_fd;
+	pfd[1].events = POLLIN;
+	while (!__atomic_load_n(&g_stats.stop, __ATOMIC_ACQUIRE)) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_err("poll(stats): %s\n", strerror(errno));
+			break;
+		}
+
+		if (pfd[1].revents)
+			break;
+
+		fd = accept4(g_stats.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EINTR && errno != EAGAIN &&
+			    errno != ECONNABORTED)
+				pr_err("accept(stats): %s\n",
+				       strerror(errno));
+			continue;
+		}
+
+		serve_stats_client(fd);
+		close(fd);
+	}
+
+	return arg;
+}
+
+
+static int fill_unix_addr(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		pr_err("Stats socket path is too long: %s\n", path);
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+
+static int init_stats_socket(const char *path)
+{
+	int err;
+	int fd;
+	struct stat st;
+	struct sockaddr_un addr;
+
+	err = fill_unix_addr(path, &addr);
+	if (err)
+		return err;
+
+	/*
+	 * A stale socket of a previous run, but never
+	 * remove anything else.
+	 */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		err = errno;
+		pr_err("socket(AF_UNIX): %s\n", strerror(err));
+		return -err;
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		err = errno;
+		pr_err("bind(%s): %s\n", path, strerror(err));
+		goto out_close;
+	}
+
+	/*
+	 * The report has the address of every client.
+	 */
+	chmod(path, 0600);
+
+	if (listen(fd, 16) < 0) {
+		err = errno;
+		pr_err("listen(%s): %s\n", path, strerror(err));
+		unlink(path);
+		goto out_close;
+	}
+
+	g_stats.listen_fd = fd;
+	return 0;
+
+out_close:
+	close(fd);
+	return -err;
+}
+
+
+int stats_start(struct server_state *shards, uint32_t nr_shards,
+		const struct server_cfg *cfg)
+{
+	int ret;
+	sigset_t set, old;
+
+	g_stats.shards    = shards;
+	g_stats.nr_shards = nr_shards;
+	g_stats.cfg       = cfg;
+	g_stats.stop      = false;
+	g_stats.start_us  = stats_now_us();
+	if (cfg->stats_socket == NULL)
+		return 0;
+
+	ret = init_stats_socket(cfg->stats_socket);
+	if (ret)
+		return ret;
+
+	g_stats.stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (g_stats.stop_fd < 0) {
+		ret = errno;
+		pr_err("eventfd(): %s\n", strerror(ret));
+		return -ret;
+	}
+
+	/*
+	 * Signals are handled by the main thread.
+	 */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	ret = pthread_create(&g_stats.thread, NULL, run_stats_server, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		pr_err("pthread_create(): %s\n", strerror(ret));
+		return -ret;
+	}
+
+	g_stats.has_thread = true;
+	pr_info("Stats are served on %s\n", cfg->stats_socket);
+	return 0;
+}
+
+
+/*
+ * Must be called before the shards are destroyed.
+ */
+void stats_stop(void)
+{
+	uint64_t val = 1;
+
+	if (g_stats.has_thread) {
+		__atomic_store_n(&g_stats.stop, true, __ATOMIC_RELEASE);
+		if (write(g_stats.stop_fd, &val, sizeof(val)) < 0)
+			pr_err("write(eventfd): %s\n", strerror(errno));
+		pthread_join(g_stats.thread, NULL);
+		g_stats.has_thread = false;
+	}
+
+	if (g_stats.stop_fd != -1) {
+		close(g_stats.stop_fd);
+		g_stats.stop_fd = -1;
+	}
+
+	if (g_stats.listen_fd != -1) {
+		close(g_stats.listen_fd);
+		unlink(g_stats.cfg->stats_socket);
+		g_stats.listen_fd = -1;
+	}
+}
+
+
+/*
+ * ftransfer stats <socket_path>
+ */
+int run_stats(int argc, char *argv[])
+{
+	int fd;
+	int err = 0;
+	ssize_t ret;
+	char buf[4096];
+	struct sockaddr_un addr;
+
+	if (argc < 1) {
+		pr_err("Missing stats socket path\n");
+		print_help();
+		return EINVAL;
+	}
+
+	if (fill_unix_addr(argv[0], &addr))
+		return ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		err = errno;
+		pr_err("socket(AF_UNIX): %s\n", strerror(err));
+		return err;
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		err = errno;
+		pr_err("connect(%s): %s\n", argv[0], strerror(err));
+		goto out;
+	}
+
+	while ((ret = read(fd, buf, sizeof(buf))) != 0) {
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			pr_err("read(): %s\n", strerror(err));
+			break;
+		}
+		fwrite(buf, 1, (size_t)ret, stdout);
+	}
+out:
+	close(fd);
+	return err;
+}
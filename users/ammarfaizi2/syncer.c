@@ -0,0 +1,373 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer server (durability)
+ *
+ * A file is only reported as received completely once its data and
+ * its directory entry are on stable storage. In group commit mode
+ * the completed files are handed to a background syncer, which
+ * commits them in batches, every sync_interval ms or sync_batch
+ * files, whichever comes first.
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/xattr.h>
+
+#include "server.h"
+
+
+struct sync_entry {
+	int			fd;		/* dup() of the file handle   */
+	int			err;		/* Commit result              */
+	struct server_stats	*stats;		/* Owner shard counters       */
+	uint64_t		start_us;	/* When the header arrived    */
+	uint64_t		bytes;		/* File size                  */
+	char			peer[IPV4_L + sizeof(":65535")];
+	char			file_name[256];
+};
+
+struct syncer {
+	const struct server_cfg	*cfg;
+	int			dir_fd;		/* Storage directory          */
+	pthread_t		thread;
+	bool			has_thread;
+	bool			stop;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct sync_entry	*pending;	/* Waiting for the next batch */
+	uint32_t		nr_pending;
+	uint32_t		cap_pending;
+	struct timespec		first_at;	/* When pending[0] was queued */
+};
+
+static struct syncer g_syncer = {
+	.dir_fd = -1,
+	.lock   = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static void report_file_complete(struct sync_entry *ent)
+{
+	struct hist *hist = &ent->stats->file_time_us;
+	uint64_t us = stats_now_us() - ent->start_us;
+
+	pr_info("File received completely peer=%s file=\"%s\" bytes=%" PRIu64
+		"\n", ent->peer, ent->file_name, ent->bytes);
+
+	/*
+	 * Written by the syncer and, if it can't queue, by the
+	 * shard itself.
+	 */
+	__atomic_fetch_add(&ent->stats->files_done, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->counts[hist_index(us)], 1, __ATOMIC_RELAXED);
+}
+
+
+static int sync_storage_dir(void)
+{
+	int err;
+
+	/*
+	 * The directory entry of a new file is only durable
+	 * once the directory itself is synced.
+	 */
+	if (g_syncer.dir_fd == -1 || fsync(g_syncer.dir_fd) == 0)
+		return 0;
+
+	err = errno;
+	pr_err("fsync(%s): %s\n", g_syncer.cfg->storage_path,
+	       strerror(err));
+	return -err;
+}
+
+
+static int sync_file(int fd)
+{
+	int err;
+
+	if (fdatasync(fd) == 0)
+		return 0;
+
+	err = errno;
+	pr_err("fdatasync(): %s\n", strerror(err));
+	return -err;
+}
+
+
+static int syncer_queue(struct sync_entry *ent, int file_fd)
+{
+	int err;
+	uint32_t cap;
+	struct sync_entry *pending;
+
+	ent->fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0);
+	if (ent->fd < 0) {
+		err = errno;
+		pr_err("fcntl(F_DUPFD_CLOEXEC): %s\n", strerror(err));
+		return -err;
+	}
+
+	pthread_mutex_lock(&g_syncer.lock);
+	if (g_syncer.nr_pending == g_syncer.cap_pending) {
+		cap = g_syncer.cap_pending ? g_syncer.cap_pending * 2u : 64u;
+		pending = realloc(g_syncer.pending, cap * sizeof(*pending));
+		if (pending == NULL) {
+			pthread_mutex_unlock(&g_syncer.lock);
+			pr_err("realloc(): %s\n", strerror(ENOMEM));
+			close(ent->fd);
+			ent->fd = -1;
+			return -ENOMEM;
+		}
+		g_syncer.pending     = pending;
+		g_syncer.cap_pending = cap;
+	}
+
+	if (g_syncer.nr_pending == 0)
+		clock_gettime(CLOCK_MONOTONIC, &g_syncer.first_at);
+
+	g_syncer.pending[g_syncer.nr_pending++] = *ent;
+
+	/*
+	 * Wake the syncer to start the batch timer, or to
+	 * commit a full batch.
+	 */
+	if (g_syncer.nr_pending == 1 ||
+	    g_syncer.nr_pending >= g_syncer.cfg->sync_batch)
+		pthread_cond_signal(&g_syncer.cond);
+	pthread_mutex_unlock(&g_syncer.lock);
+	return 0;
+}
+
+
+/*
+ * Called from the event loop when the last byte of a file has
+ * been written.
+ */
+void mark_file_complete(struct server_state *state,
+			struct client_channel *chan)
+{
+	struct sync_entry ent;
+
+	/*
+	 * Only the last range of a multi-stream file commits
+	 * it, fdatasync() covers what the others wrote.
+	 */
+	if (chan->xfer != NULL &&
+	    !xfer_range_done(chan->xfer, chan->file_size - chan->file_off))
+		return;
+
+	/*
+	 * Nothing left to resume.
+	 */
+	if (chan->resumable &&
+	    fremovexattr(fileno(chan->handle), RESUME_XATTR) < 0)
+		pr_warn("fremovexattr(\"%s\"): %s\n", chan->file_name,
+			strerror(errno));
+
+	ent.fd       = -1;
+	ent.err      = 0;
+	ent.stats    = &state->stats;
+	ent.start_us = chan->file_start_us;
+	ent.bytes    = chan->xfer ? xfer_file_size(chan->xfer) : chan->file_size;
+	snprintf(ent.peer, sizeof(ent.peer), PRWIU, W_IU(chan));
+	strcpy(ent.file_name, chan->file_name);
+
+	switch (state->cfg->durability) {
+	case DURABILITY_GROUP:
+		if (!syncer_queue(&ent, fileno(chan->handle)))
+			return;
+
+		/*
+		 * Can't queue it, commit it right here.
+		 */
+		/* fallthrough */
+	case DURABILITY_FDATASYNC:
+		fflush(chan->handle);
+		if (sync_file(fileno(chan->handle)) || sync_storage_dir()) {
+			pr_err("Cannot commit file from %s\n", ent.peer);
+			return;
+		}
+		break;
+	case DURABILITY_NONE:
+		break;
+	}
+
+	report_file_complete(&ent);
+}
+
+
+static void commit_batch(struct sync_entry *batch, uint32_t nr)
+{
+	int ret = 0;
+
+	/*
+	 * One syncfs() commits the data and the directory
+	 * entries of the whole batch with a single journal
+	 * commit, about twice as fast as an fdatasync() per
+	 * file. Fall back to the per-file way if it fails.
+	 */
+	if (nr > 1 && syncfs(batch[0].fd) == 0)
+		goto out;
+
+	for (uint32_t i = 0; i < nr; i++)
+		batch[i].err = sync_file(batch[i].fd);
+
+	ret = sync_storage_dir();
+out:
+	for (uint32_t i = 0; i < nr; i++) {
+		if (ret || batch[i].err)
+			pr_err("Cannot commit file from %s\n",
+			       batch[i].peer);
+		else
+			report_file_complete(&batch[i]);
+		close(batch[i].fd);
+	}
+}
+
+
+static void wait_for_batch(void)
+{
+	struct timespec deadline;
+	uint32_t interval_ms = g_syncer.cfg->sync_interval;
+
+	while (!g_syncer.stop && g_syncer.nr_pending == 0)
+		pthread_cond_wait(&g_syncer.cond, &g_syncer.lock);
+
+	deadline = g_syncer.first_at;
+	deadline.tv_sec  += interval_ms / 1000u;
+	deadline.tv_nsec += (long)(interval_ms % 1000u) * 1000000l;
+	if (deadline.tv_nsec >= 1000000000l) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000l;
+	}
+
+	while (!g_syncer.stop &&
+	       g_syncer.nr_pending < g_syncer.cfg->sync_batch) {
+		if (pthread_cond_timedwait(&g_syncer.cond, &g_syncer.lock,
+					   &deadline) == ETIMEDOUT)
+			break;
+	}
+}
+
+
+static void *run_syncer(void *arg)
+{
+	uint32_t nr, cap = 0, tmp_cap;
+	struct sync_entry *batch = NULL, *tmp;
+
+	pthread_mutex_lock(&g_syncer.lock);
+	for (;;) {
+		wait_for_batch();
+		if (g_syncer.nr_pending == 0) {
+			if (g_syncer.stop)
+				break;
+			continue;
+		}
+
+		/*
+		 * Swap the queue out, the event loops can keep
+		 * queueing while this batch is committed.
+		 */
+		nr      = g_syncer.nr_pending;
+		tmp     = g_syncer.pending;
+		tmp_cap = g_syncer.cap_pending;
+		g_syncer.pending     = batch;
+		g_syncer.cap_pending = cap;
+		g_syncer.nr_pending  = 0;
+		batch = tmp;
+		cap   = tmp_cap;
+		pthread_mutex_unlock(&g_syncer.lock);
+
+		commit_batch(batch, nr);
+		pthread_mutex_lock(&g_syncer.lock);
+	}
+	pthread_mutex_unlock(&g_syncer.lock);
+
+	free(batch);
+	return arg;
+}
+
+
+int syncer_start(const struct server_cfg *cfg)
+{
+	int ret;
+	sigset_t set, old;
+	pthread_condattr_t attr;
+
+	g_syncer.cfg = cfg;
+	if (cfg->durability == DURABILITY_NONE)
+		return 0;
+
+	g_syncer.dir_fd = open(cfg->storage_path,
+			       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (g_syncer.dir_fd < 0) {
+		ret = errno;
+		pr_err("open(%s): %s\n", cfg->storage_path,
+		       strerror(ret));
+		return -ret;
+	}
+
+	if (cfg->durability != DURABILITY_GROUP)
+		return 0;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&g_syncer.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/*
+	 * Signals are handled by the main thread.
+	 */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	ret = pthread_create(&g_syncer.thread, NULL, run_syncer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		pr_err("pthread_create(): %s\n", strerror(ret));
+		pthread_cond_destroy(&g_syncer.cond);
+		return -ret;
+	}
+
+	g_syncer.has_thread = true;
+	return 0;
+}
+
+
+/*
+ * Commits whatever is still queued, must be called after
+ * the event loops have stopped.
+ */
+void syncer_stop(void)
+{
+	if (g_syncer.has_thread) {
+		pthread_mutex_lock(&g_syncer.lock);
+		g_syncer.stop = true;
+		pthread_cond_signal(&g_syncer.cond);
+		pthread_mutex_unlock(&g_syncer.lock);
+		pthread_join(g_syncer.thread, NULL);
+		pthread_cond_destroy(&g_syncer.cond);
+		g_syncer.has_thread = false;
+	}
+
+	if (g_syncer.dir_fd != -1) {
+		close(g_syncer.dir_fd);
+		g_syncer.dir_fd = -1;
+	}
+
+	free(g_syncer.pending);
+	g_syncer.pending     = NULL;
+	g_syncer.nr_pending  = 0;
+	g_syncer.cap_pending = 0;
+}
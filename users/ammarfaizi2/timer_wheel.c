@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer server (hierarchical timer wheel)
+ *
+ * Cascading timer wheel, O(1) add and delete. Timers on the outer
+ * levels are moved one level down each time the level below wraps,
+ * so every timer is cascaded at most TW_LEVELS - 1 times.
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef _DEFAULT_SOURCE
+#  define _DEFAULT_SOURCE
+#endif
+
+#include <string.h>
+
+#include "server.h"
+
+
+#define TW_INDEX(WHEEL, N) \
+	(((WHEEL)->now >> ((N) * TW_BITS)) & TW_MASK)
+
+
+static void tw_link(struct tw_timer **slot, struct tw_timer *timer)
+{
+	timer->next = *slot;
+	if (*slot)
+		(*slot)->pprev = &timer->next;
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+
+static void tw_internal_add(struct timer_wheel *wheel, struct tw_timer *timer)
+{
+	uint64_t max;
+	uint64_t expires = timer->expires;
+	uint64_t delta = expires - wheel->now;
+	struct tw_timer **slot;
+
+	if ((int64_t)delta < 0) {
+		/*
+		 * Already expired, run it on the next tick.
+		 */
+		slot = &wheel->slots[0][wheel->now & TW_MASK];
+		goto out;
+	}
+
+	for (uint32_t lvl = 0; lvl < TW_LEVELS; lvl++) {
+		if (delta < (1ull << ((lvl + 1u) * TW_BITS))) {
+			slot = &wheel->slots[lvl][(expires >> (lvl * TW_BITS)) &
+						  TW_MASK];
+			goto out;
+		}
+	}
+
+	/*
+	 * Too far in the future, clamp it to the last level.
+	 */
+	max = (1ull << (TW_LEVELS * TW_BITS)) - 1u;
+	timer->expires = wheel->now + max;
+	slot = &wheel->slots[TW_LEVELS - 1u]
+			    [(timer->expires >> ((TW_LEVELS - 1u) * TW_BITS)) &
+			     TW_MASK];
+out:
+	tw_link(slot, timer);
+}
+
+
+void tw_add(struct timer_wheel *wheel, struct tw_timer *timer,
+	    uint64_t expires)
+{
+	if (tw_pending(timer))
+		tw_del(wheel, timer);
+
+	timer->expires = expires;
+	tw_internal_add(wheel, timer);
+	wheel->nr_timers++;
+}
+
+
+void tw_del(struct timer_wheel *wheel, struct tw_timer *timer)
+{
+	if (!tw_pending(timer))
+		return;
+
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->next  = NULL;
+	timer->pprev = NULL;
+	wheel->nr_timers--;
+}
+
+
+static uint32_t tw_cascade(struct timer_wheel *wheel, uint32_t lvl)
+{
+	uint32_t idx = TW_INDEX(wheel, lvl);
+	struct tw_timer *timer, *next;
+
+	timer = wheel->slots[lvl][idx];
+	wheel->slots[lvl][idx] = NULL;
+	for (; timer; timer = next) {
+		next = timer->next;
+		tw_internal_add(wheel, timer);
+	}
+
+	return idx;
+}
+
+
+void tw_advance(struct timer_wheel *wheel, uint64_t now,
+		void (*expire)(struct tw_timer *timer, void *arg), void *arg)
+{
+	uint32_t idx;
+	struct tw_timer *timer, *expired;
+
+	while (wheel->now <= now) {
+		if (wheel->nr_timers == 0) {
+			/*
+			 * Nothing to cascade or run, just catch up.
+			 */
+			wheel->now = now + 1u;
+			break;
+		}
+
+		idx = wheel->now & TW_MASK;
+		if (idx == 0) {
+			for (uint32_t lvl = 1; lvl < TW_LEVELS; lvl++) {
+				if (tw_cascade(wheel, lvl))
+					break;
+			}
+		}
+
+		/*
+		 * Detach the slot first, the expire callback may
+		 * re-arm a timer into the same slot one lap later.
+		 */
+		expired = wheel->slots[0][idx];
+		wheel->slots[0][idx] = NULL;
+		if (expired)
+			expired->pprev = &expired;
+
+		wheel->now++;
+		while ((timer = expired) != NULL) {
+			tw_del(wheel, timer);
+			expire(timer, arg);
+		}
+	}
+}
+
+
+void tw_init(struct timer_wheel *wheel, uint64_t now)
+{
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->now = now;
+}
@@ -0,0 +1,423 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer server (disk writer pool)
+ *
+ * The epoll event loops hand filled receive buffers to a pool of
+ * writer threads, a slow disk then only stalls the channels that
+ * write to it instead of every recv() of the shard.
+ *
+ * Every (shard, writer) pair has a single producer single consumer
+ * submission ring and a completion ring going back, no locks are
+ * taken on either side. A channel always goes to the same writer,
+ * so its writes complete in order.
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include "server.h"
+
+
+struct wr_job {
+	union uni_pkt		*buf;		/* Owned by the shard pool    */
+	int			fd;		/* Destination file           */
+	uint32_t		len;		/* Bytes in buf               */
+	uint32_t		chan_idx;	/* Owner channel              */
+	uint32_t		buf_class;	/* Pool the buffer belongs to */
+	int			err;		/* Completion: 0 or -errno    */
+	uint64_t		off;		/* File offset                */
+};
+
+/*
+ * head is only written by the consumer and tail only by the
+ * producer, keep them on different cache lines.
+ */
+struct wr_ring {
+	_Alignas(64) uint32_t	head;
+	_Alignas(64) uint32_t	tail;
+	_Alignas(64) struct wr_job jobs[WR_RING_SIZE];
+};
+
+/*
+ * Rings of one (shard, writer) pair.
+ */
+struct wr_pair {
+	struct wr_ring		sq;		/* shard -> writer            */
+	struct wr_ring		cq;		/* writer -> shard            */
+	uint32_t		pending;	/* Shard side: not reaped yet */
+};
+
+struct wr_thread {
+	pthread_t		thread;
+	bool			has_thread;
+	int			event_fd;	/* Wakes a sleeping writer    */
+	uint32_t		sleeping;	/* Waiting on event_fd?       */
+	uint32_t		idx;
+};
+
+struct wr_pool {
+	struct server_state	*shards;
+	uint32_t		nr_shards;
+	uint32_t		nr_writers;
+	bool			stop;
+	struct wr_thread	*threads;
+};
+
+static struct wr_pool g_pool;
+
+
+static inline uint32_t ring_load(const uint32_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+
+static inline void ring_store(uint32_t *p, uint32_t val)
+{
+	__atomic_store_n(p, val, __ATOMIC_RELEASE);
+}
+
+
+static inline bool ring_empty(struct wr_ring *ring)
+{
+	return ring_load(&ring->tail) == ring->head;
+}
+
+
+static void ring_push(struct wr_ring *ring, const struct wr_job *job)
+{
+	uint32_t tail = ring->tail;
+
+	ring->jobs[tail & (WR_RING_SIZE - 1u)] = *job;
+	ring_store(&ring->tail, tail + 1u);
+}
+
+
+static bool ring_pop(struct wr_ring *ring, struct wr_job *job)
+{
+	uint32_t head = ring->head;
+
+	if (ring_load(&ring->tail) == head)
+		return false;
+
+	*job = ring->jobs[head & (WR_RING_SIZE - 1u)];
+	ring_store(&ring->head, head + 1u);
+	return true;
+}
+
+
+static void kick_event_fd(int fd)
+{
+	uint64_t val = 1;
+
+	if (write(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		pr_err("write(eventfd): %s\n", strerror(errno));
+}
+
+
+static inline struct wr_pair *get_pair(struct server_state *state,
+				       uint32_t writer)
+{
+	return &state->wr_pairs[writer];
+}
+
+
+int pwrite_full(int fd, const char *buf, size_t len, uint64_t off)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < len) {
+		ret = pwrite(fd, buf + done, len - done, (off_t)(off + done));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -EIO;
+		done += (size_t)ret;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Returns the number of jobs done.
+ */
+static uint32_t run_writer_once(struct wr_thread *thr)
+{
+	bool done_any;
+	uint32_t nr = 0;
+	struct wr_job job;
+	struct wr_pair *pair;
+	struct server_state *state;
+
+	for (uint32_t i = 0; i < g_pool.nr_shards; i++) {
+		state = &g_pool.shards[i];
+		pair = get_pair(state, thr->idx);
+		done_any = false;
+		while (ring_pop(&pair->sq, &job)) {
+			job.err = pwrite_full(job.fd, job.buf->raw_buf, job.len,
+					      job.off);
+			ring_push(&pair->cq, &job);
+			done_any = true;
+			nr++;
+		}
+
+		/*
+		 * One wake up per shard per round, not one per job.
+		 */
+		if (done_any)
+			kick_event_fd(state->wr_event_fd);
+	}
+
+	return nr;
+}
+
+
+static bool writer_has_work(struct wr_thread *thr)
+{
+	for (uint32_t i = 0; i < g_pool.nr_shards; i++) {
+		if (!ring_empty(&get_pair(&g_pool.shards[i], thr->idx)->sq))
+			return true;
+	}
+
+	return false;
+}
+
+
+static void *run_writer(void *arg)
+{
+	uint64_t val;
+	struct wr_thread *thr = arg;
+
+	for (;;) {
+		if (run_writer_once(thr))
+			continue;
+
+		/*
+		 * Announce that we are going to sleep, then look
+		 * at the rings once more. A producer either sees
+		 * the flag or we see its job. The fence pairs with
+		 * the one in writer_submit().
+		 */
+		__atomic_store_n(&thr->sleeping, 1u, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (writer_has_work(thr)) {
+			__atomic_store_n(&thr->sleeping, 0u, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (__atomic_load_n(&g_pool.stop, __ATOMIC_ACQUIRE))
+			break;
+
+		if (read(thr->event_fd, &val, sizeof(val)) < 0 &&
+		    errno != EINTR) {
+			pr_err("read(eventfd): %s\n", strerror(errno));
+			break;
+		}
+		__atomic_store_n(&thr->sleeping, 0u, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Returns -EAGAIN if the ring of this channel is full.
+ */
+int writer_submit(struct server_state *state, struct client_channel *chan,
+		  union uni_pkt *buf, uint32_t len, uint64_t off)
+{
+	struct wr_job job;
+	struct wr_thread *thr;
+	uint32_t writer = chan->arr_idx % g_pool.nr_writers;
+	struct wr_pair *pair = get_pair(state, writer);
+
+	/*
+	 * Completions that are not reaped yet still hold a
+	 * slot, so the completion ring can never overflow.
+	 */
+	if (pair->pending >= WR_RING_SIZE)
+		return -EAGAIN;
+
+	job.buf       = buf;
+	job.fd        = fileno(chan->handle);
+	job.len       = len;
+	job.chan_idx  = chan->arr_idx;
+	job.buf_class = chan->buf_class;
+	job.err       = 0;
+	job.off       = off;
+	ring_push(&pair->sq, &job);
+	pair->pending++;
+
+	thr = &g_pool.threads[writer];
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&thr->sleeping, __ATOMIC_RELAXED))
+		kick_event_fd(thr->event_fd);
+
+	return 0;
+}
+
+
+/*
+ * Called from the shard event loop when wr_event_fd is
+ * readable, and once more at shutdown.
+ */
+void writer_reap(struct server_state *state)
+{
+	uint64_t val;
+	struct wr_job job;
+	struct wr_pair *pair;
+	struct client_channel *chan;
+
+	if (state->wr_event_fd == -1)
+		return;
+
+	if (read(state->wr_event_fd, &val, sizeof(val)) < 0 &&
+	    errno != EAGAIN)
+		pr_err("read(eventfd): %s\n", strerror(errno));
+
+	for (uint32_t i = 0; i < g_pool.nr_writers; i++) {
+		pair = get_pair(state, i);
+		while (ring_pop(&pair->cq, &job)) {
+			pair->pending--;
+			chan = get_channel(state, job.chan_idx);
+			buf_pool_put(&state->buf_pools[job.buf_class], job.buf);
+			complete_channel_write(state, chan, job.len, job.err);
+		}
+	}
+}
+
+
+int writer_init_shard(struct server_state *state)
+{
+	int err;
+	uint32_t nr = state->cfg->nr_writers;
+
+	state->wr_event_fd = -1;
+	if (nr == 0)
+		return 0;
+
+	state->wr_pairs = aligned_alloc(64, nr * sizeof(*state->wr_pairs));
+	if (state->wr_pairs == NULL) {
+		pr_err("aligned_alloc(): %s\n", strerror(ENOMEM));
+		return -ENOMEM;
+	}
+	memset(state->wr_pairs, 0, nr * sizeof(*state->wr_pairs));
+
+	state->wr_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (state->wr_event_fd < 0) {
+		err = errno;
+		pr_err("eventfd(): %s\n", strerror(err));
+		return -err;
+	}
+
+	return 0;
+}
+
+
+void writer_destroy_shard(struct server_state *state)
+{
+	if (state->wr_event_fd != -1) {
+		close(state->wr_event_fd);
+		state->wr_event_fd = -1;
+	}
+
+	free(state->wr_pairs);
+	state->wr_pairs = NULL;
+}
+
+
+int writer_start(struct server_state *shards, uint32_t nr_shards,
+		 const struct server_cfg *cfg)
+{
+	int ret;
+	sigset_t set, old;
+	struct wr_thread *thr;
+
+	g_pool.shards     = shards;
+	g_pool.nr_shards  = nr_shards;
+	g_pool.nr_writers = cfg->nr_writers;
+	g_pool.stop       = false;
+	if (cfg->nr_writers == 0)
+		return 0;
+
+	g_pool.threads = calloc(cfg->nr_writers, sizeof(*g_pool.threads));
+	if (g_pool.threads == NULL) {
+		pr_err("calloc(): %s\n", strerror(ENOMEM));
+		return -ENOMEM;
+	}
+
+	for (uint32_t i = 0; i < cfg->nr_writers; i++)
+		g_pool.threads[i].event_fd = -1;
+
+	for (uint32_t i = 0; i < cfg->nr_writers; i++) {
+		thr = &g_pool.threads[i];
+		thr->idx = i;
+		thr->event_fd = eventfd(0, EFD_CLOEXEC);
+		if (thr->event_fd < 0) {
+			ret = errno;
+			pr_err("eventfd(): %s\n", strerror(ret));
+			return -ret;
+		}
+	}
+
+	/*
+	 * Signals are handled by the main thread.
+	 */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	for (uint32_t i = 0; i < cfg->nr_writers; i++) {
+		thr = &g_pool.threads[i];
+		ret = pthread_create(&thr->thread, NULL, run_writer, thr);
+		if (ret) {
+			pr_err("pthread_create(): %s\n", strerror(ret));
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			return -ret;
+		}
+		thr->has_thread = true;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return 0;
+}
+
+
+/*
+ * Must be called after the event loops have stopped, every
+ * queued job is written before the writers exit.
+ */
+void writer_stop(void)
+{
+	struct wr_thread *thr;
+
+	if (g_pool.threads == NULL)
+		return;
+
+	__atomic_store_n(&g_pool.stop, true, __ATOMIC_RELEASE);
+	for (uint32_t i = 0; i < g_pool.nr_writers; i++) {
+		thr = &g_pool.threads[i];
+		if (thr->has_thread) {
+			kick_event_fd(thr->event_fd);
+			pthread_join(thr->thread, NULL);
+		}
+		if (thr->event_fd != -1)
+			close(thr->event_fd);
+	}
+
+	free(g_pool.threads);
+	g_pool.threads = NULL;
+}
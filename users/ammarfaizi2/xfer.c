@@ -0,0 +1,231 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Simple file transfer server (multi-stream transfers)
+ *
+ * A big file can be sent as byte ranges over several connections,
+ * which land on any shard. The ranges of one file share a transfer
+ * that is looked up by the client chosen id. The file is complete
+ * once the ranges add up to its size.
+ *
+ * The ranges of a transfer must not overlap. A transfer whose
+ * streams are all gone stays around for XFER_LINGER_SEC, so a
+ * range that is sent again still counts towards the same file.
+ *
+ * Copyright (C) 2021  Ammar Faizi <ammarfaizi2@gmail.com>
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "server.h"
+
+#define XFER_LINGER_SEC		(300u)
+#define XFER_MAX		(4096u)
+
+
+struct xfer {
+	struct xfer		*next;
+	uint64_t		id;		/* Chosen by the client       */
+	uint64_t		file_size;	/* Size of the whole file     */
+	uint64_t		done;		/* Bytes of completed ranges  */
+	uint64_t		idle_us;	/* When refs dropped to zero  */
+	uint32_t		refs;		/* Attached channels          */
+	bool			listed;		/* Can still be looked up?    */
+	char			path[1024];
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	struct xfer		*head;
+	uint32_t		nr;
+} g_xfers = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static void unlist_xfer(struct xfer **pprev)
+{
+	struct xfer *x = *pprev;
+
+	*pprev = x->next;
+	x->next = NULL;
+	x->listed = false;
+	g_xfers.nr--;
+}
+
+
+/*
+ * Drop the transfers nobody came back for. Caller holds the lock.
+ */
+static void sweep_xfers(uint64_t now)
+{
+	struct xfer *x;
+	struct xfer **pprev = &g_xfers.head;
+
+	while ((x = *pprev) != NULL) {
+		if (x->refs == 0 &&
+		    now - x->idle_us >= XFER_LINGER_SEC * 1000000ull) {
+			pr_info("Dropping incomplete transfer %016" PRIx64
+				" of \"%s\"\n", x->id, x->path);
+			unlist_xfer(pprev);
+			free(x);
+			continue;
+		}
+		pprev = &x->next;
+	}
+}
+
+
+/*
+ * The first range creates the file. It isn't truncated to zero,
+ * a range sent again must not wipe the ones that are already in.
+ */
+static int create_xfer_file(const char *path, uint64_t file_size)
+{
+	int fd;
+	int err = 0;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		err = errno;
+		pr_info("Cannot create file: %s: %s\n", path, strerror(err));
+		return -err;
+	}
+
+	if (ftruncate(fd, (off_t)file_size) < 0) {
+		err = errno;
+		pr_err("ftruncate(\"%s\"): %s\n", path, strerror(err));
+	}
+
+	close(fd);
+	return -err;
+}
+
+
+int xfer_get(struct xfer **out, uint64_t id, const char *path,
+	     uint64_t file_size, bool *created)
+{
+	int ret = 0;
+	struct xfer *x;
+
+	*created = false;
+	pthread_mutex_lock(&g_xfers.lock);
+	sweep_xfers(stats_now_us());
+	for (x = g_xfers.head; x != NULL; x = x->next) {
+		if (x->id == id)
+			break;
+	}
+
+	if (x != NULL) {
+		if (x->file_size != file_size || strcmp(x->path, path)) {
+			pr_err("Transfer %016" PRIx64 " already carries \"%s\"\n",
+			       id, x->path);
+			ret = -EINVAL;
+			goto out;
+		}
+		goto out_ref;
+	}
+
+	if (g_xfers.nr >= XFER_MAX) {
+		pr_err_ratelimited("Too many transfers in progress\n");
+		ret = -EBUSY;
+		goto out;
+	}
+
+	x = calloc(1, sizeof(*x));
+	if (x == NULL) {
+		pr_err("calloc(): %s\n", strerror(ENOMEM));
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = create_xfer_file(path, file_size);
+	if (ret) {
+		free(x);
+		goto out;
+	}
+
+	x->id        = id;
+	x->file_size = file_size;
+	x->listed    = true;
+	snprintf(x->path, sizeof(x->path), "%s", path);
+	x->next      = g_xfers.head;
+	g_xfers.head = x;
+	g_xfers.nr++;
+	*created     = true;
+out_ref:
+	x->refs++;
+	*out = x;
+out:
+	pthread_mutex_unlock(&g_xfers.lock);
+	return ret;
+}
+
+
+/*
+ * Returns true for the range that completes the file.
+ */
+bool xfer_range_done(struct xfer *x, uint64_t len)
+{
+	bool complete = false;
+	struct xfer **pprev;
+
+	pthread_mutex_lock(&g_xfers.lock);
+	x->done += len;
+	if (x->listed && x->done >= x->file_size) {
+		/*
+		 * A new transfer may reuse the id from now on.
+		 */
+		for (pprev = &g_xfers.head; *pprev != x;)
+			pprev = &(*pprev)->next;
+		unlist_xfer(pprev);
+		complete = true;
+	}
+	pthread_mutex_unlock(&g_xfers.lock);
+	return complete;
+}
+
+
+uint64_t xfer_file_size(const struct xfer *x)
+{
+	/*
+	 * Never changes after xfer_get().
+	 */
+	return x->file_size;
+}
+
+
+void xfer_put(struct xfer *x)
+{
+	pthread_mutex_lock(&g_xfers.lock);
+	if (--x->refs == 0) {
+		if (!x->listed)
+			free(x);
+		else
+			x->idle_us = stats_now_us();
+	}
+	pthread_mutex_unlock(&g_xfers.lock);
+}
+
+
+void xfer_destroy(void)
+{
+	struct xfer *x;
+
+	pthread_mutex_lock(&g_xfers.lock);
+	while ((x = g_xfers.head) != NULL) {
+		g_xfers.head = x->next;
+		free(x);
+	}
+	g_xfers.nr = 0;
+	pthread_mutex_unlock(&g_xfers.lock);
+}
@@ -7,14 +7,18 @@
 
 #include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <netdb.h>
@@ -33,6 +37,10 @@ struct client {
 
 
 /* function declarations */
+static long now_ms           (void)                           ;
+static int  order_addrs      (struct addrinfo *ai,
+			      struct addrinfo *out[])         ;
+static int  start_connect    (const struct addrinfo *ai)      ;
 static void connect_to_server(struct client *c)               ;
 static void set_file_prop    (struct client *c)               ;
 static int  send_all         (const char *buffer,
@@ -46,11 +54,92 @@ extern int is_interrupted;
 
 
 /*function implementations */
+static long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ * IPv6 and IPv4 take turns, starting with the family getaddrinfo()
+ * put first (RFC 8305)
+ */
+static int
+order_addrs(struct addrinfo *ai, struct addrinfo *out[])
+{
+	int n = 0;
+	int first = ai->ai_family;
+	struct addrinfo *a = ai, *b = ai;
+
+	while (n < CONNECT_MAX) {
+		while (a != NULL && a->ai_family != first)
+			a = a->ai_next;
+		while (b != NULL && b->ai_family == first)
+			b = b->ai_next;
+
+		if (a == NULL && b == NULL)
+			break;
+
+		if (a != NULL) {
+			out[n++] = a;
+			a = a->ai_next;
+		}
+
+		if (b != NULL && n < CONNECT_MAX) {
+			out[n++] = b;
+			b = b->ai_next;
+		}
+	}
+
+	return n;
+}
+
+
+/*
+ * Returns a socket with connect() in progress, or -1
+ */
+static int
+start_connect(const struct addrinfo *ai)
+{
+	int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+			ai->ai_protocol);
+
+	if (fd < 0) {
+		PERROR("connect_to_server(): socket");
+
+		return -1;
+	}
+
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 &&
+						errno != EINPROGRESS) {
+		PERROR("connect_to_server(): connect");
+		close(fd);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/*
+ * Races the addresses: a new one starts every CONNECT_STAGGER ms,
+ * or right away once the ones in flight failed. The first one
+ * that connects wins.
+ */
 static void
 connect_to_server(struct client *c)
 {
-	int ret = 0, rv;
-	struct addrinfo hints = {0}, *ai, *p = NULL;
+	int ret = -1, rv, err, i, n_addrs = 0, n_fds = 0, next = 0;
+	long now, deadline, next_start, wait;
+	socklen_t len = sizeof(err);
+	struct pollfd fds[CONNECT_MAX];
+	struct addrinfo hints = {0}, *ai, *addrs[CONNECT_MAX];
 
 	hints.ai_family   = AF_UNSPEC;   /* IPv4 or IPv6 */
 	hints.ai_socktype = SOCK_STREAM; /* TCP */
@@ -62,34 +151,86 @@ connect_to_server(struct client *c)
 		goto btm;
 	}
 
-	for (p = ai; p != NULL; p = p->ai_next) {
-		ret = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+	n_addrs    = order_addrs(ai, addrs);
+	now        = now_ms();
+	deadline   = now + CONNECT_TIMEOUT;
+	next_start = now;
 
-		if (ret < 0) {
-			PERROR("connect_to_server(): socket");
+	while (ret < 0 && is_interrupted == 0) {
+		now = now_ms();
 
-			continue;
+		if (now >= deadline) {
+			FPERROR("connect_to_server(): Timed out\n");
+
+			break;
 		}
 
-		if (connect(ret, p->ai_addr, p->ai_addrlen) < 0) {
-			PERROR("connect_to_server(): connect");
-			close(ret);
+		if (next < n_addrs && (now >= next_start || n_fds == 0)) {
+			rv         = start_connect(addrs[next++]);
+			next_start = now;
+
+			if (rv < 0)
+				continue;
+
+			fds[n_fds].fd     = rv;
+			fds[n_fds].events = POLLOUT;
+			n_fds++;
+			next_start = now + CONNECT_STAGGER;
 
 			continue;
 		}
 
-		break;
+		if (n_fds == 0)
+			break;
+
+		wait = deadline - now;
+		if (next < n_addrs && next_start - now < wait)
+			wait = next_start - now;
+
+		if (poll(fds, (nfds_t)n_fds, (int)wait) <= 0)
+			continue;
+
+		for (i = 0; i < n_fds; i++) {
+			if (fds[i].revents == 0)
+				continue;
+
+			if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR,
+						&err, &len) < 0)
+				err = errno;
+
+			if (err == 0) {
+				ret      = fds[i].fd;
+				fds[i]   = fds[--n_fds];
+
+				break;
+			}
+
+			errno = err;
+			PERROR("connect_to_server(): connect");
+			close(fds[i].fd);
+
+			/* don't wait for the stagger */
+			fds[i--]   = fds[--n_fds];
+			next_start = now;
+		}
 	}
 
+	for (i = 0; i < n_fds; i++)
+		close(fds[i].fd);
+
 	freeaddrinfo(ai);
 
 btm:
-	if (p == NULL) {
+	if (ret < 0) {
 		FPERROR("connect_to_server(): Failed to connect\n");
 
 		exit(1);
 	}
 
+	/* send_all() blocks, send_file() checks errno at the end */
+	fcntl(ret, F_SETFL, fcntl(ret, F_GETFL) & ~O_NONBLOCK);
+	errno = 0;
+
 	INFO("Connected to server\n");
 
 	c->tcp_fd = ret;
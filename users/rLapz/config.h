@@ -6,6 +6,10 @@
 #define INIT_CLIENT_SIZE  5
 #define MAX_CLIENTS       100u
 
+#define CONNECT_TIMEOUT   10000 /* ms, connect_to_server() gives up */
+#define CONNECT_STAGGER   250   /* ms between racing addresses      */
+#define CONNECT_MAX       16    /* addresses to try                 */
+
 
 /* colors */
 #define BOLD_GREEN(TEXT)  "\x1b[01;32m" TEXT "\x1b[00m"